@@ -0,0 +1,105 @@
+#include <string.h>
+#include "histogram.h"
+
+#define HALF_BUCKETS (HISTOGRAM_SUB_BUCKETS / 2)
+
+
+/*
+ * Index of the bucket counting a value: the value itself if it is small,
+ * else its top HISTOGRAM_SUB_BITS - 1 bits after the leading one, offset
+ * by its power of two.
+ */
+static int bucket_index(uint64_t value) {
+	int shift;
+
+	if (value < HISTOGRAM_SUB_BUCKETS)
+		return value;
+
+	shift = 63 - __builtin_clzll(value) - (HISTOGRAM_SUB_BITS - 1);
+	if (shift > HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS)
+		return HISTOGRAM_BUCKETS - 1;
+	return HISTOGRAM_SUB_BUCKETS + (shift - 1) * HALF_BUCKETS + (int) (value >> shift) - HALF_BUCKETS;
+}
+
+/*
+ * Value reported for a bucket, the middle of the values it counts.
+ */
+static uint64_t bucket_value(int index) {
+	int shift;
+
+	if (index < HISTOGRAM_SUB_BUCKETS)
+		return index;
+
+	shift = (index - HISTOGRAM_SUB_BUCKETS) / HALF_BUCKETS + 1;
+	return ((uint64_t) ((index - HISTOGRAM_SUB_BUCKETS) % HALF_BUCKETS + HALF_BUCKETS) << shift) +
+		((uint64_t) 1 << (shift - 1));
+}
+
+
+void histogram_init(histogram *h) {
+	memset(h, 0, sizeof(histogram));
+	h->min = UINT64_MAX;
+}
+
+
+/*
+ * Counts a value, e.g. a latency in microseconds.
+ */
+void histogram_record(histogram *h, uint64_t value) {
+	h->counts[bucket_index(value)]++;
+	h->total++;
+	h->sum += value;
+	if (value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+}
+
+
+/*
+ * Adds the values counted in src to dst.
+ */
+void histogram_merge(histogram *dst, histogram *src) {
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		dst->counts[i] += src->counts[i];
+	dst->total += src->total;
+	dst->sum += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+
+/*
+ * Input:
+ *  - h: histogram
+ *  - percentile: between 0 and 100
+ * Returns: the value below which percentile % of the values fall, within
+ *  the precision of its bucket, or 0 if the histogram is empty
+ */
+uint64_t histogram_percentile(histogram *h, double percentile) {
+	uint64_t rank, seen = 0;
+
+	if (h->total == 0)
+		return 0;
+	if (percentile >= 100)
+		return h->max;
+
+	rank = (uint64_t) (percentile / 100 * h->total);
+	if (rank == 0)
+		rank = 1;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= rank) {
+			uint64_t value = bucket_value(i);
+			return value > h->max ? h->max : (value < h->min ? h->min : value);
+		}
+	}
+	return h->max;
+}
+
+
+double histogram_mean(histogram *h) {
+	return h->total ? (double) h->sum / h->total : 0;
+}
@@ -0,0 +1,33 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Latency histogram in the style of HdrHistogram: values below
+ * HISTOGRAM_SUB_BUCKETS are counted exactly, larger ones in buckets that
+ * double in width with each power of two, keeping about 1% precision
+ * (HISTOGRAM_SUB_BUCKETS / 2 buckets per power of two) up to 2^HISTOGRAM_MAX_BITS.
+ */
+
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS + \
+	(HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS) * (HISTOGRAM_SUB_BUCKETS / 2))
+
+typedef struct histogram {
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t total;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+} histogram;
+
+void histogram_init(histogram *h);
+void histogram_record(histogram *h, uint64_t value);
+void histogram_merge(histogram *dst, histogram *src);
+uint64_t histogram_percentile(histogram *h, double percentile);
+double histogram_mean(histogram *h);
+
+#endif /* HISTOGRAM_H */
@@ -0,0 +1,564 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "tecnicofs-client-api.h"
+#include "histogram.h"
+#include "../tecnicofs-api-constants.h"
+
+#define MAX_PROCESSES 64
+/* operation types with their own histogram, the last one counts the others */
+#define OP_TYPES "cdlmp"
+#define NUM_TYPES (sizeof(OP_TYPES))
+
+/* tree generated workloads run against: TREE_DIRS directories of TREE_FILES files */
+#define TREE_DIRS 4
+#define TREE_FILES 6
+/* commands generated for each worker */
+#define GEN_COMMANDS 1000
+/*
+ * each worker of a generated workload adds at most one file to the tree,
+ * which with the tree must fit the 50 i-nodes and 20 entries per directory
+ * of the server
+ */
+#define GEN_MAX_WORKERS 16
+
+/*
+ * A command read from an input file
+ */
+typedef struct command {
+	char op;
+	char arg1[MAX_INPUT_SIZE], arg2[MAX_INPUT_SIZE];
+} command;
+
+/*
+ * A generated workload: percentages of lookups of the tree, of creates and
+ * deletes of the file of each worker, and of moves of that file between
+ * two directories
+ */
+typedef struct mix {
+	char *name;
+	int lookups;
+	int changes;
+	int moves;
+} mix;
+
+mix mixes[] = {
+	{ "lookup", 90, 10, 0 },
+	{ "create", 20, 80, 0 },
+	{ "move", 20, 10, 70 },
+};
+
+/*
+ * Results of the commands of a worker, or of all of them once merged
+ */
+typedef struct stats {
+	histogram latency[NUM_TYPES]; /* microseconds */
+	uint64_t errors[NUM_TYPES];
+} stats;
+
+/*
+ * A thread replaying an input file over its own mount of the server
+ */
+typedef struct worker {
+	int id;
+	command *commands;
+	int numberCommands;
+	tfsHandle *fs;
+	stats results;
+
+	/* open loop: requests waiting for their callback */
+	int outstanding;
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+} worker;
+
+/*
+ * An asynchronous request of the open loop, freed by its callback
+ */
+typedef struct sentRequest {
+	worker *w;
+	int type;
+	long intended; /* microseconds */
+} sentRequest;
+
+char *serverName;
+command **files;
+int *fileSizes;
+int numberFiles = 0;
+
+int numberThreads = 1;
+int numberProcesses = 1;
+int loops = 1;
+double rate = 0; /* ops per second of all workers, 0 for a closed loop */
+int uniquePaths = 0;
+mix *workload = NULL; /* generated instead of read from input files */
+
+
+static void displayUsage(const char* appName) {
+	printf("Usage: %s [-t threads] [-P processes] [-r opsPerSecond] [-n loops] [-u] server_socket_name inputfile...\n", appName);
+	printf("       %s [-t threads] [-P processes] [-r opsPerSecond] [-n loops] -g mix server_socket_name\n", appName);
+	printf("  -t: threads per process, each replaying an input file over its own mount (default 1)\n");
+	printf("  -P: processes, worker w replays inputfile w modulo the number of files (default 1)\n");
+	printf("  -r: open loop at this total rate, latencies counted from the intended send time\n");
+	printf("      (default 0, closed loop: each worker waits for a reply before the next command)\n");
+	printf("  -n: times each worker replays its file (default 1)\n");
+	printf("  -u: give each worker its own directory, so workers replaying a file don't collide\n");
+	printf("  -g: generate %d commands per worker against a tree created first, mix lookup, create or move\n",
+		GEN_COMMANDS);
+	exit(EXIT_FAILURE);
+}
+
+static long now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static int typeIndex(char op) {
+	char *c = strchr(OP_TYPES, op);
+	return (c != NULL && op != '\0') ? c - OP_TYPES : NUM_TYPES - 1;
+}
+
+/*
+ * Reads the commands of an input file, in the format of tecnicofs-client.
+ * Input:
+ *  - path: input file
+ *  - commands: set to the array of commands read
+ * Returns: number of commands, exits if the file can't be read
+ */
+static int readCommands(char *path, command **commands) {
+	FILE *inputFile = fopen(path, "r");
+	char line[MAX_INPUT_SIZE];
+	int n = 0, size = 64;
+
+	if (inputFile == NULL) {
+		fprintf(stderr, "Error: cannot open input file %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	*commands = malloc(sizeof(command) * size);
+	while (fgets(line, sizeof(line)/sizeof(char), inputFile)) {
+		command *cmd;
+
+		if (n == size) {
+			size *= 2;
+			*commands = realloc(*commands, sizeof(command) * size);
+		}
+		cmd = &(*commands)[n];
+		cmd->arg2[0] = '\0';
+		if (sscanf(line, "%c %s %s", &cmd->op, cmd->arg1, cmd->arg2) < 2 || cmd->op == '#')
+			continue;
+		n++;
+	}
+	fclose(inputFile);
+	return n;
+}
+
+/*
+ * Generates the commands of a worker for a workload, the same ones for the
+ * same worker on every run. The file of the worker lives in directory
+ * id modulo TREE_DIRS and is moved to the next one and back, so that every
+ * directory holds the files of at most two workers in GEN_MAX_WORKERS.
+ * The file is deleted at the end, so that the commands can be replayed.
+ * Input:
+ *  - id: index of the worker
+ *  - m: the workload
+ *  - commands: set to the array of commands generated
+ * Returns: number of commands
+ */
+static int generateCommands(int id, mix *m, command **commands) {
+	unsigned seed = id + 1;
+	int n = 0, dir = -1; /* of the file of the worker, -1 while it doesn't exist */
+
+	*commands = malloc(sizeof(command) * (GEN_COMMANDS + 1));
+	while (n < GEN_COMMANDS || dir >= 0) {
+		command *cmd = &(*commands)[n];
+		int r = n < GEN_COMMANDS ? rand_r(&seed) % 100 : 100; /* past them, only the delete */
+
+		n++;
+		cmd->arg2[0] = '\0';
+		if (r < m->lookups) {
+			cmd->op = 'l';
+			sprintf(cmd->arg1, "/tree/d%d/f%d", rand_r(&seed) % TREE_DIRS, rand_r(&seed) % TREE_FILES);
+		} else if (dir < 0) {
+			dir = id % TREE_DIRS;
+			cmd->op = 'c';
+			sprintf(cmd->arg1, "/tree/d%d/w%d", dir, id);
+			strcpy(cmd->arg2, "f");
+		} else if (r < m->lookups + m->changes || r == 100) {
+			cmd->op = 'd';
+			sprintf(cmd->arg1, "/tree/d%d/w%d", dir, id);
+			dir = -1;
+		} else {
+			cmd->op = 'm';
+			sprintf(cmd->arg1, "/tree/d%d/w%d", dir, id);
+			dir = dir == id % TREE_DIRS ? (id + 1) % TREE_DIRS : id % TREE_DIRS;
+			sprintf(cmd->arg2, "/tree/d%d/w%d", dir, id);
+		}
+	}
+	return n;
+}
+
+/*
+ * Creates the tree generated workloads run against, unless it exists.
+ */
+static void createTree() {
+	tfsHandle *fs = tfsMount(serverName);
+	char path[MAX_INPUT_SIZE];
+
+	if (fs == NULL) {
+		fprintf(stderr, "Unable to mount socket: %s\n", serverName);
+		exit(EXIT_FAILURE);
+	}
+	for (int d = -1; d < TREE_DIRS; d++) {
+		for (int f = -1; f < (d < 0 ? 0 : TREE_FILES); f++) {
+			if (d < 0)
+				strcpy(path, "/tree");
+			else if (f < 0)
+				sprintf(path, "/tree/d%d", d);
+			else
+				sprintf(path, "/tree/d%d/f%d", d, f);
+			if (tfsCreate(fs, path, f < 0 ? 'd' : 'f') < 0 && tfsLookup(fs, path) < 0) {
+				fprintf(stderr, "Error: can't create %s\n", path);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	tfsUnmount(fs);
+}
+
+/*
+ * Moves a path below the directory of a worker, for -u.
+ */
+static void prefixPath(char *dst, worker *w, char *path) {
+	snprintf(dst, MAX_INPUT_SIZE, "/bench%d_%d%s%s", getpid(), w->id, path[0] == '/' ? "" : "/", path);
+}
+
+static void completed(int handle, int status, void *arg) {
+	sentRequest *req = arg;
+	worker *w = req->w;
+	long now = now_us();
+
+	(void) handle;
+	/* prints complete in the worker thread, the others in the receiver thread */
+	pthread_mutex_lock(&w->lock);
+	histogram_record(&w->results.latency[req->type], now - req->intended);
+	if (status < 0)
+		w->results.errors[req->type]++;
+	if (--w->outstanding == 0)
+		pthread_cond_signal(&w->idle);
+	pthread_mutex_unlock(&w->lock);
+	free(req);
+}
+
+/*
+ * Runs a command, synchronously or, with a callback, asynchronously.
+ * Prints have no asynchronous variant and are always synchronous.
+ * Returns: status of a synchronous command, handle of an asynchronous one
+ */
+static int runCommand(worker *w, command *cmd, tfsCallback callback, void *arg) {
+	char arg1[MAX_INPUT_SIZE], arg2[MAX_INPUT_SIZE];
+
+	if (uniquePaths) {
+		prefixPath(arg1, w, cmd->arg1);
+		prefixPath(arg2, w, cmd->arg2);
+	} else {
+		strcpy(arg1, cmd->arg1);
+		strcpy(arg2, cmd->arg2);
+	}
+
+	switch (cmd->op) {
+		case 'c':
+			return callback ? tfsCreateAsync(w->fs, arg1, cmd->arg2[0], callback, arg) :
+				tfsCreate(w->fs, arg1, cmd->arg2[0]);
+		case 'd':
+			return callback ? tfsDeleteAsync(w->fs, arg1, callback, arg) : tfsDelete(w->fs, arg1);
+		case 'l':
+			return callback ? tfsLookupAsync(w->fs, arg1, callback, arg) : tfsLookup(w->fs, arg1);
+		case 'm':
+			return callback ? tfsMoveAsync(w->fs, arg1, arg2, callback, arg) : tfsMove(w->fs, arg1, arg2);
+		case 'p':
+			if (callback) {
+				int status = tfsPrint(w->fs, cmd->arg1);
+				callback(0, status, arg);
+				return 1;
+			}
+			return tfsPrint(w->fs, cmd->arg1);
+		default:
+			return TECNICOFS_ERROR_OTHER;
+	}
+}
+
+/*
+ * Replays the commands of a worker. In a closed loop each command is sent
+ * once the previous one is answered. In an open loop command k is sent at
+ * start + k / rate whatever the replies, and its latency is counted from
+ * that time, so a slow server isn't hidden by sending less.
+ */
+void *replay(void *arg) {
+	worker *w = arg;
+	double interval = rate > 0 ? 1000000.0 * numberThreads * numberProcesses / rate : 0;
+	long start = now_us(), sent = 0;
+
+	if (uniquePaths) {
+		char dir[MAX_INPUT_SIZE];
+		prefixPath(dir, w, "");
+		tfsCreate(w->fs, dir, 'd');
+	}
+
+	for (int loop = 0; loop < loops; loop++) {
+		for (int i = 0; i < w->numberCommands; i++, sent++) {
+			command *cmd = &w->commands[i];
+			int type = typeIndex(cmd->op);
+
+			if (interval == 0) {
+				long begin = now_us();
+				if (runCommand(w, cmd, NULL, NULL) < 0)
+					w->results.errors[type]++;
+				histogram_record(&w->results.latency[type], now_us() - begin);
+				continue;
+			}
+
+			sentRequest *req = malloc(sizeof(sentRequest));
+			req->w = w;
+			req->type = type;
+			req->intended = start + (long) (sent * interval);
+
+			long wait = req->intended - now_us();
+			if (wait > 0)
+				usleep(wait);
+
+			pthread_mutex_lock(&w->lock);
+			w->outstanding++;
+			pthread_mutex_unlock(&w->lock);
+			if (runCommand(w, cmd, completed, req) < 0) {
+				/* not sent, the callback won't run */
+				completed(0, TECNICOFS_ERROR_CONNECTION_ERROR, req);
+			}
+		}
+	}
+
+	pthread_mutex_lock(&w->lock);
+	while (w->outstanding > 0) {
+		pthread_cond_wait(&w->idle, &w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/*
+ * Runs the workers of a process and merges their results.
+ * Input:
+ *  - process: index of the process, workers are numbered across processes
+ *  - total: merged results of the workers
+ */
+void runProcess(int process, stats *total) {
+	worker *workers = calloc(numberThreads, sizeof(worker));
+	pthread_t tid[numberThreads];
+
+	for (int i = 0; i < NUM_TYPES; i++)
+		histogram_init(&total->latency[i]);
+	memset(total->errors, 0, sizeof(total->errors));
+
+	for (int t = 0; t < numberThreads; t++) {
+		worker *w = &workers[t];
+		w->id = process * numberThreads + t;
+		if (workload) {
+			w->numberCommands = generateCommands(w->id, workload, &w->commands);
+		} else {
+			w->commands = files[w->id % numberFiles];
+			w->numberCommands = fileSizes[w->id % numberFiles];
+		}
+		for (int i = 0; i < NUM_TYPES; i++)
+			histogram_init(&w->results.latency[i]);
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->idle, NULL);
+		if ((w->fs = tfsMount(serverName)) == NULL) {
+			fprintf(stderr, "Unable to mount socket: %s\n", serverName);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (int t = 0; t < numberThreads; t++) {
+		if (pthread_create(&tid[t], NULL, replay, &workers[t]) != 0) {
+			fprintf(stderr, "Error: can't create worker thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (int t = 0; t < numberThreads; t++) {
+		worker *w = &workers[t];
+		pthread_join(tid[t], NULL);
+		tfsUnmount(w->fs);
+		for (int i = 0; i < NUM_TYPES; i++) {
+			histogram_merge(&total->latency[i], &w->results.latency[i]);
+			total->errors[i] += w->results.errors[i];
+		}
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->idle);
+		if (workload)
+			free(w->commands);
+	}
+	free(workers);
+}
+
+/*
+ * Writes or reads the results of a process through a pipe.
+ * Returns: 0 on success, -1 otherwise
+ */
+static int transfer(int fd, stats *results, int writing) {
+	char *ptr = (char *) results;
+	size_t len = sizeof(stats);
+
+	while (len > 0) {
+		ssize_t n = writing ? write(fd, ptr, len) : read(fd, ptr, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		ptr += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void printReport(stats *total, double elapsed) {
+	histogram all;
+	uint64_t errors = 0;
+
+	histogram_init(&all);
+	printf("%-4s %10s %10s %8s %8s %8s %8s %8s %8s %8s\n",
+		"op", "count", "ops/s", "errors", "mean", "p50", "p90", "p99", "p99.9", "max");
+	for (int i = 0; i <= NUM_TYPES; i++) {
+		histogram *h = (i < NUM_TYPES) ? &total->latency[i] : &all;
+		char name[8];
+
+		if (i < NUM_TYPES) {
+			if (h->total == 0)
+				continue;
+			histogram_merge(&all, h);
+			errors += total->errors[i];
+			snprintf(name, sizeof(name), "%c", i < NUM_TYPES - 1 ? OP_TYPES[i] : '?');
+		} else {
+			strcpy(name, "all");
+		}
+
+		printf("%-4s %10lu %10.0f %8lu %8.0f %8lu %8lu %8lu %8lu %8lu\n", name,
+			(unsigned long) h->total, h->total / elapsed,
+			(unsigned long) (i < NUM_TYPES ? total->errors[i] : errors), histogram_mean(h),
+			(unsigned long) histogram_percentile(h, 50), (unsigned long) histogram_percentile(h, 90),
+			(unsigned long) histogram_percentile(h, 99), (unsigned long) histogram_percentile(h, 99.9),
+			(unsigned long) (h->total ? h->max : 0));
+	}
+	printf("latencies in microseconds, %.3f s elapsed\n", elapsed);
+}
+
+int main(int argc, char* argv[]) {
+	int opt, pipes[MAX_PROCESSES];
+	pid_t pids[MAX_PROCESSES];
+	stats *total = malloc(sizeof(stats)), *results = malloc(sizeof(stats));
+	long start;
+
+	while ((opt = getopt(argc, argv, "t:P:r:n:ug:")) != -1) {
+		switch (opt) {
+			case 't':
+				numberThreads = atoi(optarg);
+				break;
+			case 'P':
+				numberProcesses = atoi(optarg);
+				break;
+			case 'r':
+				rate = atof(optarg);
+				break;
+			case 'n':
+				loops = atoi(optarg);
+				break;
+			case 'u':
+				uniquePaths = 1;
+				break;
+			case 'g':
+				for (int i = 0; i < (int) (sizeof(mixes) / sizeof(mix)); i++) {
+					if (strcmp(optarg, mixes[i].name) == 0)
+						workload = &mixes[i];
+				}
+				if (workload == NULL) {
+					fprintf(stderr, "Error: unknown mix %s\n", optarg);
+					displayUsage(argv[0]);
+				}
+				break;
+			default:
+				displayUsage(argv[0]);
+		}
+	}
+
+	if ((workload ? argc - optind != 1 : argc - optind < 2) || numberThreads <= 0 || numberProcesses <= 0 || numberProcesses > MAX_PROCESSES || loops <= 0 ||
+		rate < 0 || (workload && (uniquePaths || numberThreads * numberProcesses > GEN_MAX_WORKERS))) {
+		fprintf(stderr, "Invalid format:\n");
+		if (workload)
+			fprintf(stderr, "  -g takes no input files nor -u, and at most %d workers\n", GEN_MAX_WORKERS);
+		displayUsage(argv[0]);
+	}
+
+	serverName = argv[optind];
+	numberFiles = argc - optind - 1;
+	files = malloc(sizeof(command *) * numberFiles);
+	fileSizes = malloc(sizeof(int) * numberFiles);
+	for (int i = 0; i < numberFiles; i++)
+		fileSizes[i] = readCommands(argv[optind + 1 + i], &files[i]);
+	if (workload)
+		createTree();
+
+	start = now_us();
+	if (numberProcesses == 1) {
+		runProcess(0, total);
+	} else {
+		/* each process sends back its merged results through a pipe */
+		for (int p = 0; p < numberProcesses; p++) {
+			int fds[2];
+
+			if (pipe(fds) < 0 || (pids[p] = fork()) < 0) {
+				perror("Error: can't start process");
+				exit(EXIT_FAILURE);
+			}
+			if (pids[p] == 0) {
+				close(fds[0]);
+				runProcess(p, results);
+				exit(transfer(fds[1], results, 1) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+			}
+			close(fds[1]);
+			pipes[p] = fds[0];
+		}
+
+		for (int i = 0; i < NUM_TYPES; i++)
+			histogram_init(&total->latency[i]);
+		memset(total->errors, 0, sizeof(total->errors));
+		for (int p = 0; p < numberProcesses; p++) {
+			if (transfer(pipes[p], results, 0) < 0) {
+				fprintf(stderr, "Error: process %d failed\n", p);
+				exit(EXIT_FAILURE);
+			}
+			for (int i = 0; i < NUM_TYPES; i++) {
+				histogram_merge(&total->latency[i], &results->latency[i]);
+				total->errors[i] += results->errors[i];
+			}
+			close(pipes[p]);
+			waitpid(pids[p], NULL, 0);
+		}
+	}
+
+	printReport(total, (now_us() - start) / 1000000.0);
+
+	for (int i = 0; i < numberFiles; i++)
+		free(files[i]);
+	free(files);
+	free(fileSizes);
+	free(total);
+	free(results);
+	exit(EXIT_SUCCESS);
+}
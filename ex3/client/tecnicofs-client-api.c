@@ -1,7 +1,15 @@
+#define _GNU_SOURCE /* memfd_create */
 #include "tecnicofs-client-api.h"
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <stdio.h>
@@ -9,11 +17,105 @@
 #define SUCCESS 0
 #define FAIL 1
 
-char socketName[MAX_FILE_NAME];
-char *serverSocket;
-int sockfd;
-socklen_t servlen, clilen;
-struct sockaddr_un serv_addr, client_addr;
+/* retries of a request rejected with TECNICOFS_ERROR_SERVER_BUSY */
+#define MAX_BUSY_RETRIES 8
+#define BACKOFF_MIN_US 1000
+#define BACKOFF_MAX_US 128000
+
+/* requests waiting for their reply, request ids map to slots modulo this */
+#define MAX_PENDING 1024
+/* id of the datagram that stops the receiver thread */
+#define STOP_ID -1
+/* lookups cached under a lease, in a direct-mapped table */
+#define CACHE_SIZE 1024
+/* servers of a mount, each owning the top-level entries hashed to its points of the ring */
+#define MAX_SERVERS 64
+#define RING_POINTS 64
+/* watches of a mount, their ids are their slots plus one */
+#define MAX_WATCHES 64
+
+/*
+ * Called with the data of each datagram of a streamed reply, in order
+ */
+typedef void (*chunkHandler)(char *data, size_t len, void *arg);
+
+/*
+ * A request sent to the server, waiting for its reply
+ */
+typedef struct pendingRequest {
+	int id; /* 0 if the slot is free */
+	int done;
+	int status;
+	int lease;
+	int fd; /* descriptor attached to the reply, -1 if none */
+	void *payload; /* where the data following the status is copied, or NULL */
+	size_t payloadSize;
+	chunkHandler chunk; /* gets the data of streamed replies instead, or NULL */
+	void *chunkArg;
+	tfsCallback callback;
+	void *arg;
+	pthread_cond_t completed;
+} pendingRequest;
+
+/*
+ * Result of a lookup, valid until its lease expires
+ */
+typedef struct cachedLookup {
+	char path[MAX_FILE_NAME]; /* without leading or trailing slashes */
+	int inumber;
+	long expires; /* CLOCK_MONOTONIC, in milliseconds, 0 if the slot is free */
+} cachedLookup;
+
+/*
+ * A watch of the client, whose events are passed to its callback
+ */
+typedef struct clientWatch {
+	tfsWatchCallback callback; /* NULL if the slot is free */
+	void *arg;
+	int server; /* server watched, -1 for every server */
+} clientWatch;
+
+/*
+ * A point of the consistent hashing ring
+ */
+typedef struct ringPoint {
+	uint32_t hash;
+	int server;
+} ringPoint;
+
+/*
+ * A mount of one or more servers: the socket of the client, the addresses
+ * of the servers, the requests waiting for replies on that socket and the
+ * cached lookups. Every server replies to the same socket, request ids are
+ * unique across them.
+ */
+struct tfsMountHandle {
+	char socketName[MAX_FILE_NAME];
+	int sockfd;
+	socklen_t clilen;
+	struct sockaddr_un client_addr;
+
+	int numberServers;
+	socklen_t servlen[MAX_SERVERS];
+	struct sockaddr_un serv_addr[MAX_SERVERS];
+	ringPoint ring[MAX_SERVERS * RING_POINTS];
+
+	pendingRequest pending[MAX_PENDING];
+	int nextId;
+	pthread_mutex_t pendingLock;
+	pthread_cond_t slotFree;
+	pthread_t receiverTid;
+
+	cachedLookup cache[CACHE_SIZE];
+	unsigned long invalidations;
+	pthread_mutex_t cacheLock;
+
+	clientWatch watches[MAX_WATCHES];
+	pthread_mutex_t watchLock;
+};
+
+/* distinguishes the sockets of the handles mounted by one process */
+int mountCount = 0;
 
 int setSockAddrUn(char *path, struct sockaddr_un *addr) {
   if (addr == NULL)
@@ -26,112 +128,1417 @@ int setSockAddrUn(char *path, struct sockaddr_un *addr) {
   return SUN_LEN(addr);
 }
 
-int tfsPrint(char *outputfile) {
-	char message[MAX_INPUT_SIZE];
-	sprintf(message, "p %s", outputfile);
-	if (sendto(sockfd, message, strlen(message)+1, 0, (struct sockaddr *) &serv_addr, servlen) < 0) {
-		perror("client: sendto error");
-		exit(EXIT_FAILURE);
+static long now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Copies a path without leading, trailing or repeated slashes, as the
+ * server names leases.
+ */
+static void normalizePath(char *dst, char *src) {
+	int len = 0;
+
+	for (; *src != '\0' && len < MAX_FILE_NAME - 1; src++) {
+		if (*src == '/' && (len == 0 || dst[len - 1] == '/'))
+			continue;
+		dst[len++] = *src;
+	}
+	if (len > 0 && dst[len - 1] == '/')
+		len--;
+	dst[len] = '\0';
+}
+
+static cachedLookup *cacheSlot(tfsHandle *fs, char *path) {
+	unsigned int hash = 5381;
+
+	for (char *c = path; *c != '\0'; c++)
+		hash = hash * 33 + *c;
+	return &fs->cache[hash % CACHE_SIZE];
+}
+
+/*
+ * Drops the cached lookups of a path and of the paths below it.
+ */
+static void cacheInvalidate(tfsHandle *fs, char *path) {
+	int len = strlen(path);
+
+	pthread_mutex_lock(&fs->cacheLock);
+	fs->invalidations++;
+	for (int i = 0; i < CACHE_SIZE; i++) {
+		cachedLookup *entry = &fs->cache[i];
+		if (entry->expires != 0 && strncmp(entry->path, path, len) == 0 &&
+			(entry->path[len] == '\0' || entry->path[len] == '/' || len == 0))
+			entry->expires = 0;
+	}
+	pthread_mutex_unlock(&fs->cacheLock);
+}
+
+/*
+ * FNV-1a with a final mix, as consecutive names must land far apart on the ring.
+ */
+static uint32_t hashName(char *name, int len) {
+	uint32_t hash = 2166136261u;
+
+	for (int i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	return hash;
+}
+
+static int comparePoints(const void *a, const void *b) {
+	uint32_t x = ((ringPoint *) a)->hash, y = ((ringPoint *) b)->hash;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Picks the server owning a path: the one of the first point of the ring
+ * after the hash of the top-level component of the path. Each server thus
+ * holds whole top-level subtrees, and adding a server only moves the ones
+ * that land on its points. Paths without a component, like "/", go to the
+ * first server.
+ * Input:
+ *  - fs: mounted servers
+ *  - path: path operated on
+ * Returns: index of the server
+ */
+static int routePath(tfsHandle *fs, char *path) {
+	int len = 0, lo = 0, hi = fs->numberServers * RING_POINTS;
+	uint32_t hash;
+
+	if (fs->numberServers == 1)
+		return 0;
+
+	while (*path == '/')
+		path++;
+	while (path[len] != '\0' && path[len] != '/')
+		len++;
+	if (len == 0)
+		return 0;
+
+	hash = hashName(path, len);
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (fs->ring[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return fs->ring[lo % (fs->numberServers * RING_POINTS)].server;
+}
+
+/*
+ * Passes the events pushed for a watch to its callback.
+ */
+static void deliverEvents(tfsHandle *fs, int watch, char *data, size_t len) {
+	char *end = data + len;
+	tfsWatchCallback callback;
+	void *arg;
+
+	if (watch <= 0 || watch > MAX_WATCHES)
+		return;
+
+	pthread_mutex_lock(&fs->watchLock);
+	callback = fs->watches[watch - 1].callback;
+	arg = fs->watches[watch - 1].arg;
+	pthread_mutex_unlock(&fs->watchLock);
+	if (callback == NULL)
+		return;
+
+	while (data + 1 < end) {
+		size_t pathLen = strnlen(data + 1, end - data - 1);
+		if (data + 1 + pathLen == end) /* not terminated */
+			break;
+		callback(watch, data[0], data + 1, arg);
+		data += pathLen + 2;
+	}
+}
+
+/*
+ * Receives a datagram and the file descriptor attached to it, if any.
+ * Returns: bytes received, as recv
+ */
+static ssize_t receiveReply(int sockfd, char *buffer, size_t size, int *fd) {
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { buffer, size };
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	ssize_t len;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	*fd = -1;
+	len = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+	for (cmsg = CMSG_FIRSTHDR(&msg); len >= 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	return len;
+}
+
+/*
+ * Receives the replies of the server and completes the matching requests,
+ * running their callback or waking up the thread waiting for them. The
+ * datagrams of a streamed reply are handed to the chunk handler of the
+ * request as they arrive, a descriptor attached to a reply is kept for
+ * the thread waiting for it.
+ * Invalidations pushed by the server are applied to the lookup cache,
+ * events are passed to the callback of their watch.
+ */
+void *receiveReplies(void *arg) {
+	tfsHandle *fs = arg;
+	/* room for a full datagram and the '\0' ending it */
+	char buffer[sizeof(tfsReply) + TFS_MAX_REPLY_PAYLOAD + 1];
+	tfsReply reply;
+	ssize_t len;
+	int fd;
+
+	while (1) {
+		len = receiveReply(fs->sockfd, buffer, sizeof(buffer) - 1, &fd);
+		if (len < (ssize_t) sizeof(reply)) {
+			if (fd >= 0)
+				close(fd);
+			continue;
+		}
+		memcpy(&reply, buffer, sizeof(reply));
+		buffer[len] = '\0';
+
+		if (reply.id == STOP_ID)
+			break;
+
+		/* only a final reply waited for without a callback may carry a descriptor */
+		if (reply.id == TFS_PUSH_ID) {
+			if (fd >= 0)
+				close(fd);
+			if (reply.status == TFS_PUSH_INVALIDATE)
+				cacheInvalidate(fs, buffer + sizeof(reply));
+			else if (reply.status == TFS_PUSH_EVENTS)
+				deliverEvents(fs, reply.lease, buffer + sizeof(reply), len - sizeof(reply));
+			continue;
+		}
+
+		if (reply.id < 0) {
+			if (fd >= 0)
+				close(fd);
+			continue;
+		}
+
+		pthread_mutex_lock(&fs->pendingLock);
+		pendingRequest *req = &fs->pending[reply.id % MAX_PENDING];
+		if (req->id != reply.id) {
+			/* nobody is waiting for this reply anymore */
+			pthread_mutex_unlock(&fs->pendingLock);
+			if (fd >= 0)
+				close(fd);
+			continue;
+		}
+
+		if (req->chunk && (reply.status == TFS_STREAM_MORE || len > (ssize_t) sizeof(reply))) {
+			chunkHandler chunk = req->chunk;
+			void *chunkArg = req->chunkArg;
+
+			/* the slot stays taken until the last datagram is handled */
+			pthread_mutex_unlock(&fs->pendingLock);
+			chunk(buffer + sizeof(reply), len - sizeof(reply), chunkArg);
+			if (reply.status == TFS_STREAM_MORE) {
+				if (fd >= 0)
+					close(fd);
+				continue;
+			}
+			pthread_mutex_lock(&fs->pendingLock);
+		}
+
+		if (req->callback) {
+			tfsCallback callback = req->callback;
+			void *arg = req->arg;
+
+			req->id = 0;
+			pthread_cond_broadcast(&fs->slotFree);
+			pthread_mutex_unlock(&fs->pendingLock);
+			if (fd >= 0)
+				close(fd);
+			callback(reply.id, reply.status, arg);
+			continue;
+		}
+
+		req->done = 1;
+		req->status = reply.status;
+		req->lease = reply.lease;
+		req->fd = fd;
+		if (req->payload) {
+			size_t payloadLen = len - sizeof(reply);
+			memcpy(req->payload, buffer + sizeof(reply), payloadLen < req->payloadSize ? payloadLen : req->payloadSize);
+		}
+		pthread_cond_signal(&req->completed);
+		pthread_mutex_unlock(&fs->pendingLock);
+	}
+	return NULL;
+}
+
+/*
+ * Sends a message to a server without waiting for its reply, giving it
+ * the id of a free slot.
+ * Input:
+ *  - fs: mounted servers
+ *  - server: index of the server
+ *  - message: request to send, followed by the commands of a batch
+ *  - len: bytes to send
+ *  - fd: descriptor attached to the message, the server gets a copy of it,
+ *    or -1
+ *  - payload: where the data following the status of the reply is copied,
+ *    like the statuses of a batch, or NULL
+ *  - payloadSize: bytes of payload
+ *  - chunk: called with the data of every datagram of a streamed reply,
+ *    from the receiver thread, or NULL
+ *  - chunkArg: passed to chunk
+ *  - callback: function called with the status when the reply arrives,
+ *    from the receiver thread, or NULL to collect it with tfsWait
+ *  - arg: passed to the callback
+ * Returns: handle of the request or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int submitMessage(tfsHandle *fs, int server, tfsRequest *message, size_t len, int fd, void *payload, size_t payloadSize,
+	chunkHandler chunk, void *chunkArg, tfsCallback callback, void *arg) {
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { message, len };
+	struct msghdr msg = { 0 };
+	pendingRequest *req;
+
+	pthread_mutex_lock(&fs->pendingLock);
+	message->id = fs->nextId;
+	fs->nextId = (fs->nextId == INT_MAX) ? 1 : fs->nextId + 1;
+
+	/* bounds the requests in flight, as the slot must be free */
+	req = &fs->pending[message->id % MAX_PENDING];
+	while (req->id != 0) {
+		pthread_cond_wait(&fs->slotFree, &fs->pendingLock);
+	}
+	req->id = message->id;
+	req->done = 0;
+	req->fd = -1;
+	req->payload = payload;
+	req->payloadSize = payloadSize;
+	req->chunk = chunk;
+	req->chunkArg = chunkArg;
+	req->callback = callback;
+	req->arg = arg;
+	pthread_mutex_unlock(&fs->pendingLock);
+
+	msg.msg_name = &fs->serv_addr[server];
+	msg.msg_namelen = fs->servlen[server];
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd >= 0) {
+		struct cmsghdr *cmsg;
+
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	if (sendmsg(fs->sockfd, &msg, 0) < 0) {
+		perror("client: sendmsg error");
+		pthread_mutex_lock(&fs->pendingLock);
+		req->id = 0;
+		pthread_cond_broadcast(&fs->slotFree);
+		pthread_mutex_unlock(&fs->pendingLock);
+		return TECNICOFS_ERROR_CONNECTION_ERROR;
+	}
+	return message->id;
+}
+
+/*
+ * Sends a command to a server without waiting for its reply.
+ * Input:
+ *  - fs: mounted servers
+ *  - server: index of the server
+ *  - command: request to send
+ *  - callback, arg: see submitMessage
+ * Returns: handle of the request or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int submitRequest(tfsHandle *fs, int server, char *command, tfsCallback callback, void *arg) {
+	tfsRequest message;
+
+	strncpy(message.command, command, sizeof(message.command) - 1);
+	message.command[sizeof(message.command) - 1] = '\0';
+	return submitMessage(fs, server, &message, sizeof(message.id) + strlen(message.command) + 1, -1, NULL, 0, NULL, NULL, callback, arg);
+}
+
+/*
+ * Waits for the reply to a request sent without a callback.
+ * Input:
+ *  - fs: mounted server
+ *  - handle: handle of the request
+ *  - lease: if not NULL, set to the lease granted with the reply
+ *  - fd: if not NULL, set to the descriptor attached to the reply, or -1,
+ *    which the caller must close
+ * Returns: status sent by the server
+ */
+int waitRequest(tfsHandle *fs, int handle, int *lease, int *fd) {
+	pendingRequest *req;
+	int status;
+
+	if (handle <= 0)
+		return handle;
+
+	req = &fs->pending[handle % MAX_PENDING];
+	pthread_mutex_lock(&fs->pendingLock);
+	if (req->id != handle || req->callback) {
+		pthread_mutex_unlock(&fs->pendingLock);
+		return TECNICOFS_ERROR_OTHER;
 	}
+	while (!req->done) {
+		pthread_cond_wait(&req->completed, &fs->pendingLock);
+	}
+	status = req->status;
+	if (lease)
+		*lease = req->lease;
+	if (fd)
+		*fd = req->fd;
+	else if (req->fd >= 0)
+		close(req->fd);
+	req->id = 0;
+	pthread_cond_broadcast(&fs->slotFree);
+	pthread_mutex_unlock(&fs->pendingLock);
+
+	return status;
+}
+
+int tfsWait(tfsHandle *fs, int handle) {
+	return waitRequest(fs, handle, NULL, NULL);
+}
 
+/*
+ * Sends a message to a server, with a descriptor attached, and waits for
+ * its reply and the descriptor attached to it.
+ * While the server answers TECNICOFS_ERROR_SERVER_BUSY the message is
+ * retried with an exponential backoff, up to MAX_BUSY_RETRIES times.
+ * Input:
+ *  - fs: mounted servers
+ *  - server: index of the server
+ *  - message, len, fd, payload, payloadSize, chunk, chunkArg: see submitMessage
+ *  - lease: if not NULL, set to the lease granted with the reply
+ *  - replyFd: see waitRequest
+ * Returns: status sent by the server
+ */
+int sendMessageFd(tfsHandle *fs, int server, tfsRequest *message, size_t len, int fd, void *payload, size_t payloadSize,
+	chunkHandler chunk, void *chunkArg, int *lease, int *replyFd) {
 	int res;
-	if (recvfrom(sockfd, &res, sizeof(res), 0, 0, 0) < 0) {
-		perror("client: recvfrom error");
-		exit(EXIT_FAILURE);
-	} 
-	return res;
+	useconds_t backoff = BACKOFF_MIN_US;
+	unsigned int seed = getpid() ^ fs->sockfd;
+
+	for (int retries = 0; ; retries++) {
+		res = waitRequest(fs, submitMessage(fs, server, message, len, fd, payload, payloadSize, chunk, chunkArg, NULL, NULL),
+			lease, replyFd);
+
+		if (res != TECNICOFS_ERROR_SERVER_BUSY || retries == MAX_BUSY_RETRIES)
+			return res;
+		if (replyFd && *replyFd >= 0)
+			close(*replyFd);
+
+		/* sleep between backoff/2 and backoff so clients don't retry in lockstep */
+		usleep(backoff / 2 + rand_r(&seed) % (backoff / 2));
+		if (backoff < BACKOFF_MAX_US)
+			backoff *= 2;
+	}
 }
 
-int tfsCreate(char *filename, char nodeType) {
+/*
+ * Sends a message to a server and waits for its reply.
+ * Input: see sendMessageFd
+ * Returns: status sent by the server
+ */
+int sendMessage(tfsHandle *fs, int server, tfsRequest *message, size_t len, void *payload, size_t payloadSize,
+	chunkHandler chunk, void *chunkArg, int *lease) {
+	return sendMessageFd(fs, server, message, len, -1, payload, payloadSize, chunk, chunkArg, lease, NULL);
+}
+
+int sendRequest(tfsHandle *fs, int server, char *command, int *lease) {
+	tfsRequest message;
+
+	strncpy(message.command, command, sizeof(message.command) - 1);
+	message.command[sizeof(message.command) - 1] = '\0';
+	return sendMessage(fs, server, &message, sizeof(message.id) + strlen(message.command) + 1, NULL, 0, NULL, NULL, lease);
+}
+
+/*
+ * Formats an operation of a batch as the command sent to the server. An
+ * invalid operation is sent as a command the server rejects, so that it
+ * gets its status in order with the others.
+ * Returns: length of the command
+ */
+static int formatOperation(char *command, tfsOperation *op) {
+	int len = MAX_INPUT_SIZE;
+
+	switch (op->type) {
+		case 'c':
+			len = snprintf(command, MAX_INPUT_SIZE, "c %s %c", op->path, op->nodeType);
+			break;
+		case 'd':
+		case 'D':
+		case 'l':
+			len = snprintf(command, MAX_INPUT_SIZE, "%c %s", op->type, op->path);
+			break;
+		case 'm':
+		case 'C':
+			len = snprintf(command, MAX_INPUT_SIZE, "%c %s %s", op->type, op->path, op->to);
+			break;
+	}
+	if (len >= MAX_INPUT_SIZE) {
+		strcpy(command, "?");
+		len = 1;
+	}
+	return len;
+}
+
+/*
+ * Sends operations owned by one server in datagrams of up to TFS_MAX_BATCH.
+ * Input:
+ *  - fs: mounted servers
+ *  - server: index of the server
+ *  - ops: operations of the batch
+ *  - indexes: indexes in ops of the operations to send, in order
+ *  - count: number of indexes
+ *  - results: statuses of the operations, by their index in ops
+ * Returns: number of operations applied, or the error that stopped the
+ *  first datagram
+ */
+static int batchServer(tfsHandle *fs, int server, tfsOperation *ops, int *indexes, int count, int *results) {
+	char buffer[TFS_MAX_BATCH_SIZE] __attribute__((aligned(8)));
+	tfsRequest *message = (tfsRequest *) buffer;
+	int statuses[TFS_MAX_BATCH];
+	int done = 0;
+
+	while (done < count) {
+		size_t len = sizeof(tfsRequest);
+		int n, applied;
+
+		for (n = 0; n < TFS_MAX_BATCH && done + n < count; n++)
+			len += formatOperation(buffer + len, &ops[indexes[done + n]]) + 1;
+
+		snprintf(message->command, sizeof(message->command), "%c %d", TFS_BATCH_COMMAND, n);
+		applied = sendMessage(fs, server, message, len, statuses, sizeof(statuses), NULL, NULL, NULL);
+		if (applied < 0)
+			return done > 0 ? done : applied;
+
+		for (int i = 0; i < applied; i++)
+			results[indexes[done + i]] = statuses[i];
+		done += applied;
+		if (applied < n)
+			break;
+	}
+	return done;
+}
+
+/*
+ * Sends operations to the servers in batches of up to TFS_MAX_BATCH, each
+ * a single datagram, and waits for their statuses. The operations of each
+ * server are applied in order, each one on its own: one failing doesn't
+ * stop or undo the others. Lookups in a batch don't use or fill the lookup
+ * cache.
+ * Input:
+ *  - fs: mounted servers
+ *  - ops: operations to apply
+ *  - count: number of operations
+ *  - results: array of count, where the status of each operation is stored,
+ *    TECNICOFS_ERROR_CROSS_SHARD for moves and clones between servers and
+ *    TECNICOFS_ERROR_OTHER for the other ones not applied
+ * Returns: number of operations applied by the servers, or the error that
+ *  stopped every server (e.g. TECNICOFS_ERROR_SERVER_BUSY)
+ */
+int tfsBatch(tfsHandle *fs, tfsOperation *ops, int count, int *results) {
+	int *indexes = malloc(sizeof(int) * count), *owners = malloc(sizeof(int) * count);
+	int applied = 0, error = 0;
+
+	for (int i = 0; i < count; i++) {
+		results[i] = TECNICOFS_ERROR_OTHER;
+		owners[i] = routePath(fs, ops[i].path);
+		if ((ops[i].type == 'm' || ops[i].type == 'C') && routePath(fs, ops[i].to) != owners[i]) {
+			/* never sent, so not applied */
+			results[i] = TECNICOFS_ERROR_CROSS_SHARD;
+			owners[i] = -1;
+		}
+	}
+
+	/* operations of different servers touch disjoint subtrees, their order doesn't matter */
+	for (int server = 0; server < fs->numberServers; server++) {
+		int n = 0, res;
+
+		for (int i = 0; i < count; i++) {
+			if (owners[i] == server)
+				indexes[n++] = i;
+		}
+		if (n == 0)
+			continue;
+
+		if ((res = batchServer(fs, server, ops, indexes, n, results)) < 0)
+			error = res;
+		else
+			applied += res;
+	}
+
+	free(indexes);
+	free(owners);
+	return (applied == 0 && error != 0) ? error : applied;
+}
+
+/*
+ * Prints the tree of each server, the one of server i > 0 to outputfile.i
+ * Returns: SUCCESS or the first error
+ */
+int tfsPrint(tfsHandle *fs, char *outputfile) {
 	char message[MAX_INPUT_SIZE];
-	sprintf(message, "c %s %c", filename, nodeType);
-	if (sendto(sockfd, message, strlen(message)+1, 0, (struct sockaddr *) &serv_addr, servlen) < 0) {
-		perror("client: sendto error");
-		exit(EXIT_FAILURE);
-	} 
+	int status = SUCCESS;
 
-	int res;
-	if (recvfrom(sockfd, &res, sizeof(res), 0, 0, 0) < 0) {
-		perror("client: recvfrom error");
-		exit(EXIT_FAILURE);
-	} 
+	for (int server = 0; server < fs->numberServers; server++) {
+		int res;
 
-	return res;
+		if (server == 0)
+			snprintf(message, sizeof(message), "p %s", outputfile);
+		else
+			snprintf(message, sizeof(message), "p %s.%d", outputfile, server);
+		if ((res = sendRequest(fs, server, message, NULL)) != SUCCESS && status == SUCCESS)
+			status = res;
+	}
+	return status;
 }
 
-int tfsDelete(char *path) {
+int tfsCreate(tfsHandle *fs, char *filename, char nodeType) {
 	char message[MAX_INPUT_SIZE];
-	sprintf(message, "d %s", path);
-	if (sendto(sockfd, message, strlen(message)+1, 0, (struct sockaddr *) &serv_addr, servlen) < 0) {
-		perror("client: sendto error");
-		exit(EXIT_FAILURE);
-	} 
+	sprintf(message, "c %s %c", filename, nodeType);
+	return sendRequest(fs, routePath(fs, filename), message, NULL);
+}
 
-	int res;
-	if (recvfrom(sockfd, &res, sizeof(res), 0, 0, 0) < 0) {
-		perror("client: recvfrom error");
-		exit(EXIT_FAILURE);
-	} 
+int tfsDelete(tfsHandle *fs, char *path) {
+	char message[MAX_INPUT_SIZE];
+	sprintf(message, "d %s", path);
+	return sendRequest(fs, routePath(fs, path), message, NULL);
+}
 
-	return res;
+/*
+ * Deletes a path and everything below it, which disappears at once for
+ * other clients.
+ * Returns: SUCCESS or an error
+ */
+int tfsDeleteRecursive(tfsHandle *fs, char *path) {
+	char message[MAX_INPUT_SIZE];
+	sprintf(message, "D %s", path);
+	return sendRequest(fs, routePath(fs, path), message, NULL);
 }
 
-int tfsMove(char *from, char *to) {
+/*
+ * Moves a path. Both paths must be owned by the same server, that is
+ * have the same top-level component when several servers are mounted.
+ * Returns: status sent by the server or TECNICOFS_ERROR_CROSS_SHARD
+ */
+int tfsMove(tfsHandle *fs, char *from, char *to) {
 	char message[MAX_INPUT_SIZE];
+	int server = routePath(fs, from);
+
+	if (routePath(fs, to) != server)
+		return TECNICOFS_ERROR_CROSS_SHARD;
 	sprintf(message, "m %s %s", from, to);
-	if (sendto(sockfd, message, strlen(message)+1, 0, (struct sockaddr *) &serv_addr, servlen) < 0) {
-		perror("client: sendto error");
-		exit(EXIT_FAILURE);
-	} 
+	return sendRequest(fs, server, message, NULL);
+}
 
-	int res;
-	if (recvfrom(sockfd, &res, sizeof(res), 0, 0, 0) < 0) {
-		perror("client: recvfrom error");
-		exit(EXIT_FAILURE);
-	} 
+/*
+ * Makes to a clone of from, sharing its subtree until either side changes.
+ * Both paths must be owned by the same server, as for tfsMove.
+ * Returns: status sent by the server or TECNICOFS_ERROR_CROSS_SHARD
+ */
+int tfsClone(tfsHandle *fs, char *from, char *to) {
+	char message[MAX_INPUT_SIZE];
+	int server = routePath(fs, from);
 
-	return res;
+	if (routePath(fs, to) != server)
+		return TECNICOFS_ERROR_CROSS_SHARD;
+	sprintf(message, "C %s %s", from, to);
+	return sendRequest(fs, server, message, NULL);
 }
 
-int tfsLookup(char *path) {
-	char message[MAX_INPUT_SIZE];
+int tfsLookup(tfsHandle *fs, char *path) {
+	char message[MAX_INPUT_SIZE], key[MAX_FILE_NAME];
+	cachedLookup *entry;
+	unsigned long invalidations;
+	int inumber, lease;
+	long sent;
+
+	/* answer locally while the lease on the path is valid */
+	normalizePath(key, path);
+	entry = cacheSlot(fs, key);
+	pthread_mutex_lock(&fs->cacheLock);
+	sent = now_ms();
+	if (entry->expires > sent && strcmp(entry->path, key) == 0) {
+		inumber = entry->inumber;
+		pthread_mutex_unlock(&fs->cacheLock);
+		return inumber;
+	}
+	invalidations = fs->invalidations;
+	pthread_mutex_unlock(&fs->cacheLock);
+
 	sprintf(message, "l %s", path);
-	if (sendto(sockfd, message, strlen(message)+1, 0, (struct sockaddr *) &serv_addr, servlen) < 0) {
-		perror("client: sendto error");
-		exit(EXIT_FAILURE);
-	} 
+	inumber = sendRequest(fs, routePath(fs, path), message, &lease);
+
+	/* an invalidation received meanwhile may be for this path, don't cache then */
+	if (inumber >= 0 && lease > 0) {
+		pthread_mutex_lock(&fs->cacheLock);
+		if (invalidations == fs->invalidations) {
+			strcpy(entry->path, key);
+			entry->inumber = inumber;
+			entry->expires = sent + lease;
+		}
+		pthread_mutex_unlock(&fs->cacheLock);
+	}
+	return inumber;
+}
+
+/*
+ * Reads a chunk of the entries of a directory. Entries present during the
+ * whole listing are read exactly once, the ones added or removed meanwhile
+ * may or may not be.
+ * Input:
+ *  - fs: mounted servers
+ *  - path: path of the directory
+ *  - cursor: 0 for the first chunk, then updated after each one, until it
+ *    is TFS_CURSOR_END
+ *  - entries: array of TFS_READDIR_CHUNK entries to fill
+ * Returns: number of entries read or an error
+ */
+int tfsReaddir(tfsHandle *fs, char *path, int *cursor, tfsDirEntry *entries) {
+	char payload[sizeof(int) + TFS_READDIR_CHUNK * sizeof(tfsDirEntry)] __attribute__((aligned(8)));
+	tfsRequest message;
+	int count;
 
+	if (*cursor == TFS_CURSOR_END)
+		return 0;
+
+	snprintf(message.command, sizeof(message.command), "r %s %d", path, *cursor);
+	count = sendMessage(fs, routePath(fs, path), &message, sizeof(message.id) + strlen(message.command) + 1,
+		payload, sizeof(payload), NULL, NULL, NULL);
+	if (count < 0)
+		return count;
+	if (count > TFS_READDIR_CHUNK)
+		return TECNICOFS_ERROR_OTHER;
+
+	memcpy(cursor, payload, sizeof(int));
+	memcpy(entries, payload + sizeof(int), count * sizeof(tfsDirEntry));
+	return count;
+}
+
+/*
+ * Gets the type, inumber and size of a node, and the memory the contents
+ * of a file take.
+ * Returns: SUCCESS or an error
+ */
+int tfsStat(tfsHandle *fs, char *path, tfsNodeStat *st) {
+	tfsRequest message;
+
+	snprintf(message.command, sizeof(message.command), "s %s", path);
+	return sendMessage(fs, routePath(fs, path), &message, sizeof(message.id) + strlen(message.command) + 1,
+		st, sizeof(tfsNodeStat), NULL, NULL, NULL);
+}
+
+/*
+ * Gets the totals of the blocks of files over every mounted server, from
+ * which the compression ratio (used / stored), the hit rate of the cache
+ * of decompressed blocks and the deduplication ratio (poolRefs /
+ * poolBlocks) follow.
+ * Input:
+ *  - fs: mounted servers
+ *  - usage: set to the totals
+ * Returns: SUCCESS or an error
+ */
+int tfsUsage(tfsHandle *fs, tfsUsageStat *usage) {
+	tfsRequest message;
+
+	memset(usage, 0, sizeof(tfsUsageStat));
+	snprintf(message.command, sizeof(message.command), "%c", TFS_USAGE_COMMAND);
+	for (int i = 0; i < fs->numberServers; i++) {
+		tfsUsageStat server;
+		int res = sendMessage(fs, i, &message, sizeof(message.id) + strlen(message.command) + 1,
+			&server, sizeof(server), NULL, NULL, NULL);
+
+		if (res < 0)
+			return res;
+		usage->used += server.used;
+		usage->stored += server.stored;
+		usage->cacheHits += server.cacheHits;
+		usage->cacheMisses += server.cacheMisses;
+		usage->poolBlocks += server.poolBlocks;
+		usage->poolRefs += server.poolRefs;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Gets the metadata of the paths owned by one server, in requests of up to TFS_MAX_STAT.
+ * Input:
+ *  - fs: mounted servers
+ *  - server: index of the server
+ *  - paths: paths of the bulk stat
+ *  - indexes: indexes in paths of the paths to send
+ *  - count: number of indexes
+ *  - stats: metadata of the paths, by their index in paths
+ * Returns: SUCCESS or an error
+ */
+static int statServer(tfsHandle *fs, int server, char **paths, int *indexes, int count, tfsNodeStat *stats) {
+	char buffer[TFS_MAX_BATCH_SIZE] __attribute__((aligned(8)));
+	tfsRequest *message = (tfsRequest *) buffer;
+	tfsNodeStat results[TFS_MAX_STAT];
+
+	for (int done = 0; done < count; ) {
+		size_t len = sizeof(tfsRequest);
+		int n, res;
+
+		for (n = 0; n < TFS_MAX_STAT && done + n < count; n++) {
+			char *path = paths[indexes[done + n]];
+			int pathLen = strnlen(path, MAX_INPUT_SIZE - 1);
+			memcpy(buffer + len, path, pathLen);
+			buffer[len + pathLen] = '\0';
+			len += pathLen + 1;
+		}
+
+		snprintf(message->command, sizeof(message->command), "%c %d", TFS_BULK_STAT_COMMAND, n);
+		res = sendMessage(fs, server, message, len, results, sizeof(results), NULL, NULL, NULL);
+		if (res < 0)
+			return res;
+		if (res != n)
+			return TECNICOFS_ERROR_OTHER;
+
+		for (int i = 0; i < n; i++)
+			stats[indexes[done + i]] = results[i];
+		done += n;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Gets the metadata of many paths with one request per TFS_MAX_STAT paths
+ * and server. The server resolves the components shared by several paths
+ * only once.
+ * Input:
+ *  - fs: mounted servers
+ *  - paths: paths of the nodes
+ *  - count: number of paths
+ *  - stats: array of count to fill, with inumber -1 and type T_NONE for
+ *    paths that don't exist
+ * Returns: SUCCESS or an error
+ */
+int tfsStatBulk(tfsHandle *fs, char **paths, int count, tfsNodeStat *stats) {
+	int *indexes = malloc(sizeof(int) * count);
+	int status = SUCCESS;
+
+	for (int server = 0; server < fs->numberServers && status == SUCCESS; server++) {
+		int n = 0;
+
+		for (int i = 0; i < count; i++) {
+			if (routePath(fs, paths[i]) == server)
+				indexes[n++] = i;
+		}
+		if (n > 0)
+			status = statServer(fs, server, paths, indexes, n, stats);
+	}
+
+	free(indexes);
+	return status;
+}
+
+/*
+ * A find whose streamed matches are passed on to the caller
+ */
+typedef struct findMatches {
+	tfsMatch match;
+	void *arg;
+} findMatches;
+
+static void splitMatches(char *data, size_t len, void *arg) {
+	findMatches *matches = arg;
+	char *end = data + len;
+
+	while (data < end) {
+		size_t pathLen = strnlen(data, end - data);
+		if (data + pathLen == end) /* not terminated */
+			break;
+		matches->match(data, matches->arg);
+		data += pathLen + 1;
+	}
+}
+
+/*
+ * Finds the nodes below path whose name matches a glob pattern. The
+ * server streams the matches back while it searches. Below the root,
+ * every mounted server is searched.
+ * Input:
+ *  - fs: mounted servers
+ *  - path: directory to search
+ *  - pattern: glob pattern, e.g. "*.txt"
+ *  - match: called with the path of each match, from the thread receiving
+ *    the replies
+ *  - arg: passed to match
+ * Returns: number of matches or an error
+ */
+int tfsFind(tfsHandle *fs, char *path, char *pattern, tfsMatch match, void *arg) {
+	findMatches matches = { match, arg };
+	tfsRequest message;
+	int total = 0, server = routePath(fs, path), everyServer;
+	char *component = path;
+
+	while (*component == '/')
+		component++;
+	everyServer = (*component == '\0');
+
+	if (snprintf(message.command, sizeof(message.command), "%c %s %s", TFS_FIND_COMMAND,
+		everyServer ? "/" : path, pattern) >=
+		(int) sizeof(message.command))
+		return TECNICOFS_ERROR_OTHER;
+
+	for (int i = everyServer ? 0 : server; i < (everyServer ? fs->numberServers : server + 1); i++) {
+		int res = sendMessage(fs, i, &message, sizeof(message.id) + strlen(message.command) + 1,
+			NULL, 0, splitMatches, &matches, NULL);
+		if (res < 0)
+			return res;
+		total += res;
+	}
+	return total;
+}
+
+/*
+ * Writes the data of a streamed reply to a file descriptor, keeping the
+ * first error.
+ */
+typedef struct exportOutput {
+	int fd;
+	int failed;
+} exportOutput;
+
+static void writeChunk(char *data, size_t len, void *arg) {
+	exportOutput *output = arg;
+
+	while (len > 0 && !output->failed) {
+		ssize_t n = write(output->fd, data, len);
+		if (n < 0) {
+			perror("client: export write error");
+			output->failed = 1;
+			break;
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+/*
+ * Exports the tree below path to a file descriptor, as the server streams
+ * it back, without the server touching its disk. Exporting the root gets
+ * one tree from each mounted server, one after the other.
+ * Input:
+ *  - fs: mounted servers
+ *  - path: root of the tree
+ *  - format: 't' for the lines tecnicofs prints, 'b' for binary records
+ *    (see TFS_EXPORT_COMMAND)
+ *  - fd: where the tree is written
+ * Returns: number of nodes or an error
+ */
+int tfsExport(tfsHandle *fs, char *path, char format, int fd) {
+	exportOutput output = { fd, 0 };
+	tfsRequest message;
+	int total = 0, server = routePath(fs, path), everyServer;
+	char *component = path;
+
+	while (*component == '/')
+		component++;
+	everyServer = (*component == '\0');
+
+	if (snprintf(message.command, sizeof(message.command), "%c %s %c", TFS_EXPORT_COMMAND,
+		everyServer ? "/" : path, format) >= (int) sizeof(message.command))
+		return TECNICOFS_ERROR_OTHER;
+
+	for (int i = everyServer ? 0 : server; i < (everyServer ? fs->numberServers : server + 1); i++) {
+		int res = sendMessage(fs, i, &message, sizeof(message.id) + strlen(message.command) + 1,
+			NULL, 0, writeChunk, &output, NULL);
+		if (res < 0)
+			return res;
+		if (output.failed)
+			return TECNICOFS_ERROR_OTHER;
+		total += res;
+	}
+	return total;
+}
+
+/*
+ * Replaces the contents of a file with the bytes of a descriptor, a memfd
+ * or a regular file, sent to the server rather than its bytes. A server
+ * keeping contents in memfds (-m) seals a memfd and keeps it as the
+ * contents without copying them, so it can't be written any more; others,
+ * or a memfd still mapped for writing, have its bytes copied.
+ * Input:
+ *  - fs: mounted servers
+ *  - path: path of the file
+ *  - fd: descriptor of the new contents, which stays open
+ * Returns: SUCCESS or an error
+ */
+int tfsWriteFd(tfsHandle *fs, char *path, int fd) {
+	tfsRequest message;
+	struct stat st;
+
+	if (fstat(fd, &st) < 0 || st.st_size > INT_MAX)
+		return TECNICOFS_ERROR_OTHER;
+	if (snprintf(message.command, sizeof(message.command), "%c %s %ld", TFS_WRITE_COMMAND, path,
+		(long) st.st_size) >= (int) sizeof(message.command))
+		return TECNICOFS_ERROR_OTHER;
+
+	/* sent whole, as writes are followed by their bytes */
+	return sendMessageFd(fs, routePath(fs, path), &message, sizeof(message), fd, NULL, 0, NULL, NULL, NULL, NULL);
+}
+
+/*
+ * Replaces the contents of a file. Contents up to TFS_MAX_WRITE_INLINE
+ * bytes are sent with the request, larger ones in a memfd (see tfsWriteFd).
+ * Readers see either the old or the new contents, never a mix.
+ * Input:
+ *  - fs: mounted servers
+ *  - path: path of the file
+ *  - contents: new contents
+ *  - size: bytes of contents
+ * Returns: SUCCESS or an error
+ */
+int tfsWrite(tfsHandle *fs, char *path, char *contents, size_t size) {
+	char buffer[TFS_MAX_BATCH_SIZE] __attribute__((aligned(8)));
+	tfsRequest *message = (tfsRequest *) buffer;
+	int fd, res;
+
+	if (size > TFS_MAX_WRITE_INLINE) {
+		if ((fd = memfd_create("tecnicofs-write", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+			return TECNICOFS_ERROR_OTHER;
+		exportOutput output = { fd, 0 };
+		writeChunk(contents, size, &output);
+		res = output.failed ? TECNICOFS_ERROR_OTHER : tfsWriteFd(fs, path, fd);
+		close(fd);
+		return res;
+	}
+
+	if (snprintf(message->command, sizeof(message->command), "%c %s %zu", TFS_WRITE_COMMAND, path, size) >=
+		(int) sizeof(message->command))
+		return TECNICOFS_ERROR_OTHER;
+	memcpy(buffer + sizeof(tfsRequest), contents, size);
+	return sendMessage(fs, routePath(fs, path), message, sizeof(tfsRequest) + size, NULL, 0, NULL, NULL, NULL);
+}
+
+/*
+ * Streamed contents of a file, copied to a buffer as far as they fit
+ */
+typedef struct readBuffer {
+	char *data;
+	size_t size;
+	size_t len; /* bytes received, even past size */
+} readBuffer;
+
+static void copyChunk(char *data, size_t len, void *arg) {
+	readBuffer *buf = arg;
+
+	if (buf->len < buf->size)
+		memcpy(buf->data + buf->len, data, len < buf->size - buf->len ? len : buf->size - buf->len);
+	buf->len += len;
+}
+
+/*
+ * Reads the contents of a file into a buffer.
+ * Input:
+ *  - fs: mounted servers
+ *  - path: path of the file
+ *  - buffer: where the contents are copied
+ *  - size: bytes of buffer, contents past them aren't copied
+ * Returns: length of the contents, which may be larger than size, or an error
+ */
+int tfsRead(tfsHandle *fs, char *path, char *buffer, size_t size) {
+	readBuffer buf = { buffer, size, 0 };
+	tfsRequest message;
+	int res, fd;
+
+	if (snprintf(message.command, sizeof(message.command), "%c %s", TFS_READ_COMMAND, path) >=
+		(int) sizeof(message.command))
+		return TECNICOFS_ERROR_OTHER;
+
+	res = sendMessageFd(fs, routePath(fs, path), &message, sizeof(message.id) + strlen(message.command) + 1, -1,
+		NULL, 0, copyChunk, &buf, NULL, &fd);
+	if (fd >= 0) {
+		/* the server handed over its memfd */
+		for (size_t done = 0; res > 0 && done < size && done < (size_t) res; ) {
+			ssize_t n = pread(fd, buffer + done, (size_t) res - done < size - done ? (size_t) res - done : size - done, done);
+			if (n <= 0) {
+				res = TECNICOFS_ERROR_OTHER;
+				break;
+			}
+			done += n;
+		}
+		close(fd);
+	}
+	return res;
+}
+
+/*
+ * Writes bytes to a file at an offset, growing it if they end past its end
+ * and leaving a hole, read as zeros, if they start past it. Only the blocks
+ * of the file they fall in are copied or changed, so small writes to large
+ * files stay cheap. Bytes up to TFS_MAX_WRITE_INLINE are sent with the
+ * request, more in a memfd which the server copies from.
+ * Input:
+ *  - fs: mounted servers
+ *  - path: path of the file
+ *  - contents: bytes to write
+ *  - size: number of bytes
+ *  - offset: where they are written, TFS_APPEND for the end of the file
+ * Returns: SUCCESS or an error
+ */
+int tfsPwrite(tfsHandle *fs, char *path, char *contents, size_t size, int offset) {
+	char buffer[TFS_MAX_BATCH_SIZE] __attribute__((aligned(8)));
+	tfsRequest *message = (tfsRequest *) buffer;
+	int fd = -1, res;
+
+	if (size > INT_MAX || snprintf(message->command, sizeof(message->command), "%c %s %zu %d", TFS_WRITE_COMMAND,
+		path, size, offset) >= (int) sizeof(message->command))
+		return TECNICOFS_ERROR_OTHER;
+
+	if (size <= TFS_MAX_WRITE_INLINE) {
+		memcpy(buffer + sizeof(tfsRequest), contents, size);
+		return sendMessage(fs, routePath(fs, path), message, sizeof(tfsRequest) + size, NULL, 0, NULL, NULL, NULL);
+	}
+
+	if ((fd = memfd_create("tecnicofs-write", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+		return TECNICOFS_ERROR_OTHER;
+	exportOutput output = { fd, 0 };
+	writeChunk(contents, size, &output);
+	res = output.failed ? TECNICOFS_ERROR_OTHER :
+		sendMessageFd(fs, routePath(fs, path), message, sizeof(tfsRequest), fd, NULL, 0, NULL, NULL, NULL, NULL);
+	close(fd);
+	return res;
+}
+
+/*
+ * Reads a range of a file into a buffer, holes as zeros.
+ * Input:
+ *  - fs: mounted servers
+ *  - path: path of the file
+ *  - buffer: where the bytes are copied
+ *  - size: most bytes read
+ *  - offset: where the range starts
+ * Returns: number of bytes read, fewer than size past the end of the file,
+ *  or an error
+ */
+int tfsPread(tfsHandle *fs, char *path, char *buffer, size_t size, int offset) {
+	readBuffer buf = { buffer, size, 0 };
+	tfsRequest message;
+
+	if (size > INT_MAX || offset < 0 || snprintf(message.command, sizeof(message.command), "%c %s %d %zu",
+		TFS_READ_COMMAND, path, offset, size) >= (int) sizeof(message.command))
+		return TECNICOFS_ERROR_OTHER;
+
+	return sendMessage(fs, routePath(fs, path), &message, sizeof(message.id) + strlen(message.command) + 1,
+		NULL, 0, copyChunk, &buf, NULL);
+}
+
+/*
+ * Streamed contents of a file, written to a memfd created once the first
+ * datagram comes
+ */
+static void memfdChunk(char *data, size_t len, void *arg) {
+	exportOutput *output = arg;
+
+	if (output->fd < 0 && !output->failed &&
+		(output->fd = memfd_create("tecnicofs-read", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+		output->failed = 1;
+	writeChunk(data, len, output);
+}
+
+/*
+ * Reads the contents of a file as a read-only descriptor to map. A server
+ * keeping contents in memfds hands over the sealed memfd of the file, so
+ * mapping it shares its pages with the server instead of copying them;
+ * later writes to the file give it new contents and leave these alone.
+ * Other servers stream the contents into a memfd of the client.
+ * Input:
+ *  - fs: mounted servers
+ *  - path: path of the file
+ *  - fd: set to the descriptor, which the caller must close
+ * Returns: length of the contents or an error
+ */
+int tfsReadFd(tfsHandle *fs, char *path, int *fd) {
+	exportOutput output = { -1, 0 };
+	tfsRequest message;
 	int res;
-	if (recvfrom(sockfd, &res, sizeof(res), 0, 0, 0) < 0) {
-		perror("client: recvfrom error");
-		exit(EXIT_FAILURE);
-	} 
 
-	//printf("Recebeu resposta do servidor: %s\n", buffer);
+	*fd = -1;
+	if (snprintf(message.command, sizeof(message.command), "%c %s", TFS_READ_COMMAND, path) >=
+		(int) sizeof(message.command))
+		return TECNICOFS_ERROR_OTHER;
+
+	res = sendMessageFd(fs, routePath(fs, path), &message, sizeof(message.id) + strlen(message.command) + 1, -1,
+		NULL, 0, memfdChunk, &output, NULL, fd);
+	if (*fd >= 0 || res < 0 || output.failed) {
+		if (output.fd >= 0)
+			close(output.fd);
+		if (output.failed && *fd < 0)
+			res = TECNICOFS_ERROR_OTHER;
+		return res;
+	}
+
+	/* an empty file has no datagram of contents */
+	if (output.fd < 0 && (output.fd = memfd_create("tecnicofs-read", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+		return TECNICOFS_ERROR_OTHER;
+	fcntl(output.fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+	*fd = output.fd;
 	return res;
 }
 
-int tfsMount(char * sockPath) {
-	sprintf(socketName, "/tmp/clientSocketFS_%d", getpid());
-	serverSocket = sockPath; // save the server socket name in a global variable (3aii)
+/*
+ * Cancels a watch on the servers it was sent to.
+ * Returns: SUCCESS or an error
+ */
+static int unwatchServers(tfsHandle *fs, int watch, int server) {
+	char command[MAX_INPUT_SIZE];
+	int status = SUCCESS;
+
+	sprintf(command, "%c %d", TFS_UNWATCH_COMMAND, watch);
+	for (int i = server < 0 ? 0 : server; i < (server < 0 ? fs->numberServers : server + 1); i++) {
+		int res = sendRequest(fs, i, command, NULL);
+		if (res < 0)
+			status = res;
+	}
+	return status;
+}
+
+/*
+ * Watches the creates, deletes and moves of a path and of the entries of
+ * the directory at path, which needn't exist yet, instead of polling it
+ * with lookups. The server pushes the events in batches, coalescing the
+ * ones that come together. Watching the root watches every mounted server.
+ * Input:
+ *  - fs: mounted servers
+ *  - path: path to watch
+ *  - recursive: if not 0, every node below path is watched too
+ *  - callback: called with each event, its type (TFS_EVENT_*) and path,
+ *    from the thread receiving the replies
+ *  - arg: passed to callback
+ * Returns: id of the watch or an error
+ */
+int tfsWatch(tfsHandle *fs, char *path, int recursive, tfsWatchCallback callback, void *arg) {
+	char command[MAX_INPUT_SIZE], *component = path;
+	int watch = 0, server = routePath(fs, path), res = SUCCESS, everyServer;
 
-	if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0) ) < 0) {
-    	perror("client: can't open socket");
-    	exit(EXIT_FAILURE);
-  	}
+	while (*component == '/')
+		component++;
+	everyServer = (*component == '\0');
+	if (strlen(path) >= MAX_INPUT_SIZE - 16)
+		return TECNICOFS_ERROR_OTHER;
+
+	pthread_mutex_lock(&fs->watchLock);
+	while (watch < MAX_WATCHES && fs->watches[watch].callback != NULL)
+		watch++;
+	if (watch == MAX_WATCHES) {
+		pthread_mutex_unlock(&fs->watchLock);
+		return TECNICOFS_ERROR_OTHER;
+	}
+	fs->watches[watch].callback = callback;
+	fs->watches[watch].arg = arg;
+	fs->watches[watch].server = everyServer ? -1 : server;
+	pthread_mutex_unlock(&fs->watchLock);
+
+	sprintf(command, "%c %s %c %d", TFS_WATCH_COMMAND, everyServer ? "/" : path, recursive ? 'r' : 'n', watch + 1);
+	for (int i = everyServer ? 0 : server; i < (everyServer ? fs->numberServers : server + 1) && res >= 0; i++) {
+		res = sendRequest(fs, i, command, NULL);
+	}
+
+	if (res < 0) {
+		unwatchServers(fs, watch + 1, fs->watches[watch].server);
+		pthread_mutex_lock(&fs->watchLock);
+		fs->watches[watch].callback = NULL;
+		pthread_mutex_unlock(&fs->watchLock);
+		return res;
+	}
+	return watch + 1;
+}
+
+/*
+ * Cancels a watch. Events being delivered when it is cancelled may still
+ * reach its callback.
+ * Returns: SUCCESS or an error
+ */
+int tfsUnwatch(tfsHandle *fs, int watch) {
+	int server;
+
+	if (watch <= 0 || watch > MAX_WATCHES)
+		return TECNICOFS_ERROR_OTHER;
+
+	pthread_mutex_lock(&fs->watchLock);
+	if (fs->watches[watch - 1].callback == NULL) {
+		pthread_mutex_unlock(&fs->watchLock);
+		return TECNICOFS_ERROR_OTHER;
+	}
+	server = fs->watches[watch - 1].server;
+	fs->watches[watch - 1].callback = NULL;
+	pthread_mutex_unlock(&fs->watchLock);
+
+	return unwatchServers(fs, watch, server);
+}
+
+int tfsCreateAsync(tfsHandle *fs, char *filename, char nodeType, tfsCallback callback, void *arg) {
+	char message[MAX_INPUT_SIZE];
+	sprintf(message, "c %s %c", filename, nodeType);
+	return submitRequest(fs, routePath(fs, filename), message, callback, arg);
+}
 
-  	clilen = setSockAddrUn(socketName, &client_addr);
-	servlen = setSockAddrUn(serverSocket, &serv_addr);
-	unlink(socketName);
-  	if (bind(sockfd, (struct sockaddr *) &client_addr, clilen) < 0) {
+int tfsDeleteAsync(tfsHandle *fs, char *path, tfsCallback callback, void *arg) {
+	char message[MAX_INPUT_SIZE];
+	sprintf(message, "d %s", path);
+	return submitRequest(fs, routePath(fs, path), message, callback, arg);
+}
+
+int tfsMoveAsync(tfsHandle *fs, char *from, char *to, tfsCallback callback, void *arg) {
+	char message[MAX_INPUT_SIZE];
+	int server = routePath(fs, from);
+
+	if (routePath(fs, to) != server)
+		return TECNICOFS_ERROR_CROSS_SHARD;
+	sprintf(message, "m %s %s", from, to);
+	return submitRequest(fs, server, message, callback, arg);
+}
+
+int tfsLookupAsync(tfsHandle *fs, char *path, tfsCallback callback, void *arg) {
+	char message[MAX_INPUT_SIZE];
+	sprintf(message, "l %s", path);
+	return submitRequest(fs, routePath(fs, path), message, callback, arg);
+}
+
+/*
+ * Mounts several servers as one namespace, each owning the top-level
+ * entries that hash to it (see routePath).
+ * Input:
+ *  - serverNames: sockets of the servers
+ *  - count: number of servers, at most MAX_SERVERS
+ * Returns: handle of the mount or NULL
+ */
+tfsHandle *tfsMountServers(char **serverNames, int count) {
+	tfsHandle *fs;
+	int mount;
+
+	if (count <= 0 || count > MAX_SERVERS || (fs = malloc(sizeof(tfsHandle))) == NULL)
+		return NULL;
+
+	mount = __atomic_fetch_add(&mountCount, 1, __ATOMIC_RELAXED);
+	sprintf(fs->socketName, "/tmp/clientSocketFS_%d_%d", getpid(), mount);
+
+	if ((fs->sockfd = socket(AF_UNIX, SOCK_DGRAM, 0) ) < 0) {
+		perror("client: can't open socket");
+		free(fs);
+		return NULL;
+	}
+
+	fs->clilen = setSockAddrUn(fs->socketName, &fs->client_addr);
+	fs->numberServers = count;
+	for (int server = 0; server < count; server++)
+		fs->servlen[server] = setSockAddrUn(serverNames[server], &fs->serv_addr[server]);
+	unlink(fs->socketName);
+	if (bind(fs->sockfd, (struct sockaddr *) &fs->client_addr, fs->clilen) < 0) {
 		perror("client: bind error");
-    	exit(EXIT_FAILURE);
-  	}
+		close(fs->sockfd);
+		free(fs);
+		return NULL;
+	}
+
+	fs->nextId = 1;
+	fs->invalidations = 0;
+	memset(fs->cache, 0, sizeof(fs->cache));
+	pthread_mutex_init(&fs->cacheLock, NULL);
+	memset(fs->watches, 0, sizeof(fs->watches));
+	pthread_mutex_init(&fs->watchLock, NULL);
+	pthread_mutex_init(&fs->pendingLock, NULL);
+	pthread_cond_init(&fs->slotFree, NULL);
+	for (int i = 0; i < MAX_PENDING; i++) {
+		fs->pending[i].id = 0;
+		pthread_cond_init(&fs->pending[i].completed, NULL);
+	}
+	if (pthread_create(&fs->receiverTid, NULL, receiveReplies, fs) != 0) {
+		perror("client: can't create receiver thread");
+		close(fs->sockfd);
+		unlink(fs->socketName);
+		free(fs);
+		return NULL;
+	}
 
-	return 0;	  
+	for (int server = 0; server < count; server++) {
+		/*
+		 * the server may receive requests on several sockets, pick one by
+		 * pid and mount, so that the mounts of the threads of a process
+		 * spread over them too
+		 */
+		int shards = sendRequest(fs, server, "i", NULL);
+		int shard = shards > 1 ? (getpid() + mount) % shards : 0;
+		if (shard != 0) {
+			char shardSocket[sizeof(fs->serv_addr[server].sun_path)];
+			snprintf(shardSocket, sizeof(shardSocket), "%s.%d", serverNames[server], shard);
+			fs->servlen[server] = setSockAddrUn(shardSocket, &fs->serv_addr[server]);
+		}
+
+		/* points depend on the name only, so every client builds the same ring */
+		for (int i = 0; i < RING_POINTS; i++) {
+			char point[MAX_FILE_NAME + 16];
+			int len = snprintf(point, sizeof(point), "%s#%d", serverNames[server], i);
+			fs->ring[server * RING_POINTS + i].hash = hashName(point, len);
+			fs->ring[server * RING_POINTS + i].server = server;
+		}
+	}
+	qsort(fs->ring, count * RING_POINTS, sizeof(ringPoint), comparePoints);
+
+	return fs;
 }
 
-int tfsUnmount() {
-	unlink(socketName);
-	return -1;
+/*
+ * Mounts a server, or several if sockPath is a comma separated list of sockets.
+ * Returns: handle of the mount or NULL
+ */
+tfsHandle *tfsMount(char * sockPath) {
+	char names[strlen(sockPath) + 1], *serverNames[MAX_SERVERS], *saveptr;
+	int count = 0;
+
+	strcpy(names, sockPath);
+	for (char *name = strtok_r(names, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr)) {
+		if (count == MAX_SERVERS)
+			return NULL;
+		serverNames[count++] = name;
+	}
+	return tfsMountServers(serverNames, count);
+}
+
+int tfsUnmount(tfsHandle *fs) {
+	tfsReply stop = { STOP_ID, 0, 0 };
+
+	for (int watch = 1; watch <= MAX_WATCHES; watch++) {
+		if (fs->watches[watch - 1].callback != NULL)
+			tfsUnwatch(fs, watch);
+	}
+
+	/* wake up the receiver thread with a datagram only it understands */
+	sendto(fs->sockfd, &stop, sizeof(stop), 0, (struct sockaddr *) &fs->client_addr, fs->clilen);
+	pthread_join(fs->receiverTid, NULL);
+
+	close(fs->sockfd);
+	unlink(fs->socketName);
+	pthread_mutex_destroy(&fs->pendingLock);
+	pthread_cond_destroy(&fs->slotFree);
+	pthread_mutex_destroy(&fs->cacheLock);
+	pthread_mutex_destroy(&fs->watchLock);
+	for (int i = 0; i < MAX_PENDING; i++) {
+		pthread_cond_destroy(&fs->pending[i].completed);
+	}
+	free(fs);
+	return SUCCESS;
 }
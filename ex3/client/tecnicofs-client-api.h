@@ -1,14 +1,80 @@
 #ifndef API_H
 #define API_H
 
+#include <stddef.h>
 #include "tecnicofs-api-constants.h"
 
-int tfsCreate(char *path, char nodeType);
-int tfsDelete(char *path);
-int tfsLookup(char *path);
-int tfsMove(char *from, char *to);
-int tfsPrint(char *outputfile);
-int tfsMount(char* serverName);
-int tfsUnmount();
+/*
+ * A mounted server. It owns a socket and the ids of its requests, and may
+ * be shared by several threads, each getting the replies to its requests.
+ * Mounting several servers spreads the top-level entries of the namespace
+ * over them by consistent hashing, moves across servers fail with
+ * TECNICOFS_ERROR_CROSS_SHARD.
+ */
+typedef struct tfsMountHandle tfsHandle;
+
+int tfsCreate(tfsHandle *fs, char *path, char nodeType);
+int tfsDelete(tfsHandle *fs, char *path);
+int tfsDeleteRecursive(tfsHandle *fs, char *path);
+int tfsLookup(tfsHandle *fs, char *path);
+int tfsMove(tfsHandle *fs, char *from, char *to);
+int tfsClone(tfsHandle *fs, char *from, char *to);
+int tfsPrint(tfsHandle *fs, char *outputfile);
+int tfsExport(tfsHandle *fs, char *path, char format, int fd);
+int tfsReaddir(tfsHandle *fs, char *path, int *cursor, tfsDirEntry *entries);
+int tfsStat(tfsHandle *fs, char *path, tfsNodeStat *st);
+int tfsStatBulk(tfsHandle *fs, char **paths, int count, tfsNodeStat *stats);
+int tfsUsage(tfsHandle *fs, tfsUsageStat *usage);
+int tfsWrite(tfsHandle *fs, char *path, char *contents, size_t size);
+int tfsWriteFd(tfsHandle *fs, char *path, int fd);
+int tfsRead(tfsHandle *fs, char *path, char *buffer, size_t size);
+int tfsReadFd(tfsHandle *fs, char *path, int *fd);
+int tfsPwrite(tfsHandle *fs, char *path, char *contents, size_t size, int offset);
+int tfsPread(tfsHandle *fs, char *path, char *buffer, size_t size, int offset);
+
+/* called with the path of each match of a find */
+typedef void (*tfsMatch)(char *path, void *arg);
+
+int tfsFind(tfsHandle *fs, char *path, char *pattern, tfsMatch match, void *arg);
+
+/* called with each event of a watch: its type, a TFS_EVENT_*, and path */
+typedef void (*tfsWatchCallback)(int watch, char event, char *path, void *arg);
+
+int tfsWatch(tfsHandle *fs, char *path, int recursive, tfsWatchCallback callback, void *arg);
+int tfsUnwatch(tfsHandle *fs, int watch);
+
+tfsHandle *tfsMount(char* serverName);
+tfsHandle *tfsMountServers(char **serverNames, int count);
+int tfsUnmount(tfsHandle *fs);
+
+/*
+ * An operation of a batch: 'c' creates path with nodeType ('f' or 'd'),
+ * 'd' deletes path, 'D' deletes path and everything below it, 'l' looks
+ * path up, 'm' moves path to to and 'C' clones path as to.
+ */
+typedef struct tfsOperation {
+	char type;
+	char *path;
+	char *to;
+	char nodeType;
+} tfsOperation;
+
+int tfsBatch(tfsHandle *fs, tfsOperation *ops, int count, int *results);
+
+/*
+ * Asynchronous variants: they return the handle of the request as soon as
+ * it is sent. When the reply arrives the callback is called, from a thread
+ * of the library, with the handle, the status the synchronous call would
+ * have returned and arg. Without a callback the status must be collected
+ * with tfsWait. Requests rejected with TECNICOFS_ERROR_SERVER_BUSY are not
+ * retried.
+ */
+typedef void (*tfsCallback)(int handle, int status, void *arg);
+
+int tfsCreateAsync(tfsHandle *fs, char *path, char nodeType, tfsCallback callback, void *arg);
+int tfsDeleteAsync(tfsHandle *fs, char *path, tfsCallback callback, void *arg);
+int tfsLookupAsync(tfsHandle *fs, char *path, tfsCallback callback, void *arg);
+int tfsMoveAsync(tfsHandle *fs, char *from, char *to, tfsCallback callback, void *arg);
+int tfsWait(tfsHandle *fs, int handle);
 
 #endif /* CLIENT_H */
@@ -1,10 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "tecnicofs-client-api.h"
 #include "../tecnicofs-api-constants.h"
 
 FILE* inputFile;
 char* serverName;
+tfsHandle *fs;
 
 static void displayUsage (const char* appName) {
 	printf("Usage: %s inputfile server_socket_name\n", appName);
@@ -54,14 +58,14 @@ void *processInput() {
 				}
 				switch (arg2[0]) {
 					case 'f':
-						res = tfsCreate(arg1, 'f');
+						res = tfsCreate(fs, arg1, 'f');
 						if (!res)
 						  printf("Created file: %s\n", arg1);
 						else
 						  printf("Unable to create file: %s\n", arg1);
 						break;
 					case 'd':
-						res = tfsCreate(arg1, 'd');
+						res = tfsCreate(fs, arg1, 'd');
 						if (!res)
 						  printf("Created directory: %s\n", arg1);
 						else
@@ -75,7 +79,7 @@ void *processInput() {
 			case 'l':
 				if(numTokens != 2)
 					errorParse();
-				res = tfsLookup(arg1);
+				res = tfsLookup(fs, arg1);
 				if (res >= 0)
 					printf("Search: %s found\n", arg1);
 				else
@@ -85,7 +89,7 @@ void *processInput() {
 			case 'd':
 				if(numTokens != 2)
 					errorParse();
-				res = tfsDelete(arg1);
+				res = tfsDelete(fs, arg1);
 				if (!res)
 				  printf("Deleted: %s\n", arg1);
 				else
@@ -95,21 +99,71 @@ void *processInput() {
 			case 'm':
 				if(numTokens != 3)
 					errorParse();
-				res = tfsMove(arg1, arg2);
+				res = tfsMove(fs, arg1, arg2);
 				if (!res)
 				  	printf("Moved: %s to %s\n", arg1, arg2);
 				else
 					printf("Unable to move: %s to %s\n", arg1, arg2);
 				break;
 
+			case 'C':
+				if(numTokens != 3)
+					errorParse();
+				res = tfsClone(fs, arg1, arg2);
+				if (!res)
+				  	printf("Cloned: %s to %s\n", arg1, arg2);
+				else
+					printf("Unable to clone: %s to %s\n", arg1, arg2);
+				break;
+
 			case 'p':
 				if (numTokens != 2)
 					errorParse();
-				res = tfsPrint(arg1);
+				res = tfsPrint(fs, arg1);
 				if (!res)
 					printf("Printed tree to file %s\n", arg1);
 				else
 					printf("Unable to print tree\n");
+				break;
+
+			case 'e': {
+				int fd;
+
+				if (numTokens != 2)
+					errorParse();
+				fd = open(arg1, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+				res = fd < 0 ? TECNICOFS_ERROR_OTHER : tfsExport(fs, "/", 't', fd);
+				if (fd >= 0)
+					close(fd);
+				if (res >= 0)
+					printf("Exported %d nodes to file %s\n", res, arg1);
+				else
+					printf("Unable to export tree\n");
+				break;
+			}
+			case 'w':
+				if (numTokens != 3)
+					errorParse();
+				res = tfsWrite(fs, arg1, arg2, strlen(arg2));
+				if (!res)
+					printf("Wrote: %s\n", arg1);
+				else
+					printf("Unable to write: %s\n", arg1);
+				break;
+
+			case 'R': {
+				char contents[MAX_INPUT_SIZE];
+
+				if (numTokens != 2)
+					errorParse();
+				res = tfsRead(fs, arg1, contents, sizeof(contents) - 1);
+				if (res >= 0) {
+					contents[res < (int) sizeof(contents) - 1 ? res : (int) sizeof(contents) - 1] = '\0';
+					printf("Read: %s: %s\n", arg1, contents);
+				} else
+					printf("Unable to read: %s\n", arg1);
+				break;
+			}
 			case '#':
 				break;
 			default: { /* error */
@@ -124,7 +178,7 @@ void *processInput() {
 int main(int argc, char* argv[]) {
 	parseArgs(argc, argv);
 
-	if (tfsMount(serverName) == 0)
+	if ((fs = tfsMount(serverName)) != NULL)
 	  	printf("Mounted! (socket = %s)\n", serverName);
 	else {
 		fprintf(stderr, "Unable to mount socket: %s\n", serverName);
@@ -133,7 +187,7 @@ int main(int argc, char* argv[]) {
 
 	processInput();
 
-	tfsUnmount();
+	tfsUnmount(fs);
 
 	exit(EXIT_SUCCESS);
 }
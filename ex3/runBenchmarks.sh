@@ -0,0 +1,53 @@
+#!/bin/bash
+
+# arguments
+mix=$1
+maxthreads=$2
+processes=${3:-4}
+loops=${4:-10}
+
+# check the mix and the integers
+if ! [[ $mix =~ ^(lookup|create|move)$ ]]; then
+   echo "Mix must be lookup, create or move." >&2; exit 1
+fi
+for n in "$maxthreads" "$processes" "$loops"; do
+    if ! [[ $n =~ ^[0-9]+$ ]] || [ ! $n -gt 0 ]; then
+        echo "Maxthreads, processes and loops must be integers greater than 0." >&2; exit 1
+    fi
+done
+
+cd "$(dirname "$0")"
+make -s -C server tecnicofs && make -s -C client tecnicofs-bench || exit 1
+
+# a fresh server on a temporary socket for each thread count, without leases
+# so that every lookup reaches it
+socket=$(mktemp -u /tmp/tecnicofs-bench.XXXXXX)
+server=
+trap '[ -n "$server" ] && kill $server 2>/dev/null; rm -f $socket*' EXIT
+
+summary=$(printf "%-8s %10s %8s %8s %8s\n" "threads" "ops/s" "p50" "p99" "p99.9")
+numthreads=1
+while [ $numthreads -le $maxthreads ]; do
+    server/tecnicofs -l 0 -v 0 $numthreads $socket &
+    server=$!
+    for i in $(seq 50); do [ -S $socket ] && break; sleep 0.1; done
+
+    echo "Mix=$mix NumThreads=$numthreads Processes=$processes Loops=$loops"
+    report=$(client/tecnicofs-bench -g $mix -P $processes -n $loops $socket) || exit 1
+    echo "$report"
+    summary+=$'\n'$(echo "$report" | awk -v t=$numthreads '$1 == "all" { printf "%-8s %10s %8s %8s %8s", t, $3, $6, $8, $9 }')
+
+    kill $server; wait $server 2>/dev/null
+    server=
+    rm -f $socket*
+
+    # powers of two, then maxthreads
+    if [ $numthreads -lt $maxthreads ] && [ $((numthreads * 2)) -gt $maxthreads ]; then
+        numthreads=$maxthreads
+    else
+        numthreads=$((numthreads * 2))
+    fi
+done
+
+echo
+echo "$summary"
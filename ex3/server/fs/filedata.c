@@ -0,0 +1,788 @@
+#define _GNU_SOURCE /* memfd_create and file seals */
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "filedata.h"
+#include "state.h"
+#include "lz.h"
+#include "sha256.h"
+#include "../log.h"
+
+/*
+ * Bytes of a sealed memfd, mapped read-only
+ */
+struct fileMapping {
+	int fd;
+	char *bytes;
+	size_t len;
+};
+
+/*
+ * A block of a file, whose bytes follow it, compressed or not, or are in a
+ * mapping. Bytes past the end of the file in its last block are zeros.
+ */
+typedef struct fileBlock {
+	char *bytes;
+	fileMapping *mapping; /* NULL if the bytes follow the block */
+	int stored; /* bytes held, fewer than FILE_BLOCK_SIZE if compressed */
+	int pooled; /* if it is in the pool, which makes it immutable */
+	unsigned long id; /* key of a compressed block in the cache */
+	unsigned char hash[SHA256_SIZE]; /* of its bytes decompressed, if pooled */
+	struct fileBlock *next; /* in its bucket of the pool */
+} fileBlock;
+
+typedef struct fileNode {
+	void *slots[FILE_FANOUT]; /* nodes or, at the lowest level, blocks, NULL for holes */
+} fileNode;
+
+/*
+ * A block decompressed lately
+ */
+typedef struct cacheSlot {
+	pthread_mutex_t lock;
+	unsigned long id; /* of the block, 0 if the slot is empty */
+	char bytes[FILE_BLOCK_SIZE];
+} cacheSlot;
+
+/*
+ * Pool of the blocks written while deduplication is on, by the hash of
+ * their bytes. The pool holds no reference, a block leaves it as its last
+ * one is dropped, which is done holding the lock of its bucket.
+ */
+typedef struct blockPool {
+	fileBlock *buckets[FILE_POOL_BUCKETS];
+	pthread_mutex_t locks[FILE_POOL_LOCKS]; /* of buckets with the same index modulo FILE_POOL_LOCKS */
+	long long blocks; /* distinct blocks in the pool */
+	long long refs; /* references to them, from files and clones */
+} blockPool;
+
+/* changes a block, taking over the reference to the old one */
+typedef fileBlock *(*block_update)(fileBlock *old, void *arg);
+
+/* if contents are kept in sealed memfds */
+static int memfdStorage = 0;
+/* if blocks are compressed */
+static int compressBlocks = 0;
+/* if identical blocks are stored once */
+static int dedupBlocks = 0;
+static blockPool pool;
+/* what holes read as */
+static char zeros[FILE_BLOCK_SIZE];
+
+/* compressed blocks by id modulo FILE_CACHE_BLOCKS */
+static cacheSlot cache[FILE_CACHE_BLOCKS];
+static unsigned long nextBlockId = 0;
+
+/* totals of the blocks in use, each counted once however many files share it */
+static long long usedBytes = 0;
+static long long storedBytes = 0;
+static long long cacheHits = 0;
+static long long cacheMisses = 0;
+
+
+/*
+ * Chooses how the contents of files are kept, before any is written.
+ * Input:
+ *  - memfd: if contents written whole from a memfd keep it, sealed, so
+ *    that readers can be handed it instead of a copy
+ *  - compress: if blocks written are compressed (see lz_compress) when
+ *    that saves at least an eighth of them
+ *  - dedup: if blocks written go through the pool, so that identical
+ *    blocks of any files are stored once
+ */
+void file_set_storage(int memfd, int compress, int dedup) {
+	memfdStorage = memfd;
+	compressBlocks = compress;
+	dedupBlocks = dedup;
+	for (int i = 0; i < FILE_CACHE_BLOCKS; i++) {
+		pthread_mutex_init(&cache[i].lock, NULL);
+		cache[i].id = 0;
+	}
+	for (int i = 0; i < FILE_POOL_LOCKS; i++)
+		pthread_mutex_init(&pool.locks[i], NULL);
+}
+
+/*
+ * Gets the totals of the blocks of all files: the compression ratio is
+ * used / stored, the deduplication ratio poolRefs / poolBlocks.
+ * Input:
+ *  - usage: set to the totals
+ */
+void file_usage(tfsUsageStat *usage) {
+	usage->used = __atomic_load_n(&usedBytes, __ATOMIC_RELAXED);
+	usage->stored = __atomic_load_n(&storedBytes, __ATOMIC_RELAXED);
+	usage->cacheHits = __atomic_load_n(&cacheHits, __ATOMIC_RELAXED);
+	usage->cacheMisses = __atomic_load_n(&cacheMisses, __ATOMIC_RELAXED);
+	usage->poolBlocks = __atomic_load_n(&pool.blocks, __ATOMIC_RELAXED);
+	usage->poolRefs = __atomic_load_n(&pool.refs, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns: the blocks below a node at a height
+ */
+static long tree_span(int height) {
+	long span = 1;
+
+	while (height-- > 0)
+		span *= FILE_FANOUT;
+	return span;
+}
+
+static void mapping_release(fileMapping *mapping) {
+	if (data_unref(mapping) > 0)
+		return;
+	if (mapping->len > 0)
+		munmap(mapping->bytes, mapping->len);
+	close(mapping->fd);
+	data_free(mapping);
+}
+
+/*
+ * Allocates a block, with its bytes following it or in a mapping.
+ * Input:
+ *  - stored: bytes following it, fewer than FILE_BLOCK_SIZE if compressed
+ *  - mapping: mapping holding the bytes, whose reference it takes, or NULL
+ * Returns: the block
+ */
+static fileBlock *block_alloc(int stored, fileMapping *mapping) {
+	fileBlock *block = data_alloc(sizeof(fileBlock) + (mapping ? 0 : stored));
+
+	block->bytes = (char *) (block + 1);
+	block->mapping = mapping;
+	block->stored = stored;
+	block->pooled = 0;
+	block->id = stored < FILE_BLOCK_SIZE ? __atomic_add_fetch(&nextBlockId, 1, __ATOMIC_RELAXED) : 0;
+	__atomic_fetch_add(&usedBytes, FILE_BLOCK_SIZE, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&storedBytes, stored, __ATOMIC_RELAXED);
+	return block;
+}
+
+static unsigned long pool_bucket(unsigned char *hash) {
+	unsigned long key;
+
+	memcpy(&key, hash, sizeof(key));
+	return key % FILE_POOL_BUCKETS;
+}
+
+static void block_release(fileBlock *block) {
+	if (block->pooled) {
+		unsigned long bucket = pool_bucket(block->hash);
+		pthread_mutex_t *lock = &pool.locks[bucket % FILE_POOL_LOCKS];
+
+		/* a lookup of the pool can't take a reference meanwhile */
+		pthread_mutex_lock(lock);
+		__atomic_fetch_sub(&pool.refs, 1, __ATOMIC_RELAXED);
+		if (data_unref(block) > 0) {
+			pthread_mutex_unlock(lock);
+			return;
+		}
+		for (fileBlock **p = &pool.buckets[bucket]; *p != NULL; p = &(*p)->next) {
+			if (*p == block) {
+				*p = block->next;
+				break;
+			}
+		}
+		pthread_mutex_unlock(lock);
+		__atomic_fetch_sub(&pool.blocks, 1, __ATOMIC_RELAXED);
+	} else if (data_unref(block) > 0) {
+		return;
+	}
+
+	__atomic_fetch_sub(&usedBytes, FILE_BLOCK_SIZE, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&storedBytes, block->stored, __ATOMIC_RELAXED);
+	if (block->mapping)
+		mapping_release(block->mapping);
+	data_free(block);
+}
+
+/*
+ * Makes a block of bytes, compressed if that is on and saves enough.
+ * Input:
+ *  - bytes: FILE_BLOCK_SIZE bytes
+ * Returns: the block
+ */
+static fileBlock *block_pack(char *bytes) {
+	char packed[FILE_BLOCK_SIZE];
+	int len = compressBlocks ? lz_compress(bytes, FILE_BLOCK_SIZE, packed, FILE_BLOCK_SIZE - FILE_BLOCK_SIZE / 8) : 0;
+	fileBlock *block = block_alloc(len > 0 ? len : FILE_BLOCK_SIZE, NULL);
+
+	memcpy(block->bytes, len > 0 ? packed : bytes, block->stored);
+	return block;
+}
+
+/*
+ * Takes another reference to a block or a node of a tree.
+ */
+static void slot_ref(void *ptr, int height) {
+	if (height == 0 && ((fileBlock *) ptr)->pooled)
+		__atomic_fetch_add(&pool.refs, 1, __ATOMIC_RELAXED);
+	data_ref(ptr);
+}
+
+/*
+ * Finds a block in the pool.
+ * Returns: the block, with a new reference, or NULL
+ */
+static fileBlock *pool_find(unsigned long bucket, unsigned char *hash) {
+	for (fileBlock *block = pool.buckets[bucket]; block != NULL; block = block->next) {
+		if (memcmp(block->hash, hash, SHA256_SIZE) == 0) {
+			data_ref(block);
+			__atomic_fetch_add(&pool.refs, 1, __ATOMIC_RELAXED);
+			return block;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Gets the block of the pool with some bytes, adding one if there is none.
+ * Input:
+ *  - bytes: FILE_BLOCK_SIZE bytes
+ *  - hash: their hash
+ * Returns: the block, with a new reference
+ */
+static fileBlock *pool_intern(char *bytes, unsigned char *hash) {
+	unsigned long bucket = pool_bucket(hash);
+	pthread_mutex_t *lock = &pool.locks[bucket % FILE_POOL_LOCKS];
+	fileBlock *block, *found;
+
+	pthread_mutex_lock(lock);
+	block = pool_find(bucket, hash);
+	pthread_mutex_unlock(lock);
+	if (block)
+		return block;
+
+	/* compressed without the lock, another thread may add the same block meanwhile */
+	block = block_pack(bytes);
+	memcpy(block->hash, hash, SHA256_SIZE);
+	pthread_mutex_lock(lock);
+	if ((found = pool_find(bucket, hash)) == NULL) {
+		block->pooled = 1;
+		block->next = pool.buckets[bucket];
+		pool.buckets[bucket] = block;
+		__atomic_fetch_add(&pool.blocks, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&pool.refs, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(lock);
+	if (found) {
+		block_release(block);
+		return found;
+	}
+	return block;
+}
+
+/*
+ * Gets the bytes of a block, decompressing them into raw unless they are
+ * in the cache. Hot blocks stay in the cache, as they are looked up first.
+ * Input:
+ *  - block: the block
+ *  - raw: FILE_BLOCK_SIZE bytes to decompress into
+ * Returns: the bytes, in the block itself if it isn't compressed, or raw
+ */
+static char *block_bytes(fileBlock *block, char *raw) {
+	cacheSlot *slot;
+
+	if (block->stored == FILE_BLOCK_SIZE)
+		return block->bytes;
+
+	slot = &cache[block->id % FILE_CACHE_BLOCKS];
+	pthread_mutex_lock(&slot->lock);
+	if (slot->id == block->id) {
+		memcpy(raw, slot->bytes, FILE_BLOCK_SIZE);
+		pthread_mutex_unlock(&slot->lock);
+		__atomic_fetch_add(&cacheHits, 1, __ATOMIC_RELAXED);
+		return raw;
+	}
+	pthread_mutex_unlock(&slot->lock);
+
+	__atomic_fetch_add(&cacheMisses, 1, __ATOMIC_RELAXED);
+	if (lz_decompress(block->bytes, block->stored, raw, FILE_BLOCK_SIZE) != FILE_BLOCK_SIZE) {
+		log_error("file: corrupt block %lu\n", block->id);
+		memset(raw, 0, FILE_BLOCK_SIZE);
+		return raw;
+	}
+	pthread_mutex_lock(&slot->lock);
+	memcpy(slot->bytes, raw, FILE_BLOCK_SIZE);
+	slot->id = block->id;
+	pthread_mutex_unlock(&slot->lock);
+	return raw;
+}
+
+/*
+ * Drops a reference to a subtree, freeing the nodes and blocks left
+ * without any.
+ */
+static void tree_release(void *ptr, int height) {
+	fileNode *node = ptr;
+
+	if (ptr == NULL)
+		return;
+	if (height == 0) {
+		block_release(ptr);
+		return;
+	}
+	if (data_unref(node) > 0)
+		return;
+	for (int i = 0; i < FILE_FANOUT; i++)
+		tree_release(node->slots[i], height - 1);
+	data_free(node);
+}
+
+/*
+ * Gives the contents being written a node of their own, copying it if
+ * other contents share it. The path is made private from the root down,
+ * so a node with a single reference below a private one is private too.
+ * Input:
+ *  - node: node to change, taken over, or NULL for a hole
+ *  - height: height of the node
+ * Returns: the private node
+ */
+static fileNode *node_private(fileNode *node, int height) {
+	fileNode *copy;
+
+	if (node != NULL && data_refs(node) == 1)
+		return node;
+
+	copy = data_alloc(sizeof(fileNode));
+	if (node == NULL) {
+		memset(copy, 0, sizeof(fileNode));
+		return copy;
+	}
+	memcpy(copy, node, sizeof(fileNode));
+	for (int i = 0; i < FILE_FANOUT; i++) {
+		if (copy->slots[i])
+			slot_ref(copy->slots[i], height - 1);
+	}
+	tree_release(node, height);
+	return copy;
+}
+
+/*
+ * Changes a block of a subtree, copying the nodes on the way that are
+ * shared.
+ * Input:
+ *  - ptr: root of the subtree, taken over
+ *  - height: its height
+ *  - index: index of the block in the subtree
+ *  - update: called with the block, NULL for a hole, returns the new one
+ *  - arg: passed to update
+ * Returns: the new root of the subtree
+ */
+static void *tree_update(void *ptr, int height, long index, block_update update, void *arg) {
+	fileNode *node;
+	long span;
+
+	if (height == 0)
+		return update(ptr, arg);
+
+	node = node_private(ptr, height);
+	span = tree_span(height - 1);
+	node->slots[index / span] = tree_update(node->slots[index / span], height - 1, index % span, update, arg);
+	return node;
+}
+
+/*
+ * Returns: the block at an index, NULL for a hole
+ */
+static fileBlock *tree_find(fileData *file, long index) {
+	void *ptr = file->root;
+	long span = tree_span(file->height - 1);
+
+	for (int height = file->height; height > 0 && ptr != NULL; height--) {
+		ptr = ((fileNode *) ptr)->slots[index / span];
+		index %= span;
+		span /= FILE_FANOUT;
+	}
+	return ptr;
+}
+
+/*
+ * Calls block for each block of a subtree in order, skipping holes.
+ * Returns: SUCCESS or FAIL, as soon as block fails
+ */
+static int tree_walk(void *ptr, int height, long base, int (*block)(int index, char *bytes, void *arg), void *arg) {
+	long span = tree_span(height - 1);
+
+	if (ptr == NULL)
+		return SUCCESS;
+	if (height == 0) {
+		char raw[FILE_BLOCK_SIZE];
+
+		return block(base, block_bytes(ptr, raw), arg);
+	}
+
+	for (int i = 0; i < FILE_FANOUT; i++) {
+		if (tree_walk(((fileNode *) ptr)->slots[i], height - 1, base + i * span, block, arg) == FAIL)
+			return FAIL;
+	}
+	return SUCCESS;
+}
+
+
+/*
+ * Part of a write falling in a single block
+ */
+typedef struct blockWrite {
+	fileData *file;
+	char *bytes;
+	int at;
+	int len;
+	fileBlock *block; /* new block, got from the pool beforehand, or NULL */
+} blockWrite;
+
+/*
+ * Gets the new bytes of a block written partly.
+ * Input:
+ *  - old: the block, NULL for a hole
+ *  - w: the part written
+ *  - raw: FILE_BLOCK_SIZE bytes where they are put together
+ */
+static void merge_block(fileBlock *old, blockWrite *w, char *raw) {
+	char *prev = old ? block_bytes(old, raw) : zeros;
+
+	if (prev != raw)
+		memcpy(raw, prev, FILE_BLOCK_SIZE);
+	memcpy(raw + w->at, w->bytes, w->len);
+}
+
+/*
+ * Gets the blocks of consecutive parts of a write from the pool. All are
+ * hashed before any is looked up, so hashing runs in a tight loop over the
+ * batch, away from the locks of the pool.
+ * Input:
+ *  - file: file written
+ *  - w: the parts, at most FILE_HASH_BATCH
+ *  - n: number of parts
+ *  - first: index of the block of the first part
+ */
+static void pool_blocks(fileData *file, blockWrite *w, int n, long first) {
+	char raw[FILE_HASH_BATCH][FILE_BLOCK_SIZE], *bytes[FILE_HASH_BATCH];
+	unsigned char hash[FILE_HASH_BATCH][SHA256_SIZE];
+
+	for (int i = 0; i < n; i++) {
+		bytes[i] = w[i].bytes;
+		if (w[i].len < FILE_BLOCK_SIZE) {
+			merge_block(tree_find(file, first + i), &w[i], raw[i]);
+			bytes[i] = raw[i];
+		}
+	}
+	for (int i = 0; i < n; i++)
+		sha256(bytes[i], FILE_BLOCK_SIZE, hash[i]);
+	for (int i = 0; i < n; i++)
+		w[i].block = pool_intern(bytes[i], hash[i]);
+}
+
+static fileBlock *write_block(fileBlock *old, void *arg) {
+	blockWrite *w = arg;
+	char raw[FILE_BLOCK_SIZE], *bytes = w->bytes;
+	fileBlock *block = w->block;
+
+	/* a plain block nothing else refers to is written in place, unless it is mapped read-only */
+	if (block == NULL && old != NULL && old->mapping == NULL && old->stored == FILE_BLOCK_SIZE &&
+		!old->pooled && data_refs(old) == 1 && !compressBlocks) {
+		memcpy(old->bytes + w->at, w->bytes, w->len);
+		return old;
+	}
+
+	/* others are rebuilt, and compressed again if that is on */
+	if (block == NULL) {
+		if (w->len < FILE_BLOCK_SIZE) {
+			merge_block(old, w, raw);
+			bytes = raw;
+		}
+		block = block_pack(bytes);
+	}
+	w->file->stored += block->stored;
+	if (old) {
+		w->file->stored -= old->stored;
+		block_release(old);
+	}
+	return block;
+}
+
+static fileBlock *put_block(fileBlock *old, void *arg) {
+	if (old)
+		block_release(old);
+	return arg;
+}
+
+/*
+ * Writes bytes to a file, growing it and leaving a hole if the offset is
+ * past its end. Only the blocks written and the nodes above them are new:
+ * contents nothing else refers to are changed in place, others are
+ * copied along the path to those blocks and share the rest.
+ * Input:
+ *  - file: contents written, whose reference is taken over, NULL if empty
+ *  - bytes: bytes to write
+ *  - len: number of bytes
+ *  - offset: where they are written, FILE_APPEND for the end of the file
+ * Returns: the contents written, with a single reference, or NULL without
+ *  taking over file if it would grow past INT_MAX bytes
+ */
+fileData *file_write(fileData *file, char *bytes, size_t len, int offset) {
+	long long end;
+
+	if (offset == FILE_APPEND)
+		offset = file ? file->size : 0;
+	end = (long long) offset + len;
+	if (offset < 0 || end > INT_MAX)
+		return NULL;
+
+	if (file == NULL || data_refs(file) > 1) {
+		fileData *copy = data_alloc(sizeof(fileData));
+
+		if (file) {
+			*copy = *file;
+			if (copy->root)
+				slot_ref(copy->root, copy->height);
+			file_release(file);
+		} else {
+			copy->size = copy->height = 0;
+			copy->stored = 0;
+			copy->root = NULL;
+		}
+		copy->whole = NULL;
+		file = copy;
+	} else if (file->whole) {
+		/* the memfd no longer holds the contents */
+		mapping_release(file->whole);
+		file->whole = NULL;
+	}
+
+	if (len == 0)
+		return file;
+
+	/* add levels on top until the tree spans the end */
+	while (tree_span(file->height) * FILE_BLOCK_SIZE < end) {
+		if (file->root) {
+			fileNode *node = data_alloc(sizeof(fileNode));
+
+			memset(node, 0, sizeof(fileNode));
+			node->slots[0] = file->root;
+			file->root = node;
+		}
+		file->height++;
+	}
+
+	for (size_t done = 0; done < len; ) {
+		blockWrite w[FILE_HASH_BATCH];
+		long first = (offset + done) / FILE_BLOCK_SIZE;
+		int n = 0;
+
+		/* pooled blocks are made a batch at a time */
+		while (n < (dedupBlocks ? FILE_HASH_BATCH : 1) && done < len) {
+			long long pos = offset + done;
+			blockWrite *part = &w[n++];
+
+			part->file = file;
+			part->bytes = bytes + done;
+			part->at = pos % FILE_BLOCK_SIZE;
+			part->len = FILE_BLOCK_SIZE - part->at < (long long) (len - done) ?
+				FILE_BLOCK_SIZE - part->at : (int) (len - done);
+			part->block = NULL;
+			done += part->len;
+		}
+		if (dedupBlocks)
+			pool_blocks(file, w, n, first);
+		for (int i = 0; i < n; i++)
+			file->root = tree_update(file->root, file->height, first + i, write_block, &w[i]);
+	}
+
+	if (end > file->size)
+		file->size = end;
+	return file;
+}
+
+/*
+ * Allocates new contents for a file, with a single reference, copying them.
+ * Input:
+ *  - contents: bytes of the file
+ *  - len: number of bytes
+ * Returns: the contents or NULL
+ */
+fileData *file_alloc(char *contents, size_t len) {
+	return file_write(NULL, contents, len, 0);
+}
+
+/*
+ * Makes the bytes of a memfd the contents of a file, without copying them
+ * when contents are kept in memfds: it is sealed, so nobody can change it
+ * any more, mapped read-only, and its pages become the blocks of the file.
+ * Otherwise, if blocks are compressed or pooled, or if it can't be sealed
+ * (another process still has it mapped for writing), they are read into a
+ * buffer of the server, as the client may still shrink or change it.
+ * Input:
+ *  - fd: file descriptor of the bytes, which is taken over
+ * Returns: the contents, with a single reference, or NULL
+ */
+fileData *file_adopt(int fd) {
+	int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+	int current = fcntl(fd, F_GET_SEALS), sealed;
+	struct stat st;
+	fileMapping *mapping;
+	fileData *file;
+	char *bytes;
+	ssize_t n = 0;
+	off_t len = 0;
+
+	/* before its size is read, which the mapping relies on */
+	sealed = memfdStorage && !compressBlocks && !dedupBlocks && current >= 0 &&
+		((current & seals) == seals || fcntl(fd, F_ADD_SEALS, seals | F_SEAL_SEAL) == 0);
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size > INT_MAX) {
+		close(fd);
+		return NULL;
+	}
+
+	if (sealed) {
+		long blocks = (st.st_size + FILE_BLOCK_SIZE - 1) / FILE_BLOCK_SIZE;
+
+		mapping = data_alloc(sizeof(fileMapping));
+		mapping->fd = fd;
+		mapping->len = st.st_size;
+		mapping->bytes = NULL;
+		if (st.st_size > 0) {
+			mapping->bytes = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (mapping->bytes == MAP_FAILED) {
+				close(fd);
+				data_free(mapping);
+				return NULL;
+			}
+		}
+
+		file = file_write(NULL, NULL, 0, 0);
+		file->size = st.st_size;
+		while (tree_span(file->height) < blocks)
+			file->height++;
+		for (long i = 0; i < blocks; i++) {
+			fileBlock *block = block_alloc(FILE_BLOCK_SIZE, mapping);
+
+			block->bytes = mapping->bytes + i * FILE_BLOCK_SIZE;
+			data_ref(mapping);
+			file->root = tree_update(file->root, file->height, i, put_block, block);
+		}
+		file->stored = blocks * FILE_BLOCK_SIZE;
+		/* the reference of the mapping itself */
+		file->whole = mapping;
+		return file;
+	}
+
+	/* up to the size it had, or less if it was truncated meanwhile */
+	bytes = malloc(st.st_size > 0 ? st.st_size : 1);
+	while (bytes && len < st.st_size) {
+		n = pread(fd, bytes + len, st.st_size - len, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		len += n;
+	}
+	close(fd);
+	file = bytes && n >= 0 ? file_alloc(bytes, len) : NULL;
+	free(bytes);
+	return file;
+}
+
+/*
+ * Reads a range of a file, holes as zeros.
+ * Input:
+ *  - file: contents read, NULL if empty
+ *  - offset: where the range starts
+ *  - len: most bytes read, fewer past the end of the file
+ *  - out: called with the bytes in order
+ *  - arg: passed to out
+ * Returns: number of bytes read or FAIL
+ */
+int file_read(fileData *file, int offset, int len, file_output out, void *arg) {
+	if (offset < 0 || len < 0)
+		return FAIL;
+	if (file == NULL || offset >= file->size)
+		return 0;
+	if (len > file->size - offset)
+		len = file->size - offset;
+
+	if (file->whole)
+		return out(file->whole->bytes + offset, len, arg) == FAIL ? FAIL : len;
+
+	for (int done = 0; done < len; ) {
+		char raw[FILE_BLOCK_SIZE];
+		int pos = offset + done, at = pos % FILE_BLOCK_SIZE;
+		int n = FILE_BLOCK_SIZE - at < len - done ? FILE_BLOCK_SIZE - at : len - done;
+		fileBlock *block = tree_find(file, pos / FILE_BLOCK_SIZE);
+
+		if (out((block ? block_bytes(block, raw) : zeros) + at, n, arg) == FAIL)
+			return FAIL;
+		done += n;
+	}
+	return len;
+}
+
+/*
+ * Calls block with the index and bytes of each block of a file in order,
+ * skipping holes. Bytes past the end of the file in the last block are zeros.
+ * Returns: SUCCESS or FAIL, as soon as block fails
+ */
+int file_blocks(fileData *file, int (*block)(int index, char *bytes, void *arg), void *arg) {
+	return file ? tree_walk(file->root, file->height, 0, block, arg) : SUCCESS;
+}
+
+/*
+ * Returns: the sealed memfd holding exactly the contents of a file, which
+ *  stays owned by the contents, or -1 if there is none
+ */
+int file_memfd(fileData *file) {
+	return file && file->whole ? file->whole->fd : -1;
+}
+
+static int pack_block(int index, char *bytes, void *arg) {
+	int fd = *(int *) arg, size = *((int *) arg + 1);
+	off_t pos = (off_t) index * FILE_BLOCK_SIZE;
+	size_t len = size - pos < FILE_BLOCK_SIZE ? size - pos : FILE_BLOCK_SIZE;
+
+	while (len > 0) {
+		ssize_t n = pwrite(fd, bytes, len, pos);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FAIL;
+		bytes += n;
+		pos += n;
+		len -= n;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Copies the contents of a file to a new sealed memfd, holes staying holes.
+ * Returns: the memfd, which the caller must close, or -1
+ */
+int file_pack(fileData *file) {
+	int pack[2] = { memfd_create("tecnicofs", MFD_CLOEXEC | MFD_ALLOW_SEALING), file ? file->size : 0 };
+
+	if (pack[0] < 0)
+		return -1;
+	if (ftruncate(pack[0], pack[1]) < 0 || file_blocks(file, pack_block, pack) == FAIL ||
+		fcntl(pack[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+		close(pack[0]);
+		return -1;
+	}
+	return pack[0];
+}
+
+/*
+ * Drops a reference to the contents of a file, freeing them with the last one.
+ */
+void file_release(fileData *file) {
+	if (file == NULL || data_unref(file) > 0)
+		return;
+	tree_release(file->root, file->height);
+	if (file->whole)
+		mapping_release(file->whole);
+	data_free(file);
+}
@@ -0,0 +1,61 @@
+#ifndef FILEDATA_H
+#define FILEDATA_H
+
+#include <stddef.h>
+#include "../../tecnicofs-api-constants.h"
+
+/*
+ * Contents of files.
+ * A file is a tree of FILE_BLOCK_SIZE blocks indexed by their position,
+ * each node with FILE_FANOUT children and the tree only as deep as the
+ * size of the file requires, so any block is reached in O(log n). Ranges
+ * never written are holes, read as zeros, with no block or node behind
+ * them, and an append only adds the blocks past the old tail.
+ * Nodes and blocks are reference counted and never changed once shared:
+ * a write copies the path to the blocks it changes, so that clones and
+ * readers holding the previous contents keep them.
+ * Blocks may be compressed one by one, a read only decompressing the
+ * blocks it covers, with the ones decompressed lately kept in a cache.
+ * They may also go through a pool keyed by the SHA-256 of their bytes, so
+ * that identical blocks, in the same file or in any others, are stored
+ * once and shared like the blocks of clones.
+ */
+
+#define FILE_BLOCK_SIZE 4096
+#define FILE_FANOUT 64
+/* offset of a write at the end of the file */
+#define FILE_APPEND -1
+/* decompressed blocks kept for reads */
+#define FILE_CACHE_BLOCKS 64
+/* buckets of the pool, and locks shared by them */
+#define FILE_POOL_BUCKETS 65536
+#define FILE_POOL_LOCKS 64
+/* blocks of a write hashed together */
+#define FILE_HASH_BATCH 16
+
+/* a sealed memfd mapped read-only, which blocks may point into */
+typedef struct fileMapping fileMapping;
+
+typedef struct fileData {
+	int size;
+	int height; /* levels of nodes above the blocks */
+	long long stored; /* bytes its blocks take, compressed or not */
+	void *root; /* a node, the only block if height is 0, or NULL */
+	fileMapping *whole; /* memfd holding exactly the contents, NULL if there is none */
+} fileData;
+
+/* gets the contents of a file in order, returns SUCCESS or FAIL */
+typedef int (*file_output)(void *data, size_t len, void *arg);
+
+void file_set_storage(int memfd, int compress, int dedup);
+void file_usage(tfsUsageStat *usage);
+fileData *file_alloc(char *contents, size_t len);
+fileData *file_adopt(int fd);
+fileData *file_write(fileData *file, char *bytes, size_t len, int offset);
+int file_read(fileData *file, int offset, int len, file_output out, void *arg);
+int file_blocks(fileData *file, int (*block)(int index, char *bytes, void *arg), void *arg);
+int file_memfd(fileData *file);
+int file_pack(fileData *file);
+void file_release(fileData *file);
+
+#endif /* FILEDATA_H */
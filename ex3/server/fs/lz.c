@@ -0,0 +1,170 @@
+#include <string.h>
+#include <stdint.h>
+#include "lz.h"
+
+static uint32_t lz_read32(const unsigned char *p) {
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned lz_hash(const unsigned char *p) {
+	return (lz_read32(p) * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * Writes the part of a length past a nibble, 255 at a time.
+ * Returns: position after it, or NULL if it doesn't fit before end
+ */
+static unsigned char *lz_put_length(unsigned char *out, unsigned char *end, int len) {
+	for (; len >= 255; len -= 255) {
+		if (out >= end)
+			return NULL;
+		*out++ = 255;
+	}
+	if (out >= end)
+		return NULL;
+	*out++ = len;
+	return out;
+}
+
+/*
+ * Writes a sequence: literals from anchor up to p, then a match of mlen
+ * bytes at offset back, unless mlen is 0 for the last sequence.
+ * Returns: position after it, or NULL if it doesn't fit before end
+ */
+static unsigned char *lz_put_sequence(unsigned char *out, unsigned char *end, const unsigned char *anchor,
+	const unsigned char *p, int offset, int mlen) {
+	int lit = p - anchor;
+	int m = mlen ? mlen - LZ_MIN_MATCH : 0;
+	unsigned char *token = out++;
+
+	if (token >= end)
+		return NULL;
+	*token = (lit < 15 ? lit : 15) << 4 | (m < 15 ? m : 15);
+	if (lit >= 15 && (out = lz_put_length(out, end, lit - 15)) == NULL)
+		return NULL;
+	if (lit > end - out)
+		return NULL;
+	memcpy(out, anchor, lit);
+	out += lit;
+
+	if (mlen == 0)
+		return out;
+	if (end - out < 2)
+		return NULL;
+	*out++ = offset & 0xff;
+	*out++ = offset >> 8;
+	if (m >= 15 && (out = lz_put_length(out, end, m - 15)) == NULL)
+		return NULL;
+	return out;
+}
+
+/*
+ * Compresses a buffer, greedily taking the match a hash of the next
+ * LZ_MIN_MATCH bytes finds.
+ * Input:
+ *  - src: bytes to compress
+ *  - len: number of bytes
+ *  - dst: where the compressed bytes are written
+ *  - cap: most bytes written
+ * Returns: number of compressed bytes, or 0 if they don't fit in cap
+ */
+int lz_compress(const char *src, int len, char *dst, int cap) {
+	const unsigned char *in = (const unsigned char *) src, *p = in, *anchor = in, *end = in + len;
+	unsigned char *out = (unsigned char *) dst, *outEnd = out + cap;
+	int table[1 << LZ_HASH_BITS];
+
+	memset(table, -1, sizeof(table));
+	while (end - p >= LZ_MIN_MATCH) {
+		unsigned h = lz_hash(p);
+		const unsigned char *match = in + (table[h] < 0 ? 0 : table[h]);
+		int mlen = LZ_MIN_MATCH;
+
+		if (table[h] < 0 || p - match > 0xffff || lz_read32(match) != lz_read32(p)) {
+			table[h] = p - in;
+			p++;
+			continue;
+		}
+		table[h] = p - in;
+		while (p + mlen < end && match[mlen] == p[mlen])
+			mlen++;
+
+		if ((out = lz_put_sequence(out, outEnd, anchor, p, p - match, mlen)) == NULL)
+			return 0;
+		p += mlen;
+		anchor = p;
+	}
+
+	if ((out = lz_put_sequence(out, outEnd, anchor, end, 0, 0)) == NULL)
+		return 0;
+	return out - (unsigned char *) dst;
+}
+
+/*
+ * Reads the part of a length past a nibble.
+ * Returns: position after it, or NULL if the input ends first
+ */
+static const unsigned char *lz_get_length(const unsigned char *in, const unsigned char *end, int *len) {
+	unsigned char b;
+
+	do {
+		if (in >= end)
+			return NULL;
+		b = *in++;
+		*len += b;
+	} while (b == 255);
+	return in;
+}
+
+/*
+ * Decompresses a buffer written by lz_compress, checking every length and
+ * offset, so that corrupt input can't read or write out of bounds.
+ * Input:
+ *  - src: compressed bytes
+ *  - len: number of compressed bytes
+ *  - dst: where the bytes are written
+ *  - cap: most bytes written
+ * Returns: number of bytes written, or -1 if the input is corrupt
+ */
+int lz_decompress(const char *src, int len, char *dst, int cap) {
+	const unsigned char *in = (const unsigned char *) src, *inEnd = in + len;
+	unsigned char *out = (unsigned char *) dst, *outEnd = out + cap;
+
+	while (in < inEnd) {
+		unsigned char token = *in++;
+		int lit = token >> 4, mlen = token & 15, offset;
+
+		if (lit == 15 && (in = lz_get_length(in, inEnd, &lit)) == NULL)
+			return -1;
+		if (lit > inEnd - in || lit > outEnd - out)
+			return -1;
+		memcpy(out, in, lit);
+		in += lit;
+		out += lit;
+		/* the last sequence has no match */
+		if (in == inEnd)
+			break;
+
+		if (inEnd - in < 2)
+			return -1;
+		offset = in[0] | in[1] << 8;
+		in += 2;
+		if (mlen == 15 && (in = lz_get_length(in, inEnd, &mlen)) == NULL)
+			return -1;
+		mlen += LZ_MIN_MATCH;
+		if (offset == 0 || offset > out - (unsigned char *) dst || mlen > outEnd - out)
+			return -1;
+
+		if (offset >= mlen) {
+			memcpy(out, out - offset, mlen);
+		} else {
+			/* the match overlaps the bytes it produces */
+			for (int i = 0; i < mlen; i++)
+				out[i] = out[i - offset];
+		}
+		out += mlen;
+	}
+	return out - (unsigned char *) dst;
+}
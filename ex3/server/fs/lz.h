@@ -0,0 +1,19 @@
+#ifndef LZ_H
+#define LZ_H
+
+/*
+ * Fast LZ77 compression of small buffers, in the byte-oriented format of
+ * LZ4 blocks: each sequence is a token (literal count in the high nibble,
+ * match length minus LZ_MIN_MATCH in the low one, 15 meaning more length
+ * bytes follow), the literals, and a 2-byte little-endian offset back to
+ * the match. The last sequence has literals only.
+ */
+
+#define LZ_MIN_MATCH 4
+/* bits of the hash table of the compressor, on its stack */
+#define LZ_HASH_BITS 12
+
+int lz_compress(const char *src, int len, char *dst, int cap);
+int lz_decompress(const char *src, int len, char *dst, int cap);
+
+#endif /* LZ_H */
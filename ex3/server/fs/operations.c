@@ -1,12 +1,39 @@
 #include "operations.h"
+#include "../log.h"
+#include "../lease.h"
+#include "../watch.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <limits.h>
 
 #define READ 1
 #define WRITE 0
 
+/* threads scanning the subdirectories of a find, the caller included */
+#define FIND_MAX_THREADS 8
+/* threads writing the parts of a dump */
+#define DUMP_MAX_THREADS 8
+/* times an operation unshares its paths from clones before giving up */
+#define MAX_UNSHARE_ATTEMPTS 4
+
+/* i-nodes no directory entry refers to any more, waiting to be freed */
+static int reclaim_pending[INODE_TABLE_SIZE];
+static int num_reclaim_pending = 0;
+static int reclaim_busy = 0, reclaim_stopping = 0;
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t reclaim_idle = PTHREAD_COND_INITIALIZER;
+static pthread_t reclaim_tid;
+
+/* finds and dumps holding a snapshot, which writes short of i-nodes abort */
+static int active_snapshots = 0, snapshots_aborted = 0;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshots_done = PTHREAD_COND_INITIALIZER;
+
 /* Given a path, fills pointers with strings for the parent path and child
  * file name
  * Input:
@@ -43,6 +70,168 @@ void split_parent_child_from_path(char * path, char ** parent, char ** child) {
 }
 
 
+/*
+ * Queues an i-node that no directory entry refers to any more, to be freed
+ * by the reclaimer thread.
+ */
+static void reclaim_push(int inumber) {
+	pthread_mutex_lock(&reclaim_lock);
+	reclaim_pending[num_reclaim_pending++] = inumber;
+	pthread_cond_signal(&reclaim_work);
+	pthread_mutex_unlock(&reclaim_lock);
+}
+
+/*
+ * Drops a reference to the data of an i-node. With the last one, the
+ * children of a directory lose the entry referring to them, and those
+ * left without any are reclaimed in turn.
+ * Input:
+ *  - nType: type of the i-node the data belonged to
+ *  - data: its data
+ */
+static void release_data(type nType, union Data data) {
+	if (nType == T_FILE) {
+		file_release(data.file);
+		return;
+	}
+	if (data.dirEntries == NULL || data_unref(data.dirEntries) > 0)
+		return;
+
+	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
+		if (data.dirEntries[i].inumber != FREE_INODE && inode_unref(data.dirEntries[i].inumber) == 0)
+			reclaim_push(data.dirEntries[i].inumber);
+	}
+	data_free(data.dirEntries);
+}
+
+/*
+ * Frees an i-node nothing can reach any more, and queues its children if
+ * it was the last one holding them. It is only write locked so that
+ * inode_create can't reuse it while it is being freed.
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+static void reclaim_node(int inumber) {
+	type nType;
+	union Data data;
+
+	inode_lock(inumber, WRITE);
+	inode_get(inumber, &nType, &data);
+	/* keep the entries until the children are queued */
+	if (data.dirEntries)
+		data_ref(data.dirEntries);
+	inode_delete(inumber);
+	inode_unlock(inumber);
+
+	release_data(nType, data);
+}
+
+static void *reclaimer() {
+	pthread_mutex_lock(&reclaim_lock);
+	while (1) {
+		while (num_reclaim_pending == 0 && !reclaim_stopping) {
+			pthread_cond_wait(&reclaim_work, &reclaim_lock);
+		}
+		if (num_reclaim_pending == 0)
+			break;
+
+		int inumber = reclaim_pending[--num_reclaim_pending];
+		reclaim_busy = 1;
+		pthread_mutex_unlock(&reclaim_lock);
+
+		reclaim_node(inumber);
+
+		pthread_mutex_lock(&reclaim_lock);
+		reclaim_busy = 0;
+		if (num_reclaim_pending == 0)
+			pthread_cond_broadcast(&reclaim_idle);
+	}
+	pthread_mutex_unlock(&reclaim_lock);
+	return NULL;
+}
+
+static void start_reclaimer() {
+	reclaim_stopping = 0;
+	if (pthread_create(&reclaim_tid, NULL, reclaimer, NULL) != 0) {
+		log_error("failed to create reclaimer thread\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Waits until every detached subtree has been freed.
+ */
+static void drain_reclaimer() {
+	pthread_mutex_lock(&reclaim_lock);
+	while (num_reclaim_pending > 0 || reclaim_busy) {
+		pthread_cond_wait(&reclaim_idle, &reclaim_lock);
+	}
+	pthread_mutex_unlock(&reclaim_lock);
+}
+
+
+/*
+ * Starts a find or dump, which keeps the nodes below it alive: while it
+ * lasts, every write below it copies the nodes along its path. It waits
+ * while the ones running are being aborted.
+ */
+static void snapshot_begin() {
+	pthread_mutex_lock(&snapshot_lock);
+	while (snapshots_aborted) {
+		pthread_cond_wait(&snapshots_done, &snapshot_lock);
+	}
+	active_snapshots++;
+	pthread_mutex_unlock(&snapshot_lock);
+}
+
+/*
+ * Ends a find or dump.
+ * Returns: SUCCESS, or FAIL if it was aborted meanwhile
+ */
+static int snapshot_end() {
+	int status;
+
+	pthread_mutex_lock(&snapshot_lock);
+	status = snapshots_aborted ? FAIL : SUCCESS;
+	if (--active_snapshots == 0 && snapshots_aborted) {
+		snapshots_aborted = 0;
+		pthread_cond_broadcast(&snapshots_done);
+	}
+	pthread_mutex_unlock(&snapshot_lock);
+	return status;
+}
+
+/*
+ * Returns: 1 if the finds and dumps running should stop, 0 otherwise
+ */
+static int snapshot_aborted() {
+	return __atomic_load_n(&snapshots_aborted, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Aborts the finds and dumps running, for a write short of i-nodes, and
+ * waits until the nodes only they kept alive are freed.
+ * Returns: SUCCESS, or FAIL if there were none
+ */
+static int snapshots_release() {
+	int status = FAIL;
+
+	pthread_mutex_lock(&snapshot_lock);
+	if (active_snapshots > 0) {
+		snapshots_aborted = 1;
+		while (snapshots_aborted) {
+			pthread_cond_wait(&snapshots_done, &snapshot_lock);
+		}
+		status = SUCCESS;
+	}
+	pthread_mutex_unlock(&snapshot_lock);
+
+	if (status == SUCCESS)
+		drain_reclaimer();
+	return status;
+}
+
+
 /*
  * Initializes tecnicofs and creates root node.
  */
@@ -56,6 +245,38 @@ void init_fs() {
 		printf("failed to create node for tecnicofs root\n");
 		exit(EXIT_FAILURE);
 	}
+	start_reclaimer();
+}
+
+
+/*
+ * Initializes tecnicofs from a namespace written by save_fs.
+ * Input:
+ *  - fd: file descriptor to read the namespace from
+ * Returns: SUCCESS or FAIL
+ */
+int restore_fs(int fd) {
+	inode_table_init();
+
+	if (inode_table_deserialize(fd) == FAIL) {
+		log_error("failed to restore tecnicofs namespace\n");
+		return FAIL;
+	}
+	start_reclaimer();
+	return SUCCESS;
+}
+
+
+/*
+ * Writes the whole namespace to fd. No operation may run meanwhile.
+ * Input:
+ *  - fd: file descriptor to write the namespace to
+ * Returns: SUCCESS or FAIL
+ */
+int save_fs(int fd) {
+	/* detached subtrees are still in the table */
+	drain_reclaimer();
+	return inode_table_serialize(fd);
 }
 
 
@@ -63,26 +284,30 @@ void init_fs() {
  * Destroy tecnicofs and inode table.
  */
 void destroy_fs() {
+	pthread_mutex_lock(&reclaim_lock);
+	reclaim_stopping = 1;
+	pthread_cond_signal(&reclaim_work);
+	pthread_mutex_unlock(&reclaim_lock);
+	pthread_join(reclaim_tid, NULL);
+
 	inode_table_destroy();
 }
 
 
 /*
- * Checks if content of directory is not empty.
+ * Checks if content of directory is not empty, from the count of its
+ * entries.
  * Input:
- *  - entries: entries of directory
+ *  - inumber: identifier of the directory
  * Returns: SUCCESS or FAIL
  */
 
-int is_dir_empty(DirEntry *dirEntries) {
-	if (dirEntries == NULL) {
+int is_dir_empty(int inumber) {
+	nodeMeta meta;
+
+	if (inode_get_meta(inumber, &meta) == FAIL || meta.entries > 0) {
 		return FAIL;
 	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-		if (dirEntries[i].inumber != FREE_INODE) {
-			return FAIL;
-		}
-	}
 	return SUCCESS;
 }
 
@@ -125,19 +350,154 @@ int isLocked(int inumber, int *inodes_visited, int num_inodes_visited) {
 }
 
 /*
- * Creates a new node given a path.
+ * Collects the nodes along a path, the caller holding their locks.
  * Input:
  *  - name: path of node
- *  - nodeType: type of node
+ *  - chain: array to fill with the inumbers, from the root down
+ * Returns: number of nodes collected, fewer than the components of the
+ *  path if it doesn't exist
+ */
+static int path_chain(char *name, int *chain) {
+	char full_path[MAX_FILE_NAME];
+	char *saveptr, *component;
+	type nType;
+	union Data data;
+	int length = 0;
+
+	strcpy(full_path, name);
+	chain[length++] = FS_ROOT;
+
+	for (component = strtok_r(full_path, "/", &saveptr); component != NULL;
+	     component = strtok_r(NULL, "/", &saveptr)) {
+		inode_get(chain[length - 1], &nType, &data);
+		if (nType != T_DIRECTORY || (chain[length] = lookup_sub_node(component, data.dirEntries)) == FAIL)
+			break;
+		length++;
+	}
+	return length;
+}
+
+/*
+ * Checks if changing the node at the end of a path would show through a
+ * clone: some node along it is shared with a clone, or is reached through
+ * entries shared with one.
+ * Input:
+ *  - name: path of node, whose nodes the caller has locked
+ * Returns: 1 if it is shared, 0 otherwise
+ */
+static int is_path_shared(char *name) {
+	int chain[INODE_TABLE_SIZE];
+	int length = path_chain(name, chain);
+	type nType;
+	union Data data;
+
+	/* the contents of files are replaced rather than changed, so they may stay shared */
+	for (int i = 0; i < length; i++) {
+		inode_get(chain[i], &nType, &data);
+		if (inode_refs(chain[i]) > 1 || (nType == T_DIRECTORY && data.dirEntries && data_refs(data.dirEntries) > 1))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Gives a path copies of its own of the nodes it shares with clones, so
+ * that the node at its end can be changed. Only the nodes along the path
+ * are copied, a copied directory still shares the nodes below it.
+ * Operations on the namespace hold the root locked, so locking it for
+ * writing excludes them all, as tecnicofs is being printed: this is the
+ * cost of writing below a clone, paid until the path is unshared. The
+ * reclaimer only frees nodes no entry leads to anymore, and find and
+ * export walk directories whose entries they hold a reference to, which
+ * unsharing copies rather than changes.
+ * Input:
+ *  - name: path of node
+ * Returns: SUCCESS or FAIL, if the table is full
+ */
+static int unshare_path(char *name) {
+	char full_path[MAX_FILE_NAME], walked[MAX_FILE_NAME] = "";
+	char *saveptr, *component;
+	int inumber = FS_ROOT, child_inumber;
+	int status = SUCCESS;
+	type nType;
+	union Data data, shared;
+
+	strcpy(full_path, name);
+	inode_lock(FS_ROOT, WRITE);
+
+	component = strtok_r(full_path, "/", &saveptr);
+	while (1) {
+		inode_get(inumber, &nType, &data);
+		if ((shared.dirEntries = inode_unshare_data(inumber)) != NULL) {
+			release_data(nType, shared);
+			inode_get(inumber, &nType, &data);
+		}
+
+		if (component == NULL || nType != T_DIRECTORY ||
+		    (child_inumber = lookup_sub_node(component, data.dirEntries)) == FAIL)
+			break;
+
+		if (*walked)
+			strcat(walked, "/");
+		strcat(walked, component);
+
+		if (inode_refs(child_inumber) > 1) {
+			int copy_inumber = inode_clone(child_inumber);
+
+			if (copy_inumber == FAIL) {
+				log_info("failed to unshare %s, couldn't allocate inode\n", name);
+				status = FAIL;
+				break;
+			}
+			/* in the same slot, so that listings being read see it once */
+			dir_replace_entry(inumber, child_inumber, copy_inumber);
+			if (inode_unref(child_inumber) == 0)
+				reclaim_push(child_inumber);
+			child_inumber = copy_inumber;
+
+			/* the path now leads to another inode */
+			lease_revoke(walked);
+		}
+
+		inumber = child_inumber;
+		component = strtok_r(NULL, "/", &saveptr);
+	}
+
+	inode_unlock(FS_ROOT);
+	return status;
+}
+
+/*
+ * Unshares the paths an operation found shared, once it has unlocked them,
+ * before it looks them up again. A clone may share them again meanwhile,
+ * so an operation only does it MAX_UNSHARE_ATTEMPTS times.
+ * Input:
+ *  - attempts: times the operation did it, incremented
+ *  - name: path to unshare
+ *  - other: another path to unshare, or NULL
  * Returns: SUCCESS or FAIL
  */
-int create(char *name, type nodeType){
+static int unshare_again(int *attempts, char *name, char *other) {
+	if (++*attempts > MAX_UNSHARE_ATTEMPTS) {
+		log_info("failed to unshare %s, shared again by clones\n", name);
+		return FAIL;
+	}
+	/* the table may be full of nodes only finds and dumps keep alive */
+	if (unshare_path(name) == FAIL || (other != NULL && unshare_path(other) == FAIL))
+		return snapshots_release();
+	return SUCCESS;
+}
+
+/*
+ * Creates a new node given a path, see create.
+ */
+static int create_node(char *name, type nodeType){
 
 	int parent_inumber, child_inumber;
 	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
 
 	int inodes_visited[INODE_TABLE_SIZE];
-	int num_inodes_visited = 0;
+	int num_inodes_visited = 0, attempts = 0;
 
 	/* use for copy */
 	type pType;
@@ -146,27 +506,37 @@ int create(char *name, type nodeType){
 	strcpy(name_copy, name);
 	split_parent_child_from_path(name_copy, &parent_name, &child_name);
 
-	parent_inumber = lookup(parent_name, inodes_visited, &num_inodes_visited, WRITE); 
-		
-	if (parent_inumber == FAIL) {
-		printf("failed to create %s, invalid parent dir %s\n",
-		        name, parent_name);		
-		unlock_inodes(inodes_visited, num_inodes_visited);
-		return FAIL;
-	}
+	while (1) {
+		num_inodes_visited = 0;
+		parent_inumber = lookup(parent_name, inodes_visited, &num_inodes_visited, WRITE); 
+
+		if (parent_inumber == FAIL) {
+			log_info("failed to create %s, invalid parent dir %s\n",
+			        name, parent_name);		
+			unlock_inodes(inodes_visited, num_inodes_visited);
+			return FAIL;
+		}
 
-	inode_get(parent_inumber, &pType, &pdata);
+		inode_get(parent_inumber, &pType, &pdata);
 
 
-	if(pType != T_DIRECTORY) {
-		printf("failed to create %s, parent %s is not a dir\n",
-		        name, parent_name);
+		if(pType != T_DIRECTORY) {
+			log_info("failed to create %s, parent %s is not a dir\n",
+			        name, parent_name);
+			unlock_inodes(inodes_visited, num_inodes_visited);
+			return FAIL;
+		}
+
+		/* the parent is shared with a clone, which must not see the new node */
+		if (!is_path_shared(parent_name))
+			break;
 		unlock_inodes(inodes_visited, num_inodes_visited);
-		return FAIL;
+		if (unshare_again(&attempts, parent_name, NULL) == FAIL)
+			return FAIL;
 	}
 
 	if (lookup_sub_node(child_name, pdata.dirEntries) != FAIL) {
-		printf("failed to create %s, already exists in dir %s\n",
+		log_info("failed to create %s, already exists in dir %s\n",
 		       child_name, parent_name);
 		unlock_inodes(inodes_visited, num_inodes_visited);
 		return FAIL;
@@ -174,23 +544,25 @@ int create(char *name, type nodeType){
 
 	/* create node and add entry to folder that contains new node */
 	child_inumber = inode_create(nodeType);
-	inode_lock(child_inumber, WRITE); /* WRITE LOCK */
-	inodes_visited[num_inodes_visited++] = child_inumber; /* add child_inumber to list of locked nodes*/
 
 	if (child_inumber == FAIL) {
-		printf("failed to create %s in  %s, couldn't allocate inode\n",
+		log_info("failed to create %s in  %s, couldn't allocate inode\n",
 		        child_name, parent_name);
 		unlock_inodes(inodes_visited, num_inodes_visited);
 		return FAIL;
 	}
 
+	inode_lock(child_inumber, WRITE); /* WRITE LOCK */
+	inodes_visited[num_inodes_visited++] = child_inumber; /* add child_inumber to list of locked nodes*/
+
 	if (dir_add_entry(parent_inumber, child_inumber, child_name) == FAIL) {
-		printf("could not add entry %s in dir %s\n",
+		log_info("could not add entry %s in dir %s\n",
 		       child_name, parent_name);
 		unlock_inodes(inodes_visited, num_inodes_visited);
 		return FAIL;
 	}
 
+	watch_notify(TFS_EVENT_CREATE, name);
 	unlock_inodes(inodes_visited, num_inodes_visited);
 
 	return SUCCESS;
@@ -198,18 +570,36 @@ int create(char *name, type nodeType){
 
 
 /*
- * Deletes a node given a path.
+ * Creates a new node given a path.
  * Input:
  *  - name: path of node
+ *  - nodeType: type of node
+ * Returns: SUCCESS or FAIL
+ */
+int create(char *name, type nodeType) {
+	int status = create_node(name, nodeType);
+
+	/* the table may be full of nodes only finds and dumps keep alive */
+	if (status == FAIL && inode_free_count() == 0 && snapshots_release() == SUCCESS)
+		status = create_node(name, nodeType);
+	return status;
+}
+
+
+/*
+ * Removes a node given a path.
+ * Input:
+ *  - name: path of node
+ *  - recursive: if not set, a directory must be empty
  * Returns: SUCCESS or FAIL
  */
-int delete(char *name){
+static int remove_node(char *name, int recursive) {
 
 	int parent_inumber, child_inumber;
 	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
 
 	int inodes_visited[INODE_TABLE_SIZE];
-	int num_inodes_visited = 0;
+	int num_inodes_visited = 0, attempts = 0;
 
 	/* use for copy */
 	type pType, cType;
@@ -218,27 +608,36 @@ int delete(char *name){
 	strcpy(name_copy, name);
 	split_parent_child_from_path(name_copy, &parent_name, &child_name);
 
-	parent_inumber = lookup(parent_name, inodes_visited, &num_inodes_visited, WRITE);
+	while (1) {
+		num_inodes_visited = 0;
+		parent_inumber = lookup(parent_name, inodes_visited, &num_inodes_visited, WRITE);
 
-	if (parent_inumber == FAIL) {
-		printf("failed to delete %s, invalid parent dir %s\n",
-		        child_name, parent_name);
-		unlock_inodes(inodes_visited, num_inodes_visited);
-		return FAIL;
-	}
+		if (parent_inumber == FAIL) {
+			log_info("failed to delete %s, invalid parent dir %s\n",
+			        child_name, parent_name);
+			unlock_inodes(inodes_visited, num_inodes_visited);
+			return FAIL;
+		}
 
-	inode_get(parent_inumber, &pType, &pdata);
+		inode_get(parent_inumber, &pType, &pdata);
 
-	if(pType != T_DIRECTORY) {
-		printf("failed to delete %s, parent %s is not a dir\n",
-		        child_name, parent_name);
+		if(pType != T_DIRECTORY) {
+			log_info("failed to delete %s, parent %s is not a dir\n",
+			        child_name, parent_name);
+			unlock_inodes(inodes_visited, num_inodes_visited);
+			return FAIL;
+		}
+
+		if (!is_path_shared(parent_name))
+			break;
 		unlock_inodes(inodes_visited, num_inodes_visited);
-		return FAIL;
+		if (unshare_again(&attempts, parent_name, NULL) == FAIL)
+			return FAIL;
 	}
 
 	child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
 	if (child_inumber == FAIL) {
-		printf("could not delete %s, does not exist in dir %s\n",
+		log_info("could not delete %s, does not exist in dir %s\n",
 		       name, parent_name);
 		unlock_inodes(inodes_visited, num_inodes_visited);
 		return FAIL;
@@ -249,8 +648,8 @@ int delete(char *name){
 	
 	inode_get(child_inumber, &cType, &cdata);
 
-	if (cType == T_DIRECTORY && is_dir_empty(cdata.dirEntries) == FAIL) {
-		printf("could not delete %s: is a directory and not empty\n",
+	if (!recursive && cType == T_DIRECTORY && is_dir_empty(child_inumber) == FAIL) {
+		log_info("could not delete %s: is a directory and not empty\n",
 		       name);
 		unlock_inodes(inodes_visited, num_inodes_visited);
 		return FAIL;
@@ -258,23 +657,54 @@ int delete(char *name){
 
 	/* remove entry from folder that contained deleted node */
 	if (dir_reset_entry(parent_inumber, child_inumber) == FAIL) {
-		printf("failed to delete %s from dir %s\n",
+		log_info("failed to delete %s from dir %s\n",
 		       child_name, parent_name);
 		unlock_inodes(inodes_visited, num_inodes_visited);
 		return FAIL;
 	}
 
-	if (inode_delete(child_inumber) == FAIL) {
-		printf("could not delete inode number %d from dir %s\n",
+	if (inode_unref(child_inumber) > 0) {
+		/* still in a clone, which keeps it */
+	} else if (cType == T_DIRECTORY && is_dir_empty(child_inumber) == FAIL) {
+		/* detached, operations that could reach the subtree are done */
+		reclaim_push(child_inumber);
+	} else if (inode_delete(child_inumber) == FAIL) {
+		log_info("could not delete inode number %d from dir %s\n",
 		       child_inumber, parent_name);
 		unlock_inodes(inodes_visited, num_inodes_visited);
 		return FAIL;
 	}
 
+	/* clients caching the path must forget it before it is unlocked */
+	lease_revoke(name);
+	watch_notify(TFS_EVENT_DELETE, name);
+
 	unlock_inodes(inodes_visited, num_inodes_visited);
 	return SUCCESS;
 }
 
+/*
+ * Deletes a node given a path.
+ * Input:
+ *  - name: path of node, a file or an empty directory
+ * Returns: SUCCESS or FAIL
+ */
+int delete(char *name) {
+	return remove_node(name, 0);
+}
+
+/*
+ * Deletes a node and everything below it. The subtree is detached from its
+ * parent at once, under the same locks as delete, and its i-nodes are freed
+ * later by the reclaimer thread, so they can't be reused right away.
+ * Input:
+ *  - name: path of node
+ * Returns: SUCCESS or FAIL
+ */
+int delete_tree(char *name) {
+	return remove_node(name, 1);
+}
+
 /*
  * Moves a file/directory from path to newPath.
  * Input:
@@ -287,7 +717,7 @@ int move(char *path, char *newPath) {
 	int parent_inumber, child_inumber, newParent_inumber;
 	int inodes_visited[INODE_TABLE_SIZE];
 	char *parent_name, *newParent_name, *child_name, *newChild_name, name_copy[MAX_FILE_NAME], newName_copy[MAX_FILE_NAME];
-	int num_inodes_visited = 0;
+	int num_inodes_visited = 0, attempts = 0;
 
 	type pType, pnewType;
 	union Data pdata, pnewData;
@@ -297,40 +727,49 @@ int move(char *path, char *newPath) {
 	split_parent_child_from_path(name_copy, &parent_name, &child_name);
 	split_parent_child_from_path(newName_copy, &newParent_name, &newChild_name);
 
-	// lookup in alphabetical order */ 
-	if (strcmp(name_copy, newName_copy) < 0) {
-		parent_inumber = lookup(parent_name, inodes_visited, &num_inodes_visited, WRITE);
-		newParent_inumber = lookup(newParent_name, inodes_visited, &num_inodes_visited, WRITE);
-	} else {
-		newParent_inumber = lookup(newParent_name, inodes_visited, &num_inodes_visited, WRITE);
-		parent_inumber = lookup(parent_name, inodes_visited, &num_inodes_visited, WRITE);
-	}
+	while (1) {
+		num_inodes_visited = 0;
+		// lookup in alphabetical order */ 
+		if (strcmp(name_copy, newName_copy) < 0) {
+			parent_inumber = lookup(parent_name, inodes_visited, &num_inodes_visited, WRITE);
+			newParent_inumber = lookup(newParent_name, inodes_visited, &num_inodes_visited, WRITE);
+		} else {
+			newParent_inumber = lookup(newParent_name, inodes_visited, &num_inodes_visited, WRITE);
+			parent_inumber = lookup(parent_name, inodes_visited, &num_inodes_visited, WRITE);
+		}
 
-	if (parent_inumber == FAIL) {
-		fprintf(stderr, "Move: path %s does not exist\n", path);
-		unlock_inodes(inodes_visited, num_inodes_visited);
-		return FAIL;
-	}
+		if (parent_inumber == FAIL) {
+			log_info("Move: path %s does not exist\n", path);
+			unlock_inodes(inodes_visited, num_inodes_visited);
+			return FAIL;
+		}
 
-	if (newParent_inumber == FAIL) {
-		fprintf(stderr, "Move: newPath %s does not exist\n", newPath);
-		unlock_inodes(inodes_visited, num_inodes_visited);
-		return FAIL;
-	}
+		if (newParent_inumber == FAIL) {
+			log_info("Move: newPath %s does not exist\n", newPath);
+			unlock_inodes(inodes_visited, num_inodes_visited);
+			return FAIL;
+		}
 
-	inode_get(parent_inumber, &pType, &pdata);
-	inode_get(newParent_inumber,&pnewType, &pnewData);
+		inode_get(parent_inumber, &pType, &pdata);
+		inode_get(newParent_inumber,&pnewType, &pnewData);
 
-	/* check newPath is a directory */
-	if (pnewType != T_DIRECTORY) {
-		fprintf(stderr, "Move: %s is not a directory\n", newPath);
+		/* check both parents are directories */
+		if (pType != T_DIRECTORY || pnewType != T_DIRECTORY) {
+			log_info("Move: %s is not a directory\n", pType != T_DIRECTORY ? path : newPath);
+			unlock_inodes(inodes_visited, num_inodes_visited);
+			return FAIL;
+		}
+
+		if (!is_path_shared(parent_name) && !is_path_shared(newParent_name))
+			break;
 		unlock_inodes(inodes_visited, num_inodes_visited);
-		return FAIL;
+		if (unshare_again(&attempts, parent_name, newParent_name) == FAIL)
+			return FAIL;
 	}
 
 	/* check child doesnt already exist in newPath*/
 	if (lookup_sub_node(child_name, pnewData.dirEntries) != FAIL) {
-		fprintf(stderr, "Move: %s already exists in %s\n", child_name, newParent_name);
+		log_info("Move: %s already exists in %s\n", child_name, newParent_name);
 		unlock_inodes(inodes_visited, num_inodes_visited);
 		return FAIL;
 	}
@@ -348,62 +787,176 @@ int move(char *path, char *newPath) {
 	}
 
 	if (dir_reset_entry(parent_inumber, child_inumber) == FAIL) {
-		fprintf(stderr, "Move: failed to delete %s from dir %s\n", child_name, parent_name);
+		log_info("Move: failed to delete %s from dir %s\n", child_name, parent_name);
 		unlock_inodes(inodes_visited, num_inodes_visited);
 		return FAIL;
 	}
 
 	if (dir_add_entry(newParent_inumber, child_inumber, newChild_name) == FAIL) {
-		fprintf(stderr, "Move: could not add entry %s in dir %s\n", child_name, newParent_name);
+		log_info("Move: could not add entry %s in dir %s\n", child_name, newParent_name);
 		unlock_inodes(inodes_visited, num_inodes_visited);
 		return FAIL;
 	}
 
+	lease_revoke(path);
+	watch_notify(TFS_EVENT_MOVED_FROM, path);
+	watch_notify(TFS_EVENT_MOVED_TO, newPath);
+
 	unlock_inodes(inodes_visited, num_inodes_visited);
 	return SUCCESS;
 }
 
 /*
- * Lookup for a given path.
- * Input:
- *  - name: path of node
- * Returns:
- *  inumber: identifier of the i-node, if found
- *     FAIL: otherwise
+ * Makes newPath a clone of the node at path, see clone_node.
  */
-int lookup(char *name, int *inodes_visited, int *num_inodes_visited, int mode) {
-	char full_path[MAX_FILE_NAME];
-	char delim[] = "/";
-	char *saveptr;
+static int clone_path(char *path, char *newPath) {
 
-	strcpy(full_path, name);
-
-	/* start at root node */
-	int current_inumber = FS_ROOT;
+	int source_inumber, newParent_inumber, clone_inumber;
+	int inodes_visited[INODE_TABLE_SIZE], chain[INODE_TABLE_SIZE];
+	char *newParent_name, *newChild_name, newName_copy[MAX_FILE_NAME];
+	int num_inodes_visited = 0, length, attempts = 0;
 
-	/* use for copy */
-	type nType;
-	union Data data;
+	type pnewType;
+	union Data pnewData;
 
-	char *path = strtok_r(full_path, delim, &saveptr); 
+	strcpy(newName_copy, newPath);
+	split_parent_child_from_path(newName_copy, &newParent_name, &newChild_name);
 
-	/* CHECK IF CURRENT_INUMBER IS ALREADY LOCKED */
-	if (!isLocked(current_inumber, inodes_visited, *num_inodes_visited)) {
-		/* WRITELOCK FS_ROOT IF PARENT, READLOCK OTHERWISE*/
-		if (path == NULL && mode == WRITE) { 
-			inode_lock(current_inumber, WRITE); /* writelock parent node */
+	while (1) {
+		num_inodes_visited = 0;
+		/* lookup in alphabetical order, as move */
+		if (strcmp(path, newParent_name) < 0) {
+			source_inumber = lookup(path, inodes_visited, &num_inodes_visited, WRITE);
+			newParent_inumber = lookup(newParent_name, inodes_visited, &num_inodes_visited, WRITE);
 		} else {
-			inode_lock(current_inumber, READ); /* readlock every sub node, including the one we are looking for */
+			newParent_inumber = lookup(newParent_name, inodes_visited, &num_inodes_visited, WRITE);
+			source_inumber = lookup(path, inodes_visited, &num_inodes_visited, WRITE);
 		}
 
-		inodes_visited[(*num_inodes_visited)++] = current_inumber;
-	}
+		if (source_inumber == FAIL) {
+			log_info("Clone: path %s does not exist\n", path);
+			unlock_inodes(inodes_visited, num_inodes_visited);
+			return FAIL;
+		}
 
-	/* get root inode data */
-	inode_get(current_inumber, &nType, &data);
+		if (newParent_inumber == FAIL) {
+			log_info("Clone: newPath %s does not exist\n", newPath);
+			unlock_inodes(inodes_visited, num_inodes_visited);
+			return FAIL;
+		}
 
-	/* search for all sub nodes */
-	while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL) {
+		inode_get(newParent_inumber, &pnewType, &pnewData);
+
+		if (pnewType != T_DIRECTORY) {
+			log_info("Clone: %s is not a directory\n", newParent_name);
+			unlock_inodes(inodes_visited, num_inodes_visited);
+			return FAIL;
+		}
+
+		if (!is_path_shared(newParent_name))
+			break;
+		unlock_inodes(inodes_visited, num_inodes_visited);
+		if (unshare_again(&attempts, newParent_name, NULL) == FAIL)
+			return FAIL;
+	}
+
+	if (lookup_sub_node(newChild_name, pnewData.dirEntries) != FAIL) {
+		log_info("Clone: %s already exists in %s\n", newChild_name, newParent_name);
+		unlock_inodes(inodes_visited, num_inodes_visited);
+		return FAIL;
+	}
+
+	/* the new parent is only reached through its path, so this is exact */
+	length = path_chain(newParent_name, chain);
+	for (int i = 0; i < length; i++) {
+		if (chain[i] == source_inumber) {
+			log_info("Clone: %s can't be cloned inside itself\n", path);
+			unlock_inodes(inodes_visited, num_inodes_visited);
+			return FAIL;
+		}
+	}
+
+	clone_inumber = inode_clone(source_inumber);
+	if (clone_inumber == FAIL) {
+		log_info("Clone: couldn't allocate inode for %s\n", newPath);
+		unlock_inodes(inodes_visited, num_inodes_visited);
+		return FAIL;
+	}
+
+	if (dir_add_entry(newParent_inumber, clone_inumber, newChild_name) == FAIL) {
+		log_info("Clone: could not add entry %s in dir %s\n", newChild_name, newParent_name);
+		inode_delete(clone_inumber);
+		unlock_inodes(inodes_visited, num_inodes_visited);
+		return FAIL;
+	}
+
+	watch_notify(TFS_EVENT_CREATE, newPath);
+	unlock_inodes(inodes_visited, num_inodes_visited);
+	return SUCCESS;
+}
+
+/*
+ * Makes newPath a clone of the node at path. The clone shares the data of
+ * the original, and so the whole subtree below it: it is created at once,
+ * whatever the size of the subtree, and either side only gets copies of
+ * its own of the nodes along the paths it later changes (see unshare_path).
+ * The original is write locked so that no operation below it is halfway.
+ * Input:
+ *  - path: path of node
+ *  - newPath: path of the clone
+ * Returns: SUCCESS or FAIL
+ */
+int clone_node(char *path, char *newPath) {
+	int status = clone_path(path, newPath);
+
+	/* the table may be full of nodes only finds and dumps keep alive */
+	if (status == FAIL && inode_free_count() == 0 && snapshots_release() == SUCCESS)
+		status = clone_path(path, newPath);
+	return status;
+}
+
+/*
+ * Lookup for a given path.
+ * Input:
+ *  - name: path of node
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: otherwise
+ */
+int lookup(char *name, int *inodes_visited, int *num_inodes_visited, int mode) {
+	char full_path[MAX_FILE_NAME];
+	char delim[] = "/";
+	char *saveptr;
+
+	strcpy(full_path, name);
+
+	/* start at root node */
+	int current_inumber = FS_ROOT;
+
+	/* use for copy */
+	type nType;
+	union Data data;
+
+	char *path = strtok_r(full_path, delim, &saveptr); 
+
+	/* CHECK IF CURRENT_INUMBER IS ALREADY LOCKED */
+	if (!isLocked(current_inumber, inodes_visited, *num_inodes_visited)) {
+		/* WRITELOCK FS_ROOT IF PARENT, READLOCK OTHERWISE*/
+		if (path == NULL && mode == WRITE) { 
+			inode_lock(current_inumber, WRITE); /* writelock parent node */
+		} else {
+			inode_lock(current_inumber, READ); /* readlock every sub node, including the one we are looking for */
+		}
+
+		inodes_visited[(*num_inodes_visited)++] = current_inumber;
+	}
+
+	/* get root inode data */
+	inode_get(current_inumber, &nType, &data);
+
+	/* search for all sub nodes, files have none */
+	while (path != NULL && (current_inumber = nType == T_DIRECTORY ?
+	       lookup_sub_node(path, data.dirEntries) : FAIL) != FAIL) {
 
 		path = strtok_r(NULL, delim, &saveptr);
 
@@ -424,27 +977,847 @@ int lookup(char *name, int *inodes_visited, int *num_inodes_visited, int mode) {
 }
 
 
+/*
+ * Reads a chunk of the entries of a directory. The cursor is the index of
+ * the slot to resume from: entries never change slot, so every entry
+ * present during the whole listing is read exactly once, whatever is
+ * added or removed meanwhile. The directory is only locked while the
+ * chunk is copied.
+ * Input:
+ *  - name: path of the directory
+ *  - cursor: slot to start from, 0 for the first chunk
+ *  - entries: array of max entries to fill
+ *  - max: most entries to read
+ *  - next: set to the cursor of the next chunk, TFS_CURSOR_END if there is none
+ * Returns: number of entries read or FAIL
+ */
+int read_dir(char *name, int cursor, tfsDirEntry *entries, int max, int *next) {
+	int inodes_visited[INODE_TABLE_SIZE];
+	int num_inodes_visited = 0;
+	int inumber, count = 0;
+	type nType;
+	union Data data;
+
+	if (cursor < 0 || cursor > MAX_DIR_ENTRIES)
+		return FAIL;
+
+	inumber = lookup(name, inodes_visited, &num_inodes_visited, READ);
+	if (inumber == FAIL || inode_get(inumber, &nType, &data) == FAIL || nType != T_DIRECTORY) {
+		unlock_inodes(inodes_visited, num_inodes_visited);
+		return FAIL;
+	}
+
+	/* children can't be deleted while their parent is read locked */
+	for (; cursor < MAX_DIR_ENTRIES && count < max; cursor++) {
+		DirEntry *entry = &data.dirEntries[cursor];
+		if (entry->inumber == FREE_INODE)
+			continue;
+		entries[count].inumber = entry->inumber;
+		inode_get(entry->inumber, &nType, NULL);
+		entries[count].type = nType;
+		strcpy(entries[count].name, entry->name);
+		count++;
+	}
+	unlock_inodes(inodes_visited, num_inodes_visited);
+
+	*next = (cursor < MAX_DIR_ENTRIES) ? cursor : TFS_CURSOR_END;
+	return count;
+}
+
+
+/*
+ * Fills the metadata of a locked node.
+ */
+static void fill_stat(int inumber, tfsNodeStat *st) {
+	type nType;
+	union Data data;
+	nodeMeta meta;
+
+	inode_get(inumber, &nType, &data);
+	inode_get_meta(inumber, &meta);
+	st->inumber = inumber;
+	st->type = nType;
+	st->size = nType == T_DIRECTORY ? meta.entries : meta.size;
+	st->stored = 0;
+	if (nType == T_FILE && data.file)
+		st->stored = data.file->stored < INT_MAX ? data.file->stored : INT_MAX;
+	st->ctime = meta.ctime;
+	st->mtime = meta.mtime;
+}
+
+
+/*
+ * Gets the metadata of a node.
+ * Input:
+ *  - name: path of node
+ *  - st: metadata to fill
+ * Returns: SUCCESS or FAIL
+ */
+int stat_node(char *name, tfsNodeStat *st) {
+	int inodes_visited[INODE_TABLE_SIZE];
+	int num_inodes_visited = 0;
+	int inumber = lookup(name, inodes_visited, &num_inodes_visited, READ);
+
+	if (inumber != FAIL)
+		fill_stat(inumber, st);
+	unlock_inodes(inodes_visited, num_inodes_visited);
+	return inumber == FAIL ? FAIL : SUCCESS;
+}
+
+
+/*
+ * Locks a file for writing, unsharing its path first if it goes through
+ * data shared with a clone, which must keep the old contents.
+ * Input:
+ *  - name: path of the file
+ *  - inodes_visited: set to the i-nodes locked
+ *  - num_inodes_visited: set to their number
+ * Returns: i-number of the file or FAIL, with nothing left locked
+ */
+static int lock_file(char *name, int *inodes_visited, int *num_inodes_visited) {
+	type nType;
+	int inumber, attempts = 0;
+
+	while (1) {
+		*num_inodes_visited = 0;
+		inumber = lookup(name, inodes_visited, num_inodes_visited, WRITE);
+		if (inumber == FAIL || inode_get(inumber, &nType, NULL) == FAIL || nType != T_FILE) {
+			log_info("Write: %s is not a file\n", name);
+			unlock_inodes(inodes_visited, *num_inodes_visited);
+			return FAIL;
+		}
+		if (!is_path_shared(name))
+			return inumber;
+
+		unlock_inodes(inodes_visited, *num_inodes_visited);
+		if (unshare_again(&attempts, name, NULL) == FAIL)
+			return FAIL;
+	}
+}
+
+
+/*
+ * Replaces the contents of a file. They are given whole, so that readers
+ * see either the old or the new contents and never a mix.
+ * Input:
+ *  - name: path of the file
+ *  - file: new contents (see file_alloc), whose reference the file takes
+ *    on success
+ * Returns: SUCCESS or FAIL
+ */
+int write_contents(char *name, fileData *file) {
+	int inodes_visited[INODE_TABLE_SIZE];
+	int num_inodes_visited;
+	int inumber = lock_file(name, inodes_visited, &num_inodes_visited);
+
+	if (inumber == FAIL)
+		return FAIL;
+	inode_set_file(inumber, file);
+	unlock_inodes(inodes_visited, num_inodes_visited);
+	return SUCCESS;
+}
+
+
+/*
+ * Writes a range of a file, growing it if the range ends past its end.
+ * Only the blocks in the range are copied from contents that readers or
+ * clones still hold.
+ * Input:
+ *  - name: path of the file
+ *  - bytes: bytes to write
+ *  - len: number of bytes
+ *  - offset: where they are written, FILE_APPEND for the end of the file
+ * Returns: SUCCESS or FAIL
+ */
+int write_range(char *name, char *bytes, size_t len, int offset) {
+	int inodes_visited[INODE_TABLE_SIZE];
+	int num_inodes_visited;
+	int inumber = lock_file(name, inodes_visited, &num_inodes_visited);
+	int status;
+
+	if (inumber == FAIL)
+		return FAIL;
+	status = inode_write_file(inumber, bytes, len, offset);
+	unlock_inodes(inodes_visited, num_inodes_visited);
+	return status;
+}
+
+
+/*
+ * Gets the contents of a file. A reference to them is taken under the read
+ * lock, so they can be sent without holding any lock: shared contents are
+ * never changed, a write meanwhile copies what it changes.
+ * Input:
+ *  - name: path of the file
+ *  - file: set to the contents, NULL if the file is empty, to be dropped
+ *    with file_release
+ * Returns: SUCCESS or FAIL
+ */
+int read_contents(char *name, fileData **file) {
+	int inodes_visited[INODE_TABLE_SIZE];
+	int num_inodes_visited = 0;
+	int inumber = lookup(name, inodes_visited, &num_inodes_visited, READ);
+	type nType;
+	union Data data;
+
+	if (inumber == FAIL || inode_get(inumber, &nType, &data) == FAIL || nType != T_FILE) {
+		log_info("Read: %s is not a file\n", name);
+		unlock_inodes(inodes_visited, num_inodes_visited);
+		return FAIL;
+	}
+
+	*file = data.file;
+	if (*file)
+		data_ref(*file);
+	unlock_inodes(inodes_visited, num_inodes_visited);
+	return SUCCESS;
+}
+
+/*
+ * A path of a bulk stat with its position in the request
+ */
+typedef struct indexed_path {
+	char *path;
+	int index;
+} indexed_path;
+
+static int compare_paths(const void *a, const void *b) {
+	return strcmp(((indexed_path *) a)->path, ((indexed_path *) b)->path);
+}
+
+/*
+ * Gets the metadata of many nodes, resolving the components shared by
+ * consecutive paths only once. Paths are visited in sorted order, keeping
+ * the nodes of the last path read locked in a stack: each path pops the
+ * components it doesn't share with the previous one and pushes its own.
+ * Input:
+ *  - paths: paths of the nodes
+ *  - count: number of paths
+ *  - paths: paths of the nodes, NULL for ones rejected as invalid
+ *  - count: number of paths
+ *  - stats: metadata to fill, in the order of paths, with inumber FAIL
+ *    and type T_NONE for paths that don't exist or are NULL
+ */
+void stat_nodes(char **paths, int count, tfsNodeStat *stats) {
+	indexed_path order[count];
+	/* stack[0] is the root, stack[i] the node of component i of the last path */
+	int stack[MAX_FILE_NAME / 2 + 1], depth = 0, valid = 0;
+	char names[MAX_FILE_NAME / 2 + 1][MAX_FILE_NAME];
+
+	for (int i = 0; i < count; i++) {
+		memset(&stats[i], 0, sizeof(tfsNodeStat));
+		stats[i].inumber = FAIL;
+		stats[i].type = T_NONE;
+		if (paths[i] == NULL)
+			continue;
+		order[valid].path = paths[i];
+		order[valid++].index = i;
+	}
+	count = valid;
+	qsort(order, count, sizeof(indexed_path), compare_paths);
+
+	inode_lock(FS_ROOT, READ);
+	stack[0] = FS_ROOT;
+
+	for (int i = 0; i < count; i++) {
+		char path[MAX_FILE_NAME], *component, *saveptr;
+		int shared = 0, found = 1;
+		tfsNodeStat *st = &stats[order[i].index];
+
+		strncpy(path, order[i].path, sizeof(path) - 1);
+		path[sizeof(path) - 1] = '\0';
+		component = strtok_r(path, "/", &saveptr);
+
+		/* keep the components shared with the previous path */
+		while (component != NULL && shared < depth && strcmp(names[shared + 1], component) == 0) {
+			shared++;
+			component = strtok_r(NULL, "/", &saveptr);
+		}
+		while (depth > shared) {
+			inode_unlock(stack[depth--]);
+		}
+
+		/* resolve the rest */
+		while (component != NULL) {
+			type nType;
+			union Data data;
+			int child;
+
+			inode_get(stack[depth], &nType, &data);
+			if (nType != T_DIRECTORY || (child = lookup_sub_node(component, data.dirEntries)) == FAIL) {
+				found = 0;
+				break;
+			}
+			inode_lock(child, READ);
+			stack[++depth] = child;
+			strcpy(names[depth], component);
+			component = strtok_r(NULL, "/", &saveptr);
+		}
+
+		if (found)
+			fill_stat(stack[depth], st);
+	}
+
+	while (depth >= 0) {
+		inode_unlock(stack[depth--]);
+	}
+}
+
+
+/*
+ * A directory of a find waiting to be scanned
+ */
+typedef struct find_dir {
+	DirEntry *entries;
+	char *path; /* relative to the root of the namespace, freed once scanned */
+} find_dir;
+
+/*
+ * A find in progress, whose directories are shared by its threads
+ */
+typedef struct find_job {
+	char *pattern;
+	find_callback match;
+	void *arg;
+	find_dir *pending;
+	int num_pending, size_pending;
+	int scanning; /* threads scanning a directory, which may add more */
+	int matches;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+} find_job;
+
+/*
+ * Reports the children of a directory matching the pattern and queues the
+ * ones that are directories.
+ * Returns: number of matches
+ */
+static int find_scan(find_job *job, find_dir *dir) {
+	find_dir found[MAX_DIR_ENTRIES];
+	int num_found = 0, matches = 0;
+	size_t len = strlen(dir->path);
+
+	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
+		DirEntry *entry = &dir->entries[i];
+		type nType;
+		union Data data;
+		char *path;
+
+		if (entry->inumber == FREE_INODE)
+			continue;
+
+		path = malloc(len + strlen(entry->name) + 2);
+		sprintf(path, len ? "%s/%s" : "%s%s", dir->path, entry->name);
+
+		if (fnmatch(job->pattern, entry->name, 0) == 0) {
+			job->match(path, job->arg);
+			matches++;
+		}
+
+		inode_get(entry->inumber, &nType, &data);
+		if (nType == T_DIRECTORY && is_dir_empty(entry->inumber) == FAIL) {
+			found[num_found].entries = data.dirEntries;
+			found[num_found++].path = path;
+		} else {
+			free(path);
+		}
+	}
+
+	if (num_found > 0) {
+		pthread_mutex_lock(&job->lock);
+		if (job->num_pending + num_found > job->size_pending) {
+			job->size_pending = 2 * (job->num_pending + num_found);
+			job->pending = realloc(job->pending, sizeof(find_dir) * job->size_pending);
+		}
+		memcpy(job->pending + job->num_pending, found, sizeof(find_dir) * num_found);
+		job->num_pending += num_found;
+		pthread_cond_broadcast(&job->work);
+		pthread_mutex_unlock(&job->lock);
+	}
+	return matches;
+}
+
+/*
+ * Scans the directories of a find until none is left and none is being
+ * scanned.
+ */
+static void *find_worker(void *arg) {
+	find_job *job = arg;
+
+	pthread_mutex_lock(&job->lock);
+	while (1) {
+		while (job->num_pending == 0 && job->scanning > 0) {
+			pthread_cond_wait(&job->work, &job->lock);
+		}
+		if (job->num_pending == 0)
+			break;
+
+		find_dir dir = job->pending[--job->num_pending];
+		job->scanning++;
+		pthread_mutex_unlock(&job->lock);
+
+		/* an aborted find only empties its queue */
+		int matches = snapshot_aborted() ? 0 : find_scan(job, &dir);
+		free(dir.path);
+
+		pthread_mutex_lock(&job->lock);
+		job->matches += matches;
+		if (--job->scanning == 0 && job->num_pending == 0)
+			pthread_cond_broadcast(&job->work);
+	}
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+/*
+ * Finds the nodes below a directory whose name matches a glob pattern.
+ * The directory is write locked only to take a reference to its entries:
+ * the subtree is then a snapshot, as any operation changing it copies the
+ * nodes along its path first (see unshare_path), and is scanned without
+ * locks. The subdirectories are scanned by up to FIND_MAX_THREADS threads.
+ * The snapshot isn't free: each write below the directory meanwhile
+ * copies its path under the root write lock, and the old nodes stay in the
+ * table until the find ends. A write that finds the table full aborts the
+ * find instead of failing (see snapshots_release).
+ * Input:
+ *  - name: path of the directory
+ *  - pattern: glob pattern, see fnmatch
+ *  - match: called with the path of each match, from any of the threads
+ *  - arg: passed to match
+ * Returns: number of matches or FAIL
+ */
+int find_nodes(char *name, char *pattern, find_callback match, void *arg) {
+	int inodes_visited[INODE_TABLE_SIZE];
+	int num_inodes_visited = 0;
+	pthread_t helpers[FIND_MAX_THREADS - 1];
+	int num_helpers, inumber;
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	find_job job = { pattern, match, arg, NULL, 0, 0, 0, 0,
+		PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+	find_dir root;
+	type nType;
+	union Data data;
+
+	snapshot_begin();
+	inumber = lookup(name, inodes_visited, &num_inodes_visited, WRITE);
+	if (inumber == FAIL || inode_get(inumber, &nType, &data) == FAIL || nType != T_DIRECTORY) {
+		log_info("Find: %s is not a directory\n", name);
+		unlock_inodes(inodes_visited, num_inodes_visited);
+		snapshot_end();
+		return FAIL;
+	}
+	data_ref(data.dirEntries);
+	unlock_inodes(inodes_visited, num_inodes_visited);
+
+	/* paths of the matches are relative, like the ones of requests */
+	while (*name == '/')
+		name++;
+	root.entries = data.dirEntries;
+	root.path = strdup(name);
+	if (*root.path && root.path[strlen(root.path) - 1] == '/')
+		root.path[strlen(root.path) - 1] = '\0';
+
+	/* fan out over the subdirectories of the root, if there are several */
+	job.matches = find_scan(&job, &root);
+	free(root.path);
+
+	num_helpers = job.num_pending < cores ? job.num_pending : cores;
+	if (num_helpers > FIND_MAX_THREADS)
+		num_helpers = FIND_MAX_THREADS;
+	num_helpers = num_helpers > 0 ? num_helpers - 1 : 0;
+	for (int i = 0; i < num_helpers; i++) {
+		if (pthread_create(&helpers[i], NULL, find_worker, &job) != 0) {
+			num_helpers = i;
+			break;
+		}
+	}
+	find_worker(&job);
+	for (int i = 0; i < num_helpers; i++) {
+		pthread_join(helpers[i], NULL);
+	}
+
+	free(job.pending);
+	pthread_mutex_destroy(&job.lock);
+	pthread_cond_destroy(&job.work);
+	release_data(T_DIRECTORY, data);
+	if (snapshot_end() == FAIL) {
+		log_info("Find: %s aborted, inode table full\n", name);
+		return FAIL;
+	}
+	return job.matches;
+}
+
+/*
+ * Output of a dump, appended to in preorder
+ */
+typedef struct dump_buffer {
+	char *data;
+	size_t len, size;
+} dump_buffer;
+
+/*
+ * A directory being written, with the slot of its next child and the
+ * length of its path
+ */
+typedef struct dump_frame {
+	DirEntry *entries;
+	int slot;
+	size_t path_len;
+} dump_frame;
+
+/*
+ * A part of a dump, written by one thread: a node alone or with the whole
+ * subtree below it
+ */
+typedef struct dump_unit {
+	type nType;
+	union Data data;
+	char *path; /* "" for the root of the namespace, "/<path>" otherwise */
+	char *name;
+	int alone;
+	int ready;
+	dump_buffer out;
+} dump_unit;
+
+/*
+ * A dump in progress, whose units are claimed by its threads in order
+ */
+typedef struct dump_job {
+	int binary;
+	dump_unit *units;
+	int num_units;
+	int next_unit;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+} dump_job;
+
+/*
+ * Makes room for len more bytes in a buffer, doubling it as needed.
+ * Returns: pointer to where they go
+ */
+static char *dump_reserve(dump_buffer *buf, size_t len) {
+	if (buf->len + len > buf->size) {
+		buf->size = buf->size ? buf->size : 256;
+		while (buf->len + len > buf->size)
+			buf->size *= 2;
+		if ((buf->data = realloc(buf->data, buf->size)) == NULL) {
+			log_error("dump: out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return buf->data + buf->len;
+}
+
+/*
+ * Appends the record of a node: its path and a newline, or the binary
+ * record of TFS_EXPORT_COMMAND.
+ */
+static void dump_record(dump_buffer *out, int binary, char *path, size_t path_len,
+	type nType, union Data data, char *name) {
+	char *record;
+
+	if (!binary) {
+		record = dump_reserve(out, path_len + 1);
+		memcpy(record, path, path_len);
+		record[path_len] = '\n';
+		out->len += path_len + 1;
+		return;
+	}
+
+	size_t name_len = strlen(name);
+	record = dump_reserve(out, name_len + 3);
+	record[0] = nType;
+	record[1] = name_len;
+	memcpy(record + 2, name, name_len);
+	out->len += name_len + 2;
+	if (nType == T_DIRECTORY) {
+		char children = 0;
+		for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
+			if (data.dirEntries[i].inumber != FREE_INODE)
+				children++;
+		}
+		record[name_len + 2] = children;
+		out->len++;
+	}
+}
+
+/*
+ * Writes a unit in preorder, with an explicit stack of the directories
+ * being written. Paths are built in a single buffer, each child appending
+ * its name to the path of its parent, which is cut back for the next one,
+ * so they have no length limit and aren't copied.
+ */
+static void dump_unit_write(int binary, dump_unit *unit) {
+	dump_buffer path = { 0 }, stack = { 0 };
+	dump_frame *frame;
+	size_t len = strlen(unit->path);
+
+	memcpy(dump_reserve(&path, len + 1), unit->path, len + 1);
+	dump_record(&unit->out, binary, path.data, len, unit->nType, unit->data, unit->name);
+	if (unit->alone || unit->nType != T_DIRECTORY) {
+		free(path.data);
+		return;
+	}
+
+	frame = (dump_frame *) dump_reserve(&stack, sizeof(dump_frame));
+	*frame = (dump_frame) { unit->data.dirEntries, 0, len };
+	stack.len += sizeof(dump_frame);
+
+	while (stack.len > 0 && !snapshot_aborted()) {
+		frame = (dump_frame *) (stack.data + stack.len) - 1;
+		while (frame->slot < MAX_DIR_ENTRIES && frame->entries[frame->slot].inumber == FREE_INODE)
+			frame->slot++;
+		if (frame->slot == MAX_DIR_ENTRIES) {
+			stack.len -= sizeof(dump_frame);
+			continue;
+		}
+
+		DirEntry *entry = &frame->entries[frame->slot++];
+		size_t name_len = strlen(entry->name);
+		size_t sub_len = frame->path_len + 1 + name_len;
+		type nType;
+		union Data data;
+
+		path.len = frame->path_len;
+		dump_reserve(&path, name_len + 2)[0] = '/';
+		memcpy(path.data + frame->path_len + 1, entry->name, name_len + 1);
+
+		inode_get(entry->inumber, &nType, &data);
+		dump_record(&unit->out, binary, path.data, sub_len, nType, data, entry->name);
+
+		if (nType == T_DIRECTORY) {
+			frame = (dump_frame *) dump_reserve(&stack, sizeof(dump_frame));
+			*frame = (dump_frame) { data.dirEntries, 0, sub_len };
+			stack.len += sizeof(dump_frame);
+		}
+	}
+	free(path.data);
+	free(stack.data);
+}
+
+/*
+ * Splits a tree in units, so that threads can write them at once: the
+ * directories of the first levels are replaced by a unit with the node
+ * alone followed by a unit for each child, until there are enough units.
+ * Writing the units one after the other still gives the tree in preorder.
+ * Returns: number of units
+ */
+static int dump_split(dump_unit **units, dump_unit *root, int wanted) {
+	dump_unit *current = malloc(sizeof(dump_unit));
+	int count = 1, split = 1;
+
+	current[0] = *root;
+	while (count < wanted && split) {
+		dump_unit *next = malloc(sizeof(dump_unit) * count * (MAX_DIR_ENTRIES + 1));
+		int next_count = 0;
+
+		split = 0;
+		for (int u = 0; u < count; u++) {
+			dump_unit *unit = &current[u];
+
+			next[next_count++] = *unit;
+			if (unit->alone || unit->nType != T_DIRECTORY)
+				continue;
+
+			next[next_count - 1].alone = 1;
+			for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
+				DirEntry *entry = &unit->data.dirEntries[i];
+				dump_unit *child;
+
+				if (entry->inumber == FREE_INODE)
+					continue;
+				child = &next[next_count++];
+				memset(child, 0, sizeof(dump_unit));
+				inode_get(entry->inumber, &child->nType, &child->data);
+				child->path = malloc(strlen(unit->path) + strlen(entry->name) + 2);
+				sprintf(child->path, "%s/%s", unit->path, entry->name);
+				child->name = entry->name;
+				split = 1;
+			}
+		}
+		free(current);
+		current = next;
+		count = next_count;
+	}
+	*units = current;
+	return count;
+}
+
+static void *dump_worker(void *arg) {
+	dump_job *job = arg;
+
+	while (1) {
+		int u = __atomic_fetch_add(&job->next_unit, 1, __ATOMIC_SEQ_CST);
+		if (u >= job->num_units)
+			break;
+
+		dump_unit_write(job->binary, &job->units[u]);
+
+		pthread_mutex_lock(&job->lock);
+		job->units[u].ready = 1;
+		pthread_cond_broadcast(&job->ready);
+		pthread_mutex_unlock(&job->lock);
+	}
+	return NULL;
+}
+
+/*
+ * Dumps the tree below a node, in preorder, as the lines tecnicofs prints
+ * or as binary records (see TFS_EXPORT_COMMAND). The node is only locked
+ * to take a reference to its data: the tree is then a snapshot, as for
+ * find_nodes, written without locks, so that a slow reader doesn't hold
+ * up other operations. Writes below the node pay for it as they do for a
+ * find, and abort the dump when the table is full. Large trees are split in units written by up to
+ * DUMP_MAX_THREADS threads, and handed to out in order as they are done.
+ * Input:
+ *  - name: path of node
+ *  - binary: 0 for text, 1 for binary records
+ *  - out: called with the dump in order, in pieces of any size, should
+ *    return FAIL to stop
+ *  - arg: passed to out
+ * Returns: number of bytes dumped or FAIL
+ */
+static long dump_tree(char *name, int binary, export_callback out, void *arg) {
+	int inodes_visited[INODE_TABLE_SIZE];
+	int num_inodes_visited = 0;
+	pthread_t helpers[DUMP_MAX_THREADS];
+	long cores = sysconf(_SC_NPROCESSORS_ONLN), total = 0;
+	int num_helpers = 0, status = SUCCESS;
+	dump_job job = { binary, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+	dump_unit root = { 0 };
+
+	snapshot_begin();
+	int inumber = lookup(name, inodes_visited, &num_inodes_visited, WRITE);
+
+	if (inumber == FAIL) {
+		log_info("Dump: %s does not exist\n", name);
+		unlock_inodes(inodes_visited, num_inodes_visited);
+		snapshot_end();
+		return FAIL;
+	}
+	inode_get(inumber, &root.nType, &root.data);
+	if (root.data.dirEntries)
+		data_ref(root.data.dirEntries);
+	unlock_inodes(inodes_visited, num_inodes_visited);
+
+	/* "" for the root, as tecnicofs is printed, and "/<path>" otherwise */
+	while (*name == '/')
+		name++;
+	root.path = malloc(strlen(name) + 2);
+	sprintf(root.path, "%s%s", *name ? "/" : "", name);
+	if (strlen(root.path) > 1 && root.path[strlen(root.path) - 1] == '/')
+		root.path[strlen(root.path) - 1] = '\0';
+	root.name = strrchr(root.path, '/') ? strrchr(root.path, '/') + 1 : root.path;
+
+	if (cores > DUMP_MAX_THREADS)
+		cores = DUMP_MAX_THREADS;
+	job.num_units = dump_split(&job.units, &root, cores > 1 ? 4 * cores : 1);
+	if (job.num_units > 1) {
+		for (num_helpers = 0; num_helpers < cores; num_helpers++) {
+			if (pthread_create(&helpers[num_helpers], NULL, dump_worker, &job) != 0)
+				break;
+		}
+	}
+	if (num_helpers == 0)
+		dump_worker(&job);
+
+	for (int u = 0; u < job.num_units; u++) {
+		dump_unit *unit = &job.units[u];
+
+		pthread_mutex_lock(&job.lock);
+		while (!unit->ready) {
+			pthread_cond_wait(&job.ready, &job.lock);
+		}
+		pthread_mutex_unlock(&job.lock);
+
+		if (status == SUCCESS && (snapshot_aborted() || out(unit->out.data, unit->out.len, arg) == FAIL))
+			status = FAIL;
+		total += unit->out.len;
+		free(unit->out.data);
+		free(unit->path);
+	}
+
+	for (int i = 0; i < num_helpers; i++) {
+		pthread_join(helpers[i], NULL);
+	}
+	free(job.units);
+	pthread_mutex_destroy(&job.lock);
+	pthread_cond_destroy(&job.ready);
+	release_data(root.nType, root.data);
+	if (snapshot_end() == FAIL) {
+		log_info("Dump: %s aborted, inode table full\n", name);
+		status = FAIL;
+	}
+	return status == SUCCESS ? total : FAIL;
+}
+
+/*
+ * Counts the nodes of a dump as its records go by, passing them on.
+ */
+typedef struct export_count {
+	int binary;
+	export_callback out;
+	void *arg;
+	int nodes;
+} export_count;
+
+static int count_records(void *data, size_t len, void *arg) {
+	export_count *count = arg;
+	char *record = data, *end = record + len;
+
+	if (count->binary) {
+		/* units end on a record, each starts with its type and name length */
+		while (record < end) {
+			count->nodes++;
+			record += 2 + (unsigned char) record[1] + (record[0] == T_DIRECTORY);
+		}
+	} else {
+		for (; record < end; record++) {
+			if (*record == '\n')
+				count->nodes++;
+		}
+	}
+	return count->out(data, len, count->arg);
+}
+
+/*
+ * Exports the tree below a node, see dump_tree.
+ * Input:
+ *  - name: path of node
+ *  - binary: 0 for text, 1 for binary records
+ *  - out: called with the dump in order, should return FAIL to stop
+ *  - arg: passed to out
+ * Returns: number of nodes exported or FAIL
+ */
+int export_tree(char *name, int binary, export_callback out, void *arg) {
+	export_count count = { binary, out, arg, 0 };
+
+	return dump_tree(name, binary, count_records, &count) == FAIL ? FAIL : count.nodes;
+}
+
+static int write_file(void *data, size_t len, void *arg) {
+	return fwrite(data, 1, len, arg) == len ? SUCCESS : FAIL;
+}
+
 /*
  * Prints tecnicofs tree.
  * Input:
- *  - fp: pointer to output file
+ *  - path: path of the output file
  */
 int print_tecnicofs_tree(char *path){
 	FILE *fp;
-	
+	int status;
+
 	if ((fp = fopen(path,"w")) == NULL) {
-		fprintf(stderr, "Error: file can't be created\n");
+		log_info("Error: file can't be created\n");
 		return FAIL;
 	}
-	inode_lock(FS_ROOT, WRITE);
 
-	inode_print_tree(fp, FS_ROOT, "");
-
-	inode_unlock(FS_ROOT);
+	status = dump_tree("", 0, write_file, fp) == FAIL ? FAIL : SUCCESS;
 
 	if (fclose(fp) == FAIL) {
-		fprintf(stderr, "Error: file can't be closed\n");
+		log_info("Error: file can't be closed\n");
 		return FAIL;
 	}
-	return SUCCESS;
+	return status;
 }
@@ -4,12 +4,29 @@
 
 void unlock_inodes(int *inodes_visited, int num_inodes_visited);
 void init_fs();
+int restore_fs(int fd);
+int save_fs(int fd);
 void destroy_fs();
-int is_dir_empty(DirEntry *dirEntries);
+int is_dir_empty(int inumber);
+int lookup_sub_node(char *name, DirEntry *entries);
 int create(char *name, type nodeType);
 int delete(char *name);
+int delete_tree(char *name);
 int move(char *path, char *newPath);
+int clone_node(char *path, char *newPath);
 int lookup(char *name, int *inodes_visited, int *num_inodes_visited, int mode);
+int read_dir(char *name, int cursor, tfsDirEntry *entries, int max, int *next);
+int write_contents(char *name, fileData *file);
+int read_contents(char *name, fileData **file);
+int write_range(char *name, char *bytes, size_t len, int offset);
+int stat_node(char *name, tfsNodeStat *st);
+void stat_nodes(char **paths, int count, tfsNodeStat *stats);
+/* called with the path of each match of a find */
+typedef void (*find_callback)(char *path, void *arg);
+int find_nodes(char *name, char *pattern, find_callback match, void *arg);
+/* called with the records of an export, in order */
+typedef int (*export_callback)(void *data, size_t len, void *arg);
+int export_tree(char *name, int binary, export_callback out, void *arg);
 int print_tecnicofs_tree(char *path);
 
 #endif /* FS_H */
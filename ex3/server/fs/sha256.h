@@ -0,0 +1,14 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+
+/*
+ * SHA-256 (FIPS 180-4) of buffers in memory
+ */
+
+#define SHA256_SIZE 32
+
+void sha256(const void *data, size_t len, unsigned char *digest);
+
+#endif /* SHA256_H */
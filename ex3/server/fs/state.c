@@ -4,10 +4,31 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
+#include <time.h>
 #include "state.h"
+#include "../log.h"
 #include "../../tecnicofs-api-constants.h"
 
 inode_t inode_table[INODE_TABLE_SIZE];
+/* i-nodes of the table in use */
+static int inodes_used = 0;
+
+/* placed before the data of an i-node, counts the i-nodes sharing it */
+typedef struct dataHeader {
+    int refs;
+} __attribute__((aligned(16))) dataHeader;
+
+#define DATA_HEADER(data) ((dataHeader *) (data) - 1)
+
+/*
+ * Returns: the current time, in nanoseconds since the epoch
+ */
+static long long time_now() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
 
 /*
  * Sleeps for synchronization testing.
@@ -57,10 +78,13 @@ void inode_table_init() {
     for (int i = 0; i < INODE_TABLE_SIZE; i++) {
         inode_table[i].nodeType = T_NONE;
         inode_table[i].data.dirEntries = NULL;
-        inode_table[i].data.fileContents = NULL;
+        inode_table[i].data.file = NULL;
+        memset(&inode_table[i].meta, 0, sizeof(nodeMeta));
+        inode_table[i].refs = 0;
         // init rwlock inside inode
         pthread_rwlock_init(&(inode_table[i].lock), NULL);
     }
+    inodes_used = 0;
 }
 
 /*
@@ -69,11 +93,12 @@ void inode_table_init() {
 
 void inode_table_destroy() {
     for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        if (inode_table[i].nodeType != T_NONE) {
-            /* as data is an union, the same pointer is used for both dirEntries and fileContents */
-            /* just release one of them */
-	    if (inode_table[i].data.dirEntries)
-            free(inode_table[i].data.dirEntries);
+        if (inode_table[i].nodeType == T_FILE) {
+            file_release(inode_table[i].data.file);
+        } else if (inode_table[i].nodeType != T_NONE) {
+            /* release the entries once every clone sharing them is gone */
+	    if (inode_table[i].data.dirEntries && data_unref(inode_table[i].data.dirEntries) == 0)
+            data_free(inode_table[i].data.dirEntries);
         }
 
         pthread_rwlock_destroy(&(inode_table[i].lock));
@@ -81,14 +106,49 @@ void inode_table_destroy() {
 }
 
 /*
- * Creates a new i-node in the table with the given information.
+ * Allocates the data of an i-node, with a single reference.
  * Input:
- *  - nType: the type of the node (file or directory)
- * Returns:
- *  inumber: identifier of the new i-node, if successfully created
- *     FAIL: if an error occurs
+ *  - size: size of the data
+ * Returns: pointer to the data
  */
-int inode_create(type nType) {
+void *data_alloc(size_t size) {
+    dataHeader *header = malloc(sizeof(dataHeader) + size);
+
+    if (header == NULL) {
+        log_error("data_alloc: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    header->refs = 1;
+    return header + 1;
+}
+
+void data_ref(void *data) {
+    __atomic_add_fetch(&DATA_HEADER(data)->refs, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Drops a reference to the data of an i-node.
+ * Returns: the references left, the data must be freed with data_free
+ *  by whoever drops the last one
+ */
+int data_unref(void *data) {
+    return __atomic_sub_fetch(&DATA_HEADER(data)->refs, 1, __ATOMIC_SEQ_CST);
+}
+
+int data_refs(void *data) {
+    return __atomic_load_n(&DATA_HEADER(data)->refs, __ATOMIC_SEQ_CST);
+}
+
+void data_free(void *data) {
+    free(DATA_HEADER(data));
+}
+
+/*
+ * Takes a free i-node of the table for the given data and its metadata,
+ * with a single reference.
+ * Returns: inumber or FAIL
+ */
+static int inode_alloc(type nType, union Data data, nodeMeta meta) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
@@ -100,19 +160,11 @@ int inode_create(type nType) {
             if (inode_table[inumber].nodeType == T_NONE) {
 
                 inode_table[inumber].nodeType = nType;
+                inode_table[inumber].data = data;
+                inode_table[inumber].meta = meta;
+                inode_table[inumber].refs = 1;
+                __atomic_add_fetch(&inodes_used, 1, __ATOMIC_SEQ_CST);
 
-                if (nType == T_DIRECTORY) {
-                    /* Initializes entry table */
-                    inode_table[inumber].data.dirEntries = malloc(sizeof(DirEntry) * MAX_DIR_ENTRIES);
-                    
-                    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-                        inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-                    }
-                }
-                else {
-                    inode_table[inumber].data.fileContents = NULL;
-                }
-                
                 pthread_rwlock_unlock(&(inode_table[inumber].lock));
                 return inumber;
             }
@@ -128,7 +180,63 @@ int inode_create(type nType) {
 }
 
 /*
- * Deletes the i-node.
+ * Creates a new i-node in the table with the given information.
+ * Input:
+ *  - nType: the type of the node (file or directory)
+ * Returns:
+ *  inumber: identifier of the new i-node, if successfully created
+ *     FAIL: if an error occurs
+ */
+int inode_create(type nType) {
+    union Data data;
+    nodeMeta meta = { 0, 0, time_now(), 0 };
+    int inumber;
+
+    if (nType == T_DIRECTORY) {
+        /* Initializes entry table */
+        data.dirEntries = data_alloc(sizeof(DirEntry) * MAX_DIR_ENTRIES);
+
+        for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
+            data.dirEntries[i].inumber = FREE_INODE;
+        }
+    }
+    else {
+        data.file = NULL;
+    }
+
+    meta.mtime = meta.ctime;
+    inumber = inode_alloc(nType, data, meta);
+    if (inumber == FAIL && data.dirEntries)
+        data_free(data.dirEntries);
+    return inumber;
+}
+
+/*
+ * Creates a new i-node sharing the data of another one, so that the whole
+ * subtree below a directory is shared without being copied. The caller
+ * must hold a lock on the original i-node.
+ * Input:
+ *  - inumber: identifier of the original i-node
+ * Returns: inumber of the clone or FAIL
+ */
+int inode_clone(int inumber) {
+    union Data data = inode_table[inumber].data;
+    nodeMeta meta = inode_table[inumber].meta;
+    int clone;
+
+    if (data.dirEntries)
+        data_ref(data.dirEntries);
+
+    meta.ctime = time_now();
+    clone = inode_alloc(inode_table[inumber].nodeType, data, meta);
+    if (clone == FAIL && data.dirEntries)
+        data_unref(data.dirEntries);
+    return clone;
+}
+
+/*
+ * Deletes the i-node, dropping its reference to its data. The data is
+ * freed with the last reference, which for a directory must then be empty.
  * Input:
  *  - inumber: identifier of the i-node
  * Returns: SUCCESS or FAIL
@@ -138,18 +246,72 @@ int inode_delete(int inumber) {
     insert_delay(DELAY);
 
     if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-        printf("inode_delete: invalid inumber\n");
+        log_warn("inode_delete: invalid inumber\n");
         return FAIL;
-    } 
+    }
 
-    inode_table[inumber].nodeType = T_NONE;
     /* see inode_table_destroy function */
-    if (inode_table[inumber].data.dirEntries)
-        free(inode_table[inumber].data.dirEntries);
+    if (inode_table[inumber].nodeType == T_FILE)
+        file_release(inode_table[inumber].data.file);
+    else if (inode_table[inumber].data.dirEntries && data_unref(inode_table[inumber].data.dirEntries) == 0)
+        data_free(inode_table[inumber].data.dirEntries);
+    inode_table[inumber].nodeType = T_NONE;
+    inode_table[inumber].data.dirEntries = NULL;
+    __atomic_sub_fetch(&inodes_used, 1, __ATOMIC_SEQ_CST);
 
     return SUCCESS;
 }
 
+/*
+ * Drops one of the directory entries referring to the i-node.
+ * Returns: the references left, the i-node must be deleted by whoever
+ *  drops the last one
+ */
+int inode_unref(int inumber) {
+    return __atomic_sub_fetch(&inode_table[inumber].refs, 1, __ATOMIC_SEQ_CST);
+}
+
+int inode_refs(int inumber) {
+    return __atomic_load_n(&inode_table[inumber].refs, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Returns: the number of free i-nodes of the table, which may change as
+ *  soon as it is read
+ */
+int inode_free_count() {
+    return INODE_TABLE_SIZE - __atomic_load_n(&inodes_used, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Gives the i-node a private copy of its data if it shares it with
+ * clones, before the data is changed. The children of a copied directory
+ * gain a reference each. The contents of files are never changed in
+ * place, so they stay shared. The caller must have exclusive access to
+ * the i-node.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: the data the i-node shared, which the caller must release, or
+ *  NULL if it was already private
+ */
+void *inode_unshare_data(int inumber) {
+    void *shared = inode_table[inumber].data.dirEntries;
+    size_t size = sizeof(DirEntry) * MAX_DIR_ENTRIES;
+
+    if (inode_table[inumber].nodeType != T_DIRECTORY || shared == NULL || data_refs(shared) == 1)
+        return NULL;
+
+    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
+        DirEntry *entry = &inode_table[inumber].data.dirEntries[i];
+        if (entry->inumber != FREE_INODE)
+            __atomic_add_fetch(&inode_table[entry->inumber].refs, 1, __ATOMIC_SEQ_CST);
+    }
+
+    inode_table[inumber].data.dirEntries = data_alloc(size);
+    memcpy(inode_table[inumber].data.dirEntries, shared, size);
+    return shared;
+}
+
 /*
  * Copies the contents of the i-node into the arguments.
  * Only the fields referenced by non-null arguments are copied.
@@ -164,7 +326,7 @@ int inode_get(int inumber, type *nType, union Data *data) {
     insert_delay(DELAY);
 
     if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-        printf("inode_get: invalid inumber %d\n", inumber);
+        log_warn("inode_get: invalid inumber %d\n", inumber);
         return FAIL;
     }
 
@@ -177,6 +339,84 @@ int inode_get(int inumber, type *nType, union Data *data) {
     return SUCCESS;
 }
 
+/*
+ * Copies the metadata of the i-node, without scanning its data.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - meta: metadata to fill
+ * Returns: SUCCESS or FAIL
+ */
+int inode_get_meta(int inumber, nodeMeta *meta) {
+    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+        log_warn("inode_get_meta: invalid inumber %d\n", inumber);
+        return FAIL;
+    }
+
+    *meta = inode_table[inumber].meta;
+    return SUCCESS;
+}
+
+/*
+ * Replaces the contents of a file. The old contents are dropped, and freed
+ * unless a clone or a reader still holds them.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - file: new contents (see file_alloc), whose reference the i-node takes
+ * Returns: SUCCESS or FAIL
+ */
+int inode_set_file(int inumber, fileData *file) {
+    fileData *old;
+
+    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType != T_FILE)) {
+        log_warn("inode_set_file: invalid inumber %d\n", inumber);
+        return FAIL;
+    }
+
+    old = inode_table[inumber].data.file;
+    inode_table[inumber].data.file = file;
+    file_release(old);
+
+    inode_table[inumber].meta.size = file ? file->size : 0;
+    inode_table[inumber].meta.mtime = time_now();
+    return SUCCESS;
+}
+
+/*
+ * Writes bytes to a file at an offset (see file_write). Only the blocks
+ * written are copied if a clone or a reader holds the contents.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - bytes: bytes to write
+ *  - len: number of bytes
+ *  - offset: where they are written, FILE_APPEND for the end of the file
+ * Returns: SUCCESS or FAIL
+ */
+int inode_write_file(int inumber, char *bytes, size_t len, int offset) {
+    fileData *file;
+
+    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType != T_FILE)) {
+        log_warn("inode_write_file: invalid inumber %d\n", inumber);
+        return FAIL;
+    }
+
+    file = file_write(inode_table[inumber].data.file, bytes, len, offset);
+    if (file == NULL)
+        return FAIL;
+    inode_table[inumber].data.file = file;
+    inode_table[inumber].meta.size = file->size;
+    inode_table[inumber].meta.mtime = time_now();
+    return SUCCESS;
+}
+
+/*
+ * Counts an entry added to or removed from a directory in its metadata.
+ */
+static void dir_count_entry(int inumber, int delta) {
+    inode_table[inumber].meta.entries += delta;
+    inode_table[inumber].meta.size = inode_table[inumber].meta.entries * sizeof(DirEntry);
+    inode_table[inumber].meta.mtime = time_now();
+}
+
 
 /*
  * Resets an entry for a directory.
@@ -190,17 +430,17 @@ int dir_reset_entry(int inumber, int sub_inumber) {
     insert_delay(DELAY);
 
     if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-        printf("inode_reset_entry: invalid inumber\n");
+        log_warn("inode_reset_entry: invalid inumber\n");
         return FAIL;
     }
 
     if (inode_table[inumber].nodeType != T_DIRECTORY) {
-        printf("inode_reset_entry: can only reset entry to directories\n");
+        log_warn("inode_reset_entry: can only reset entry to directories\n");
         return FAIL;
     }
 
     if ((sub_inumber < FREE_INODE) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
-        printf("inode_reset_entry: invalid entry inumber\n");
+        log_warn("inode_reset_entry: invalid entry inumber\n");
         return FAIL;
     }
 
@@ -209,6 +449,38 @@ int dir_reset_entry(int inumber, int sub_inumber) {
         if (inode_table[inumber].data.dirEntries[i].inumber == sub_inumber) {
             inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
             inode_table[inumber].data.dirEntries[i].name[0] = '\0';
+            dir_count_entry(inumber, -1);
+            return SUCCESS;
+        }
+    }
+    return FAIL;
+}
+
+
+/*
+ * Makes an entry of a directory refer to another i-node, in the same slot
+ * and under the same name, as when a path is unshared from a clone. The
+ * directory isn't changed for its readers, so its mtime is kept.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - sub_inumber: identifier of the sub i-node entry
+ *  - new_inumber: identifier of the i-node it now refers to
+ * Returns: SUCCESS or FAIL
+ */
+int dir_replace_entry(int inumber, int sub_inumber, int new_inumber) {
+    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType != T_DIRECTORY)) {
+        log_warn("dir_replace_entry: invalid inumber\n");
+        return FAIL;
+    }
+
+    if ((new_inumber < 0) || (new_inumber > INODE_TABLE_SIZE) || (inode_table[new_inumber].nodeType == T_NONE)) {
+        log_warn("dir_replace_entry: invalid entry inumber\n");
+        return FAIL;
+    }
+
+    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
+        if (inode_table[inumber].data.dirEntries[i].inumber == sub_inumber) {
+            inode_table[inumber].data.dirEntries[i].inumber = new_inumber;
             return SUCCESS;
         }
     }
@@ -229,30 +501,34 @@ int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
     insert_delay(DELAY);
 
     if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-        printf("inode_add_entry: invalid inumber\n");
+        log_warn("inode_add_entry: invalid inumber\n");
         return FAIL;
     }
 
     if (inode_table[inumber].nodeType != T_DIRECTORY) {
-        printf("inode_add_entry: can only add entry to directories\n");
+        log_warn("inode_add_entry: can only add entry to directories\n");
         return FAIL;
     }
 
     if ((sub_inumber < 0) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
-        printf("inode_add_entry: invalid entry inumber\n");
+        log_warn("inode_add_entry: invalid entry inumber\n");
         return FAIL;
     }
 
     if (strlen(sub_name) == 0 ) {
-        printf("inode_add_entry: \
+        log_warn("inode_add_entry: \
                entry name must be non-empty\n");
         return FAIL;
     }
+
+    if (inode_table[inumber].meta.entries == MAX_DIR_ENTRIES)
+        return FAIL;
     
     for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
         if (inode_table[inumber].data.dirEntries[i].inumber == FREE_INODE) {
             inode_table[inumber].data.dirEntries[i].inumber = sub_inumber;
             strcpy(inode_table[inumber].data.dirEntries[i].name, sub_name);
+            dir_count_entry(inumber, 1);
             return SUCCESS;
         }
     }
@@ -261,27 +537,166 @@ int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
 
 
 /*
- * Prints the i-nodes table.
+ * Writes len bytes to fd, retrying partial writes.
+ * Returns: SUCCESS or FAIL
+ */
+static int write_all(int fd, void *buffer, size_t len) {
+    char *ptr = buffer;
+
+    while (len > 0) {
+        ssize_t n = write(fd, ptr, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FAIL;
+        ptr += n;
+        len -= n;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Reads exactly len bytes from fd.
+ * Returns: SUCCESS or FAIL
+ */
+static int read_all(int fd, void *buffer, size_t len) {
+    char *ptr = buffer;
+
+    while (len > 0) {
+        ssize_t n = read(fd, ptr, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FAIL;
+        ptr += n;
+        len -= n;
+    }
+    return SUCCESS;
+}
+
+static int save_block(int index, char *bytes, void *arg) {
+    return (write_all(*(int *) arg, &index, sizeof(int)) == FAIL ||
+        write_all(*(int *) arg, bytes, FILE_BLOCK_SIZE) == FAIL) ? FAIL : SUCCESS;
+}
+
+/*
+ * Writes every i-node in use to fd, so that another process can rebuild
+ * the table with inode_table_deserialize. The caller must make sure no
+ * operation changes the table meanwhile.
+ * Format: a header, then the inumber, type and metadata of each i-node in
+ * use, followed by the entries of directories or the blocks of files, each
+ * with its index, up to the index -1.
  * Input:
- *  - inumber: identifier of the i-node
- *  - name: pointer to the name of current file/dir
+ *  - fd: file descriptor to write to
+ * Returns: SUCCESS or FAIL
  */
-void inode_print_tree(FILE *fp, int inumber, char *name) {
-    if (inode_table[inumber].nodeType == T_FILE) {
-        fprintf(fp, "%s\n", name);
-        return;
+int inode_table_serialize(int fd) {
+    int header[4] = { SERIALIZE_MAGIC, INODE_TABLE_SIZE, MAX_DIR_ENTRIES, 0 };
+
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        if (inode_table[i].nodeType != T_NONE)
+            header[3]++;
     }
 
-    if (inode_table[inumber].nodeType == T_DIRECTORY) {
-        fprintf(fp, "%s\n", name);
-        for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-            if (inode_table[inumber].data.dirEntries[i].inumber != FREE_INODE) {
-                char path[MAX_FILE_NAME];
-                if (snprintf(path, sizeof(path), "%s/%s", name, inode_table[inumber].data.dirEntries[i].name) > sizeof(path)) {
-                    fprintf(stderr, "truncation when building full path\n");
-                }
-                inode_print_tree(fp, inode_table[inumber].data.dirEntries[i].inumber, path);
-            }
+    if (write_all(fd, header, sizeof(header)) == FAIL)
+        return FAIL;
+
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        int node[2] = { i, inode_table[i].nodeType };
+
+        if (inode_table[i].nodeType == T_NONE)
+            continue;
+
+        if (write_all(fd, node, sizeof(node)) == FAIL ||
+            write_all(fd, &inode_table[i].meta, sizeof(nodeMeta)) == FAIL)
+            return FAIL;
+
+        if (inode_table[i].nodeType == T_DIRECTORY &&
+            write_all(fd, inode_table[i].data.dirEntries, sizeof(DirEntry) * MAX_DIR_ENTRIES) == FAIL)
+            return FAIL;
+
+        if (inode_table[i].nodeType == T_FILE) {
+            int end = -1;
+
+            if (file_blocks(inode_table[i].data.file, save_block, &fd) == FAIL ||
+                write_all(fd, &end, sizeof(int)) == FAIL)
+                return FAIL;
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+ * Rebuilds an empty i-node table from the output of inode_table_serialize.
+ * Input:
+ *  - fd: file descriptor to read from
+ * Returns: SUCCESS or FAIL
+ */
+int inode_table_deserialize(int fd) {
+    int header[4];
+
+    if (read_all(fd, header, sizeof(header)) == FAIL)
+        return FAIL;
+
+    if (header[0] != SERIALIZE_MAGIC || header[1] != INODE_TABLE_SIZE || header[2] != MAX_DIR_ENTRIES) {
+        log_error("inode_table_deserialize: incompatible table\n");
+        return FAIL;
+    }
+
+    for (int n = 0; n < header[3]; n++) {
+        int node[2];
+
+        if (read_all(fd, node, sizeof(node)) == FAIL)
+            return FAIL;
+
+        if (node[0] < 0 || node[0] >= INODE_TABLE_SIZE || node[1] == T_NONE)
+            return FAIL;
+
+        if (read_all(fd, &inode_table[node[0]].meta, sizeof(nodeMeta)) == FAIL)
+            return FAIL;
+
+        if (inode_table[node[0]].nodeType == T_NONE)
+            inodes_used++;
+        inode_table[node[0]].nodeType = node[1];
+
+        if (node[1] == T_DIRECTORY) {
+            inode_table[node[0]].data.dirEntries = data_alloc(sizeof(DirEntry) * MAX_DIR_ENTRIES);
+            if (read_all(fd, inode_table[node[0]].data.dirEntries, sizeof(DirEntry) * MAX_DIR_ENTRIES) == FAIL)
+                return FAIL;
+        }
+
+        /* the last block ends at the size in the metadata, holes stay holes */
+        while (node[1] == T_FILE) {
+            char block[FILE_BLOCK_SIZE];
+            int index, size = inode_table[node[0]].meta.size;
+            fileData *file;
+
+            if (read_all(fd, &index, sizeof(int)) == FAIL)
+                return FAIL;
+            if (index == -1)
+                break;
+            if (index < 0 || (long long) index * FILE_BLOCK_SIZE >= size || read_all(fd, block, FILE_BLOCK_SIZE) == FAIL)
+                return FAIL;
+
+            file = file_write(inode_table[node[0]].data.file, block,
+                size - index * FILE_BLOCK_SIZE < FILE_BLOCK_SIZE ? size - index * FILE_BLOCK_SIZE : FILE_BLOCK_SIZE,
+                index * FILE_BLOCK_SIZE);
+            if (file == NULL)
+                return FAIL;
+            inode_table[node[0]].data.file = file;
+        }
+    }
+
+    /* entries that clones shared are read back as private copies, count the references again */
+    inode_table[FS_ROOT].refs = 1;
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        if (inode_table[i].nodeType != T_DIRECTORY)
+            continue;
+        for (int j = 0; j < MAX_DIR_ENTRIES; j++) {
+            int sub_inumber = inode_table[i].data.dirEntries[j].inumber;
+            if (sub_inumber >= 0 && sub_inumber < INODE_TABLE_SIZE)
+                inode_table[sub_inumber].refs++;
         }
     }
+    return SUCCESS;
 }
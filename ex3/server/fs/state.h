@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "../../tecnicofs-api-constants.h"
+#include "filedata.h"
 
 /* FS root inode number */
 #define FS_ROOT 0
@@ -17,6 +18,9 @@
 
 #define DELAY 0
 
+/* identifies the output of inode_table_serialize */
+#define SERIALIZE_MAGIC 0x54465334
+
 
 /*
  * Contains the name of the entry and respective i-number
@@ -27,19 +31,34 @@ typedef struct dirEntry {
 } DirEntry;
 
 /*
- * Data is either text (file) or entries (DirEntry)
+ * Data is either contents (file) or entries (DirEntry). Either is reference
+ * counted (see data_alloc), as clones of an i-node share its data until
+ * one of them changes it.
  */
 union Data {
-	char *fileContents; /* for files */
+	fileData *file; /* for files, NULL while empty */
 	DirEntry *dirEntries; /* for directories */
 };
 
+/*
+ * Metadata of an i-node, kept up to date as its data changes so that it
+ * can be read without going through the data
+ */
+typedef struct nodeMeta {
+	int entries; /* entries in use, for directories */
+	int size; /* bytes of the contents of a file or of the entries in use */
+	long long ctime; /* creation, in nanoseconds since the epoch */
+	long long mtime; /* last change to the data */
+} nodeMeta;
+
 /*
  * I-node definition
  */
 typedef struct inode_t {    
 	type nodeType;
 	union Data data;
+	nodeMeta meta;
+	int refs; /* directory entries referring to the i-node */
 	pthread_rwlock_t lock;
 } inode_t;
 
@@ -51,13 +70,27 @@ void inode_unlock(int inumber);
 
 void inode_table_init();
 void inode_table_destroy();
+void *data_alloc(size_t size);
+void data_ref(void *data);
+int data_unref(void *data);
+int data_refs(void *data);
+void data_free(void *data);
 int inode_create(type nType);
+int inode_clone(int inumber);
 int inode_delete(int inumber);
+int inode_unref(int inumber);
+int inode_refs(int inumber);
+int inode_free_count();
+void *inode_unshare_data(int inumber);
 int inode_get(int inumber, type *nType, union Data *data);
-int inode_set_file(int inumber, char *fileContents, int len);
+int inode_get_meta(int inumber, nodeMeta *meta);
+int inode_set_file(int inumber, fileData *file);
+int inode_write_file(int inumber, char *bytes, size_t len, int offset);
 int dir_reset_entry(int inumber, int sub_inumber);
 int dir_add_entry(int inumber, int sub_inumber, char *sub_name);
-void inode_print_tree(FILE *fp, int inumber, char *name);
+int dir_replace_entry(int inumber, int sub_inumber, int new_inumber);
+int inode_table_serialize(int fd);
+int inode_table_deserialize(int fd);
 
 
 #endif /* INODES_H */
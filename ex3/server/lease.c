@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "lease.h"
+#include "log.h"
+#include "../tecnicofs-api-constants.h"
+
+#define SUCCESS 0
+#define FAIL -1
+
+/* expires of a slot never used, which ends a probe run, and of a revoked one */
+#define LEASE_UNUSED 0
+#define LEASE_REVOKED 1
+
+/*
+ * A lease on a path held by a client, free once expired
+ */
+typedef struct lease {
+	char path[MAX_FILE_NAME];
+	struct sockaddr_un client_addr;
+	socklen_t addrlen;
+	long expires; /* CLOCK_MONOTONIC, in milliseconds, or LEASE_UNUSED or LEASE_REVOKED */
+} lease;
+
+static lease leases[MAX_LEASES];
+static int activeLeases = 0;
+static int leaseDuration = LEASE_DEFAULT_MS;
+static int pushSockfd = -1;
+static pthread_mutex_t leasesLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static long now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Copies a path without leading, trailing or repeated slashes, so that
+ * "/a//b/" and "a/b" get the same lease.
+ */
+void normalize_path(char *dst, char *src) {
+	int len = 0;
+
+	for (; *src != '\0' && len < MAX_FILE_NAME - 1; src++) {
+		if (*src == '/' && (len == 0 || dst[len - 1] == '/'))
+			continue;
+		dst[len++] = *src;
+	}
+	if (len > 0 && dst[len - 1] == '/')
+		len--;
+	dst[len] = '\0';
+}
+
+
+/*
+ * Sets where invalidations are sent from and how long leases last.
+ * Input:
+ *  - sockfd: socket used to push invalidations to clients
+ *  - duration: milliseconds a lease lasts, 0 disables leases
+ */
+void lease_init(int sockfd, int duration) {
+	pushSockfd = sockfd;
+	leaseDuration = duration;
+}
+
+
+/*
+ * Grants a lease on a path that was found. Must be called while the path
+ * is still locked, so that no delete or move of it runs before the lease
+ * is recorded.
+ * Input:
+ *  - path: path looked up
+ *  - client_addr, addrlen: address of the client
+ * Returns: milliseconds the lease lasts, 0 if none was granted
+ */
+int lease_grant(char *path, struct sockaddr_un *client_addr, socklen_t addrlen) {
+	char key[MAX_FILE_NAME];
+	unsigned int hash = 5381;
+	lease *slot = NULL;
+	long now;
+
+	if (leaseDuration <= 0)
+		return 0;
+
+	normalize_path(key, path);
+	for (char *c = key; *c != '\0'; c++)
+		hash = hash * 33 + *c;
+	for (char *c = client_addr->sun_path; *c != '\0'; c++)
+		hash = hash * 33 + *c;
+
+	pthread_mutex_lock(&leasesLock);
+	now = now_ms();
+
+	/*
+	 * linear probing, renewing the lease of the client if it has one
+	 * anywhere in the run, and otherwise taking the first expired slot
+	 */
+	for (int i = 0; i < MAX_LEASES; i++) {
+		lease *l = &leases[(hash + i) % MAX_LEASES];
+
+		if (l->expires != LEASE_UNUSED && strcmp(l->path, key) == 0 &&
+			strcmp(l->client_addr.sun_path, client_addr->sun_path) == 0) {
+			slot = l;
+			break;
+		}
+		if (l->expires <= now && slot == NULL)
+			slot = l;
+		if (l->expires == LEASE_UNUSED)
+			break;
+	}
+
+	if (slot == NULL) {
+		pthread_mutex_unlock(&leasesLock);
+		return 0;
+	}
+	if (slot->expires <= LEASE_REVOKED)
+		activeLeases++;
+	strcpy(slot->path, key);
+	slot->client_addr = *client_addr;
+	slot->addrlen = addrlen;
+	slot->expires = now + leaseDuration;
+	pthread_mutex_unlock(&leasesLock);
+	return leaseDuration;
+}
+
+
+/*
+ * Revokes the leases on a path and on every path below it, pushing an
+ * invalidation to their holders. Must be called before the change to the
+ * path is unlocked. Pushes never block: if a client isn't draining its
+ * socket, its stale entry lasts at most until the lease expires.
+ * Input:
+ *  - path: path deleted or moved
+ */
+void lease_revoke(char *path) {
+	char key[MAX_FILE_NAME], buffer[sizeof(tfsReply) + MAX_FILE_NAME];
+	tfsReply *push = (tfsReply *) buffer;
+	int len;
+	long now;
+
+	if (__atomic_load_n(&activeLeases, __ATOMIC_RELAXED) == 0)
+		return;
+
+	normalize_path(key, path);
+	len = strlen(key);
+	push->id = TFS_PUSH_ID;
+	push->status = TFS_PUSH_INVALIDATE;
+	push->lease = 0;
+	strcpy(buffer + sizeof(tfsReply), key);
+
+	pthread_mutex_lock(&leasesLock);
+	now = now_ms();
+	for (int i = 0; i < MAX_LEASES; i++) {
+		lease *l = &leases[i];
+
+		if (l->expires <= now) {
+			if (l->expires > LEASE_REVOKED) {
+				l->expires = LEASE_REVOKED;
+				activeLeases--;
+			}
+			continue;
+		}
+
+		if (strncmp(l->path, key, len) != 0 || (l->path[len] != '\0' && l->path[len] != '/'))
+			continue;
+
+		if (sendto(pushSockfd, buffer, sizeof(tfsReply) + len + 1, MSG_DONTWAIT,
+			(struct sockaddr *) &l->client_addr, l->addrlen) < 0) {
+			log_info("lease_revoke: can't invalidate %s\n", l->path);
+		}
+		l->expires = LEASE_REVOKED;
+		activeLeases--;
+	}
+
+	/* revoked slots just before an unused one end no run, free them for good */
+	for (int i = 0; i < MAX_LEASES; i++) {
+		for (int j = (i + MAX_LEASES - 1) % MAX_LEASES; leases[i].expires == LEASE_UNUSED &&
+			leases[j].expires == LEASE_REVOKED; j = (j + MAX_LEASES - 1) % MAX_LEASES)
+			leases[j].expires = LEASE_UNUSED;
+	}
+	pthread_mutex_unlock(&leasesLock);
+}
+
+
+/*
+ * Writes the lease table to fd, for a handoff.
+ * Returns: SUCCESS or FAIL
+ */
+int lease_save(int fd) {
+	char *ptr = (char *) leases;
+	size_t len = sizeof(leases);
+
+	pthread_mutex_lock(&leasesLock);
+	while (len > 0) {
+		ssize_t n = write(fd, ptr, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			pthread_mutex_unlock(&leasesLock);
+			return FAIL;
+		}
+		ptr += n;
+		len -= n;
+	}
+	pthread_mutex_unlock(&leasesLock);
+	return SUCCESS;
+}
+
+
+/*
+ * Reads the lease table written by lease_save.
+ * Returns: SUCCESS or FAIL
+ */
+int lease_restore(int fd) {
+	char *ptr = (char *) leases;
+	size_t len = sizeof(leases);
+
+	while (len > 0) {
+		ssize_t n = read(fd, ptr, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FAIL;
+		ptr += n;
+		len -= n;
+	}
+
+	activeLeases = 0;
+	for (int i = 0; i < MAX_LEASES; i++) {
+		if (leases[i].expires > LEASE_REVOKED)
+			activeLeases++;
+	}
+	return SUCCESS;
+}
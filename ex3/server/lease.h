@@ -0,0 +1,24 @@
+#ifndef LEASE_H
+#define LEASE_H
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Leases on looked up paths.
+ * A client holding a lease may answer lookups of the path locally until
+ * the lease expires. Deleting or moving a path, or one of its ancestors,
+ * revokes its leases, pushing an invalidation to their holders.
+ */
+
+#define MAX_LEASES 4096
+#define LEASE_DEFAULT_MS 1000
+
+void normalize_path(char *dst, char *src);
+void lease_init(int sockfd, int duration);
+int lease_grant(char *path, struct sockaddr_un *client_addr, socklen_t addrlen);
+void lease_revoke(char *path);
+int lease_save(int fd);
+int lease_restore(int fd);
+
+#endif /* LEASE_H */
@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "log.h"
+
+/* conversions kept per record, extra arguments are ignored */
+#define LOG_MAX_ARGS 8
+#define LOG_MAX_RECORD (sizeof(logRecord) + LOG_MAX_ARGS * (2 + LOG_MAX_STRING))
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+
+#define ARG_INTEGER 'i'
+#define ARG_STRING 's'
+
+/*
+ * Header of a record in a ring. It is followed by the arguments, each a
+ * tag byte and then either 8 bytes of integer or a length byte and the
+ * string. A size of 0 pads the ring up to its end.
+ */
+typedef struct logRecord {
+    unsigned short size;
+    unsigned char level;
+    unsigned char nargs;
+    const char *fmt;
+} logRecord;
+
+/*
+ * Single producer, single consumer ring owned by one thread
+ */
+typedef struct logRing {
+    char buffer[LOG_RING_SIZE];
+    unsigned long head __attribute__((aligned(64))); /* written by the owner */
+    unsigned long dropped;
+    unsigned long tail __attribute__((aligned(64))); /* written by the logger */
+    unsigned long reported;
+    struct logRing *next;
+} logRing;
+
+logLevel logThreshold = LOG_DEFAULT_LEVEL;
+
+static __thread logRing *threadRing = NULL;
+static logRing *rings = NULL;
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t loggerThread;
+static int loggerRunning = 0;
+static int stopping = 0;
+
+
+/*
+ * Allocates the ring of the calling thread and publishes it to the logger.
+ */
+static logRing *log_register() {
+    logRing *ring = calloc(1, sizeof(logRing));
+
+    if (ring == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&ringsLock);
+    ring->next = rings;
+    __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ringsLock);
+
+    threadRing = ring;
+    return ring;
+}
+
+
+/*
+ * Skips a conversion specification, from the character after '%'.
+ * Input:
+ *  - fmt: start of the specification
+ *  - isLong: set if the conversion has the l modifier
+ * Returns: pointer to the conversion character
+ */
+static const char *skip_spec(const char *fmt, int *isLong) {
+    *isLong = 0;
+    while (*fmt != '\0' && strchr("-+ #0123456789.", *fmt))
+        fmt++;
+    while (*fmt == 'l') {
+        *isLong = 1;
+        fmt++;
+    }
+    return fmt;
+}
+
+
+/*
+ * Appends a record to the ring of the calling thread. The record is
+ * dropped, and counted, if the ring is full: logging never blocks.
+ * Input:
+ *  - level: level of the message
+ *  - fmt: printf-like format, must be a string literal
+ */
+void log_write(logLevel level, const char *fmt, ...) {
+    char record[LOG_MAX_RECORD] __attribute__((aligned(8)));
+    logRecord *header = (logRecord *) record;
+    size_t len = sizeof(logRecord);
+    int isLong;
+    va_list args;
+
+    logRing *ring = threadRing ? threadRing : log_register();
+    if (ring == NULL)
+        return;
+
+    header->level = level;
+    header->nargs = 0;
+    header->fmt = fmt;
+
+    va_start(args, fmt);
+    for (const char *c = fmt; *c != '\0' && header->nargs < LOG_MAX_ARGS; c++) {
+        if (*c != '%')
+            continue;
+        c = skip_spec(c + 1, &isLong);
+        if (*c == 's') {
+            const char *s = va_arg(args, const char *);
+            size_t n = strnlen(s ? s : "(null)", LOG_MAX_STRING);
+            record[len++] = ARG_STRING;
+            record[len++] = (unsigned char) n;
+            memcpy(record + len, s ? s : "(null)", n);
+            len += n;
+        } else if (*c != '%' && *c != '\0') {
+            long value = isLong ? va_arg(args, long) : va_arg(args, int);
+            record[len++] = ARG_INTEGER;
+            memcpy(record + len, &value, sizeof(value));
+            len += sizeof(value);
+        } else {
+            continue;
+        }
+        header->nargs++;
+    }
+    va_end(args);
+
+    len = (len + 7) & ~7UL;
+    header->size = len;
+
+    unsigned long head = ring->head;
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    unsigned long pos = head & LOG_RING_MASK;
+    unsigned long pad = (len > LOG_RING_SIZE - pos) ? LOG_RING_SIZE - pos : 0;
+
+    if (head + pad + len - tail > LOG_RING_SIZE) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (pad) {
+        ((logRecord *) (ring->buffer + pos))->size = 0;
+        head += pad;
+        pos = 0;
+    }
+    memcpy(ring->buffer + pos, record, len);
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Formats a record, as printf would have with the original arguments.
+ */
+static void log_format(logRecord *header) {
+    char *arg = (char *) (header + 1);
+    FILE *out = header->level <= LOG_WARN ? stderr : stdout;
+    char spec[32], text[LOG_MAX_STRING + 1];
+    int nargs = header->nargs, isLong;
+    const char *c = header->fmt;
+
+    while (*c != '\0') {
+        if (*c != '%') {
+            fputc(*c++, out);
+            continue;
+        }
+
+        const char *end = skip_spec(c + 1, &isLong);
+        if (*end == '%') {
+            fputc('%', out);
+            c = end + 1;
+            continue;
+        }
+        if (*end == '\0' || nargs == 0) {
+            fputs(c, out);
+            break;
+        }
+
+        snprintf(spec, sizeof(spec), "%.*s", (int) (end - c + 1), c);
+        if (*arg == ARG_STRING) {
+            int n = (unsigned char) arg[1];
+            memcpy(text, arg + 2, n);
+            text[n] = '\0';
+            fprintf(out, spec, text);
+            arg += 2 + n;
+        } else {
+            long value;
+            memcpy(&value, arg + 1, sizeof(value));
+            if (isLong)
+                fprintf(out, spec, value);
+            else
+                fprintf(out, spec, (int) value);
+            arg += 1 + sizeof(value);
+        }
+        nargs--;
+        c = end + 1;
+    }
+}
+
+
+/*
+ * Formats every record available in a ring.
+ * Returns: number of records consumed
+ */
+static int log_drain(logRing *ring) {
+    unsigned long tail = ring->tail;
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    int count = 0;
+
+    while (tail != head) {
+        unsigned long pos = tail & LOG_RING_MASK;
+        logRecord *header = (logRecord *) (ring->buffer + pos);
+
+        if (header->size == 0) {
+            tail += LOG_RING_SIZE - pos;
+        } else {
+            log_format(header);
+            tail += header->size;
+            count++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    if (dropped != ring->reported) {
+        fprintf(stderr, "log: %lu records dropped\n", dropped - ring->reported);
+        ring->reported = dropped;
+    }
+    return count;
+}
+
+
+static void *log_consume() {
+    while (1) {
+        int count = 0;
+
+        for (logRing *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+            count += log_drain(ring);
+
+        if (count > 0) {
+            fflush(stdout);
+            fflush(stderr);
+        } else if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+            break;
+        } else {
+            usleep(LOG_FLUSH_US);
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Sets the level and starts the logger thread.
+ * Input:
+ *  - level: least important level that is recorded
+ */
+void log_init(logLevel level) {
+    logThreshold = level;
+    stopping = 0;
+
+    if (pthread_create(&loggerThread, NULL, log_consume, NULL) != 0) {
+        fprintf(stderr, "log_init: can't create logger thread\n");
+        exit(EXIT_FAILURE);
+    }
+    loggerRunning = 1;
+}
+
+
+/*
+ * Waits until the logger thread has written every record appended so far.
+ */
+void log_flush() {
+    int pending = 1;
+
+    while (loggerRunning && pending) {
+        pending = 0;
+        for (logRing *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+            if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+                pending = 1;
+        }
+        if (pending)
+            usleep(LOG_FLUSH_US);
+    }
+}
+
+
+/*
+ * Writes the pending records, stops the logger thread and releases the rings.
+ */
+void log_destroy() {
+    if (loggerRunning) {
+        __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+        pthread_join(loggerThread, NULL);
+        loggerRunning = 0;
+    }
+
+    pthread_mutex_lock(&ringsLock);
+    while (rings != NULL) {
+        logRing *next = rings->next;
+        free(rings);
+        rings = next;
+    }
+    pthread_mutex_unlock(&ringsLock);
+}
@@ -0,0 +1,41 @@
+#ifndef LOG_H
+#define LOG_H
+
+/*
+ * Asynchronous logging.
+ * Each thread appends compact binary records (format pointer plus raw
+ * arguments) to its own lock-free ring buffer, a background thread formats
+ * and writes them. Records below the current level cost a single compare.
+ * Formats must be string literals, as only their address is recorded, and
+ * may only use the conversions d, i, u, x, c and s (with an optional l).
+ */
+
+typedef enum logLevel { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG } logLevel;
+
+#define LOG_DEFAULT_LEVEL LOG_WARN
+
+/* bytes of each per-thread ring, must be a power of two */
+#define LOG_RING_SIZE 65536
+/* longest string argument kept in a record */
+#define LOG_MAX_STRING 128
+/* microseconds the logger thread sleeps when all rings are empty */
+#define LOG_FLUSH_US 1000
+
+extern logLevel logThreshold;
+
+#define log_msg(level, ...) do { \
+    if ((level) <= logThreshold) \
+        log_write((level), __VA_ARGS__); \
+} while (0)
+
+#define log_error(...) log_msg(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) log_msg(LOG_WARN, __VA_ARGS__)
+#define log_info(...) log_msg(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_msg(LOG_DEBUG, __VA_ARGS__)
+
+void log_init(logLevel level);
+void log_destroy();
+void log_flush();
+void log_write(logLevel level, const char *fmt, ...);
+
+#endif /* LOG_H */
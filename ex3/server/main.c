@@ -11,22 +11,88 @@
 #include <sys/types.h>
 #include <sys/un.h>
 #include <sys/uio.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <poll.h>
 #include "fs/operations.h"
+#include "log.h"
+#include "lease.h"
+#include "watch.h"
 
 #define MAX_COMMANDS 10
 #define MAX_INPUT_SIZE 100
+#define CLIENT_TABLE_SIZE 256
+
+/* the control socket used for handoffs is named <socketName>.ctl */
+#define HANDOFF_SUFFIX ".ctl"
+/* shard i > 0 receives requests on <socketName>.i */
+#define MAX_SHARDS 64
 
-#define INDIM 30
-#define OUTDIM 512
 #define READ 1
 
+/*
+ * A request received from a client, waiting in the queue to be applied
+ */
+typedef struct request {
+    tfsRequest message;
+    char *batch; /* commands of a batch, paths of a bulk stat or bytes of a write, NULL otherwise */
+    int batchLen;
+    int fd; /* memfd attached to a write, -1 otherwise */
+    struct sockaddr_un client_addr;
+    socklen_t addrlen;
+} request;
+
+/*
+ * Token bucket used to limit the request rate of a single client
+ */
+typedef struct clientRate {
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    double tokens;
+    struct timeval last;
+} clientRate;
+
+/*
+ * A socket with its own receiver thread, request queue and group of workers
+ */
+typedef struct shard {
+    int sockfd;
+    request *requestQueue;
+    int numberCommands;
+    int headQueue;
+    int insertIndex;
+    pthread_mutex_t commandsLock;
+    pthread_cond_t fill;
+    pthread_t receiverTid;
+} shard;
+
 /* Global variables */
 int numberThreads = 0;
-int sockfd;
+int numberShards = 1;
+shard *shards;
 struct sockaddr_un server_addr;
 socklen_t addrlen;
 
+/* if the contents of files are kept in sealed memfds (see usage) */
+int memfdStorage = 0;
+/* "%c %99s %99s" for MAX_INPUT_SIZE, bounding the arguments of a command */
+char commandFormat[32];
+
+/* admission control thresholds (see usage) */
+int maxInFlight = MAX_COMMANDS;
+int maxClientRate = 0;
+
+/* requests received but not yet answered, queued or being applied, in all shards */
+int inFlight = 0;
+pthread_mutex_t drainLock;
+pthread_cond_t drained;
+
+/* handoff of the sockets and namespace to a new server process */
+int handoffSockfd;
+int stopPipe[2];
+
+clientRate clientRates[CLIENT_TABLE_SIZE];
+pthread_mutex_t ratesLock;
+
 /* ================================================================= */
 
 int setSockAddrUn(char *path, struct sockaddr_un *addr) {
@@ -48,107 +114,975 @@ void errorParse(){
 
 /* prints the program's usage */
 void usage() {
-    fprintf(stderr, "Usage: /tecnicofs <numberOfThreads> <socketName>\n");
+    fprintf(stderr, "Usage: /tecnicofs [-t] [-m] [-z] [-d] [-s numberOfShards] [-q maxInFlight] [-r maxClientRate] [-l leaseMs] [-v logLevel] <numberOfThreads> <socketName>\n");
+    fprintf(stderr, "  -t: take over the sockets and namespace of the server running on socketName\n");
+    fprintf(stderr, "  -m: keep the contents of files in sealed memfds, which reads hand over instead of copying\n");
+    fprintf(stderr, "  -z: compress the blocks of files, memfds written whole are copied even with -m\n");
+    fprintf(stderr, "  -d: store identical blocks of files once, memfds written whole are copied even with -m\n");
+    fprintf(stderr, "  -s: sockets receiving requests, socketName and socketName.1 to socketName.N-1 (default 1)\n");
+    fprintf(stderr, "  -q: requests queued or being applied before rejecting new ones (default %d)\n", MAX_COMMANDS);
+    fprintf(stderr, "  -r: requests per second accepted from a single client (default 0, unlimited)\n");
+    fprintf(stderr, "  -l: milliseconds a client may cache a lookup, 0 disables leases (default %d)\n", LEASE_DEFAULT_MS);
+    fprintf(stderr, "  -v: 0 errors, 1 warnings, 2 every request, 3 debug (default %d)\n", LOG_DEFAULT_LEVEL);
 }
 
-void *applyCommands() {
-    struct sockaddr_un client_addr;
-    char in_buffer[INDIM];;
+void reply(shard *sh, request *req, int status, int lease) {
+    tfsReply rep = { req->message.id, status, lease };
+    sendto(sh->sockfd, &rep, sizeof(rep), 0, (struct sockaddr *)&req->client_addr, req->addrlen);
+}
+
+/*
+ * Answers a request with a status followed by a payload, like the statuses
+ * of a batch or the entries of a listing.
+ */
+void replyPayload(shard *sh, request *req, int status, void *payload, int len) {
+    tfsReply rep = { req->message.id, status, 0 };
+    struct iovec iov[2] = { { &rep, sizeof(rep) }, { payload, len } };
+    struct msghdr msg = { 0 };
+
+    msg.msg_name = &req->client_addr;
+    msg.msg_namelen = req->addrlen;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    sendmsg(sh->sockfd, &msg, 0);
+}
+
+/*
+ * Answers a request with a status and a file descriptor, which the client
+ * gets a copy of.
+ */
+void replyFd(shard *sh, request *req, int status, int fd) {
+    tfsReply rep = { req->message.id, status, 0 };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &rep, sizeof(rep) };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+
+    msg.msg_name = &req->client_addr;
+    msg.msg_namelen = req->addrlen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    sendmsg(sh->sockfd, &msg, 0);
+}
+
+/*
+ * Rejects a request before it is queued, closing the memfd it carries.
+ */
+void rejectRequest(shard *sh, request *req, int status) {
+    if (req->fd >= 0)
+        close(req->fd);
+    reply(sh, req, status, 0);
+}
+
+/*
+ * A reply streamed in datagrams of up to TFS_MAX_REPLY_PAYLOAD bytes,
+ * filled by any number of threads
+ */
+typedef struct stream {
+    shard *sh;
+    request *req;
+    char buffer[TFS_MAX_REPLY_PAYLOAD];
+    int len;
+    pthread_mutex_t lock;
+} stream;
+
+/*
+ * Appends data to a stream, sending the buffered data first with the
+ * status TFS_STREAM_MORE if it doesn't fit.
+ * Returns: SUCCESS or FAIL, if the data is larger than a datagram
+ */
+int streamPut(stream *st, void *data, int len) {
+    if (len > (int) sizeof(st->buffer))
+        return FAIL;
+
+    pthread_mutex_lock(&st->lock);
+    if (st->len + len > (int) sizeof(st->buffer)) {
+        replyPayload(st->sh, st->req, TFS_STREAM_MORE, st->buffer, st->len);
+        st->len = 0;
+    }
+    memcpy(st->buffer + st->len, data, len);
+    st->len += len;
+    pthread_mutex_unlock(&st->lock);
+    return SUCCESS;
+}
+
+/*
+ * Ends a stream, sending the data left with the status of the request.
+ */
+void streamEnd(stream *st, int status) {
+    replyPayload(st->sh, st->req, status, st->buffer, st->len);
+    pthread_mutex_destroy(&st->lock);
+}
+
+/*
+ * Charges a request to the token bucket of the sending client.
+ * Buckets live in a small direct-mapped table indexed by a hash of the
+ * client socket path, a client colliding with another just takes over
+ * the slot with a full bucket.
+ * Input:
+ *  - client_addr: address of the client that sent the request
+ *  - cost: tokens taken, the number of commands in the request
+ * Returns: SUCCESS or FAIL, if the client exceeded maxClientRate
+ */
+int chargeClient(struct sockaddr_un *client_addr, int cost) {
+    unsigned int hash = 5381;
+    struct timeval now;
+    clientRate *entry;
+
+    if (maxClientRate <= 0)
+        return SUCCESS;
+
+    for (char *c = client_addr->sun_path; *c != '\0'; c++)
+        hash = hash * 33 + *c;
+    entry = &clientRates[hash % CLIENT_TABLE_SIZE];
+
+    pthread_mutex_lock(&ratesLock);
+    gettimeofday(&now, NULL);
+    if (strcmp(entry->path, client_addr->sun_path) != 0) {
+        strcpy(entry->path, client_addr->sun_path);
+        entry->tokens = maxClientRate;
+    } else {
+        entry->tokens += maxClientRate * ((double) (now.tv_sec - entry->last.tv_sec) +
+            (double) (now.tv_usec - entry->last.tv_usec) / 1000000);
+        if (entry->tokens > maxClientRate)
+            entry->tokens = maxClientRate;
+    }
+    entry->last = now;
+
+    if (entry->tokens < cost) {
+        pthread_mutex_unlock(&ratesLock);
+        return FAIL;
+    }
+    entry->tokens -= cost;
+    pthread_mutex_unlock(&ratesLock);
+    return SUCCESS;
+}
+
+/*
+ * Tells if a request is sent whole and followed by a list of commands or
+ * paths, or by the bytes of a write.
+ */
+int isMultipart(request *req) {
+    return req->message.command[0] == TFS_BATCH_COMMAND || req->message.command[0] == TFS_BULK_STAT_COMMAND ||
+        req->message.command[0] == TFS_WRITE_COMMAND;
+}
+
+/*
+ * Receives a datagram and the file descriptor attached to it, if any.
+ * Returns: bytes received, as recvfrom
+ */
+int receiveRequest(int sockfd, char *buffer, size_t size, request *req) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { buffer, size };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
     int c;
 
+    msg.msg_name = &req->client_addr;
+    msg.msg_namelen = sizeof(struct sockaddr_un);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    req->fd = -1;
+    c = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+    req->addrlen = msg.msg_namelen;
+    for (cmsg = CMSG_FIRSTHDR(&msg); c >= 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&req->fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return c;
+}
+
+/*
+ * Receives requests from the socket of a shard and queues them for its
+ * worker threads. Requests past the admission thresholds are answered
+ * right away with TECNICOFS_ERROR_SERVER_BUSY instead of waiting for a worker.
+ * A batch counts as one request in flight, but as all its commands for the
+ * rate of its client.
+ */
+void *receiveRequests(void *arg) {
+    shard *sh = arg;
+    struct pollfd fds[2] = { { sh->sockfd, POLLIN, 0 }, { stopPipe[0], POLLIN, 0 } };
+    char buffer[TFS_MAX_BATCH_SIZE + 1];
+    request req;
+    int c, cost;
+
     while (1) {
-		addrlen = sizeof(struct sockaddr_un);
-		c = recvfrom(sockfd, in_buffer, sizeof(in_buffer)-1, 0, (struct sockaddr *)&client_addr, &addrlen);
-		if (c <= 0) continue;
-		//Preventivo, caso o cliente nao tenha terminado a mensagem em '\0', 
-		in_buffer[c]='\0';
+        if (poll(fds, 2, -1) < 0) continue;
+        /* stop receiving, a handoff is in progress */
+        if (fds[1].revents) break;
+        if (!(fds[0].revents & POLLIN)) continue;
+
+        c = receiveRequest(sh->sockfd, buffer, sizeof(buffer)-1, &req);
+        if (c <= (int) sizeof(req.message.id)) {
+            if (req.fd >= 0)
+                close(req.fd);
+            continue;
+        }
+        //Preventivo, caso o cliente nao tenha terminado a mensagem em '\0', 
+        buffer[c]='\0';
+        memcpy(&req.message, buffer, c < (int) sizeof(req.message) ? c : (int) sizeof(req.message));
+        req.message.command[sizeof(req.message.command) - 1] = '\0';
 
-        const char* command = in_buffer;
+        /* only writes carry a memfd */
+        if (req.fd >= 0 && req.message.command[0] != TFS_WRITE_COMMAND) {
+            close(req.fd);
+            req.fd = -1;
+        }
 
-        char token, type;
-        char name[MAX_INPUT_SIZE], secondArgument[MAX_INPUT_SIZE];
+        req.batch = NULL;
+        cost = 1;
+        if (req.message.command[0] == TFS_WRITE_COMMAND) {
+            if (c < (int) sizeof(req.message)) {
+                rejectRequest(sh, &req, TECNICOFS_ERROR_OTHER);
+                continue;
+            }
+            req.batchLen = c - sizeof(req.message);
+        } else if (isMultipart(&req)) {
+            if (c <= (int) sizeof(req.message) || sscanf(req.message.command, "%*c %d", &cost) != 1 ||
+                cost <= 0 || cost > TFS_MAX_BATCH) {
+                reply(sh, &req, TECNICOFS_ERROR_OTHER, 0);
+                continue;
+            }
+            req.batchLen = c - sizeof(req.message);
+        }
 
-        int numTokens = sscanf(command, "%c %s %s", &token, name, secondArgument);
-        type = (char) secondArgument[0];
+        if (chargeClient(&req.client_addr, cost) == FAIL) {
+            rejectRequest(sh, &req, TECNICOFS_ERROR_SERVER_BUSY);
+            continue;
+        }
 
-        if (numTokens < 2) {
-            fprintf(stderr, "Error: invalid command in Queue\n");
-            exit(EXIT_FAILURE);
+        if (__atomic_add_fetch(&inFlight, 1, __ATOMIC_ACQ_REL) > maxInFlight) {
+            __atomic_sub_fetch(&inFlight, 1, __ATOMIC_ACQ_REL);
+            rejectRequest(sh, &req, TECNICOFS_ERROR_SERVER_BUSY);
+            continue;
         }
 
-        int status;
-        switch (token) {
-            case 'c': /* CREATE */
-                switch (type) {
-                    case 'f':
-                        printf("Create file: %s\n", name);
-                        status = create(name, T_FILE); 
-                        
-                        break;
-                    case 'd':
-                        printf("Create directory: %s\n", name);
-                        status = create(name, T_DIRECTORY);
-                        break;
-                    default:
-                        fprintf(stderr, "Error: invalid node type\n");
-                        exit(EXIT_FAILURE);
-                }
+        if (isMultipart(&req) && req.batchLen > 0) {
+            /* freed by the worker that applies it */
+            req.batch = malloc(req.batchLen);
+            memcpy(req.batch, buffer + sizeof(req.message), req.batchLen);
+        }
+
+        /* inFlight bounds numberCommands, there is always room in the queue */
+        pthread_mutex_lock(&sh->commandsLock);
+        sh->requestQueue[sh->insertIndex] = req;
+        sh->insertIndex = (sh->insertIndex + 1) % maxInFlight; /* increment circularly */
+        sh->numberCommands++;
+        pthread_cond_signal(&sh->fill);
+        pthread_mutex_unlock(&sh->commandsLock);
+    }
+    return NULL;
+}
+
+/*
+ * Applies a single command to the filesystem.
+ * Input:
+ *  - command: command in text, e.g. "c /a d"
+ *  - req: request carrying the command, for the lease on a lookup,
+ *    or NULL not to grant one
+ *  - lease: set to the milliseconds of the lease granted, if any
+ *  - payload: buffer of TFS_MAX_REPLY_PAYLOAD bytes for the data sent back
+ *    after the status, or NULL if the command can't send any (batches)
+ *  - payloadLen: set to the bytes written to payload
+ * Returns: status of the command, TECNICOFS_ERROR_OTHER if it is invalid
+ */
+int executeCommand(const char *command, request *req, int *lease, char *payload, int *payloadLen) {
+    char token, type;
+    char name[MAX_INPUT_SIZE], secondArgument[MAX_INPUT_SIZE];
+    int status;
+
+    *lease = 0;
+    *payloadLen = 0;
+    secondArgument[0] = '\0';
+    int numTokens = sscanf(command, commandFormat, &token, name, secondArgument);
+    type = (char) secondArgument[0];
+
+    if (numTokens < 1 || (numTokens < 2 && token != 'i' && token != 'u')) {
+        log_warn("Error: invalid command %s\n", command);
+        return TECNICOFS_ERROR_OTHER;
+    }
+
+    switch (token) {
+        case 'c': /* CREATE */
+            switch (type) {
+                case 'f':
+                    log_info("Create file: %s\n", name);
+                    status = create(name, T_FILE); 
+                    
+                    break;
+                case 'd':
+                    log_info("Create directory: %s\n", name);
+                    status = create(name, T_DIRECTORY);
+                    break;
+                default:
+                    log_warn("Error: invalid node type %c\n", type);
+                    status = TECNICOFS_ERROR_OTHER;
+            }
+            break;
+
+        case 'l': /* LOOKUP */
+            {  
+            int inodes_visited[INODE_TABLE_SIZE];
+            int num_inodes_visited = 0;
+            
+            status = lookup(name, inodes_visited, &num_inodes_visited, READ);
+            /* granted while the path is locked, before any delete or move of it */
+            if (status >= 0 && req != NULL)
+                *lease = lease_grant(name, &req->client_addr, req->addrlen);
+            unlock_inodes(inodes_visited, num_inodes_visited);
+
+            if (status >= 0) {
+                log_info("Search: %s found\n", name);
+            } else {
+                log_info("Search: %s not found\n", name);
+            }
+
+            break;
+            }
+
+        case 'd': /* DELETE */
+            log_info("Delete: %s\n", name);
+            status = delete(name);
+            break;
+
+        case 'D': /* RECURSIVE DELETE */
+            log_info("Delete tree: %s\n", name);
+            status = delete_tree(name);
+            break;
+        
+        case 'm': /* MOVE */
+            log_info("Move: %s %s\n", name, secondArgument);
+            status = move(name, secondArgument);
+            break;
+
+        case 'C': /* CLONE */
+            if (numTokens != 3) {
+                status = TECNICOFS_ERROR_OTHER;
                 break;
+            }
+            log_info("Clone: %s %s\n", name, secondArgument);
+            status = clone_node(name, secondArgument);
+            break;
 
-            case 'l': /* LOOKUP */
-                {  
-                int inodes_visited[INODE_TABLE_SIZE];
-	            int num_inodes_visited = 0;
-                
-                status = lookup(name, inodes_visited, &num_inodes_visited, READ);
-                unlock_inodes(inodes_visited, num_inodes_visited);
+        case 'r': /* READDIR */
+            {
+            int next;
 
-                if (status >= 0) {
-                    printf("Search: %s found\n", name);
-                } else {
-                    printf("Search: %s not found\n", name);
-                }
+            if (payload == NULL || numTokens != 3) {
+                status = TECNICOFS_ERROR_OTHER;
+                break;
+            }
+            log_info("Readdir: %s from %s\n", name, secondArgument);
+            status = read_dir(name, atoi(secondArgument), (tfsDirEntry *) (payload + sizeof(int)),
+                TFS_READDIR_CHUNK, &next);
+            if (status >= 0) {
+                memcpy(payload, &next, sizeof(int));
+                *payloadLen = sizeof(int) + status * sizeof(tfsDirEntry);
+            }
+            break;
+            }
 
+        case 's': /* STAT */
+            if (payload == NULL) {
+                status = TECNICOFS_ERROR_OTHER;
                 break;
-                }
+            }
+            log_info("Stat: %s\n", name);
+            status = stat_node(name, (tfsNodeStat *) payload);
+            if (status == SUCCESS)
+                *payloadLen = sizeof(tfsNodeStat);
+            break;
+
+        case 'W': /* WATCH */
+            {
+            char mode;
+            int id;
 
-            case 'd': /* DELETE */
-                printf("Delete: %s\n", name);
-                status = delete(name);
+            if (req == NULL || sscanf(command, "W %*s %c %d", &mode, &id) != 2 || id <= 0 ||
+                (mode != 'r' && mode != 'n')) {
+                status = TECNICOFS_ERROR_OTHER;
                 break;
-            
-            case 'm': /* MOVE */
-                printf("Move: %s %s\n", name, secondArgument);
-                status = move(name, secondArgument);
+            }
+            log_info("Watch: %s\n", name);
+            status = watch_add(name, mode == 'r', id, &req->client_addr, req->addrlen);
+            break;
+            }
+
+        case 'U': /* UNWATCH */
+            {
+            int id;
+
+            if (req == NULL || sscanf(command, "U %d", &id) != 1 || id <= 0) {
+                status = TECNICOFS_ERROR_OTHER;
                 break;
+            }
+            log_info("Unwatch: %d\n", id);
+            status = watch_remove(id, &req->client_addr);
+            break;
+            }
+
+        case 'i': /* INFO */
+            status = numberShards;
+            break;
 
-            case 'p': /* PRINT */
-                printf("Print tree\n");
-                status = print_tecnicofs_tree(name);
+        case 'u': /* USAGE */
+            {
+            tfsUsageStat *usage = (tfsUsageStat *) payload;
+
+            if (payload == NULL) {
+                status = TECNICOFS_ERROR_OTHER;
                 break;
-            default: { /* error */
-                fprintf(stderr, "Error: command to apply\n");
+            }
+            file_usage(usage);
+            *payloadLen = sizeof(tfsUsageStat);
+            status = SUCCESS;
+            break;
+            }
+
+        case 'p': /* PRINT */
+            log_info("Print tree\n");
+            status = print_tecnicofs_tree(name);
+            break;
+        default: /* error */
+            log_warn("Error: invalid command %s\n", command);
+            status = TECNICOFS_ERROR_OTHER;
+    }
+    return status;
+}
+
+/*
+ * Applies the commands of a batch in order, each one on its own: a failed
+ * command doesn't stop or undo the others. Lookups in a batch get no lease.
+ * Input:
+ *  - req: batch request
+ *  - results: array of TFS_MAX_BATCH to store the status of each command
+ * Returns: number of commands applied, less than the count of the batch
+ *  if it is malformed
+ */
+int applyBatch(request *req, int *results) {
+    char *command = req->batch, *end = req->batch + req->batchLen;
+    int count, applied, lease, payloadLen;
+
+    if (sscanf(req->message.command, "b %d", &count) != 1 || count > TFS_MAX_BATCH)
+        count = 0;
+
+    for (applied = 0; applied < count && command < end; applied++) {
+        size_t len = strnlen(command, end - command);
+        if (command + len == end) /* not terminated */
+            break;
+        /* longer than a command sent alone can be */
+        if (len >= MAX_INPUT_SIZE || command[0] == TFS_BATCH_COMMAND)
+            results[applied] = TECNICOFS_ERROR_OTHER;
+        else
+            results[applied] = executeCommand(command, NULL, &lease, NULL, &payloadLen);
+        command += len + 1;
+    }
+    return applied;
+}
+
+/*
+ * Gets the metadata of the paths of a bulk stat.
+ * Input:
+ *  - req: bulk stat request
+ *  - stats: array of TFS_MAX_STAT to fill
+ * Returns: number of paths, less than the count of the request if it is malformed
+ */
+int applyBulkStat(request *req, tfsNodeStat *stats) {
+    char *path = req->batch, *end = req->batch + req->batchLen, *paths[TFS_MAX_STAT];
+    int count, n;
+
+    if (sscanf(req->message.command, "S %d", &count) != 1 || count > TFS_MAX_STAT)
+        count = 0;
+
+    for (n = 0; n < count && path < end; n++) {
+        size_t len = strnlen(path, end - path);
+        if (path + len == end) /* not terminated */
+            break;
+        /* too long to be a path, rather than truncated to an existing prefix */
+        paths[n] = len < MAX_FILE_NAME ? path : NULL;
+        path += len + 1;
+    }
+
+    log_info("Bulk stat: %d paths\n", n);
+    stat_nodes(paths, n, stats);
+    return n;
+}
+
+void streamMatch(char *path, void *arg) {
+    if (streamPut(arg, path, strlen(path) + 1) == FAIL)
+        log_warn("Find: path too long to send %s\n", path);
+}
+
+/*
+ * Finds the nodes matching a pattern, streaming their paths back.
+ * Input:
+ *  - sh: shard the request was received on
+ *  - req: find request
+ */
+void applyFind(shard *sh, request *req) {
+    char path[MAX_INPUT_SIZE], pattern[MAX_INPUT_SIZE];
+    stream st = { sh, req, "", 0, PTHREAD_MUTEX_INITIALIZER };
+    int status;
+
+    if (sscanf(req->message.command, "%*c %s %s", path, pattern) != 2) {
+        streamEnd(&st, TECNICOFS_ERROR_OTHER);
+        return;
+    }
+    log_info("Find: %s in %s\n", pattern, path);
+    status = find_nodes(path, pattern, streamMatch, &st);
+    streamEnd(&st, status);
+}
+
+/*
+ * Appends data of any size to a stream, splitting it across datagrams.
+ */
+int streamWrite(void *data, size_t len, void *arg) {
+    stream *st = arg;
+    char *ptr = data;
+
+    pthread_mutex_lock(&st->lock);
+    while (len > 0) {
+        size_t n = sizeof(st->buffer) - st->len;
+
+        if (n == 0) {
+            replyPayload(st->sh, st->req, TFS_STREAM_MORE, st->buffer, st->len);
+            st->len = 0;
+            continue;
+        }
+        if (n > len)
+            n = len;
+        memcpy(st->buffer + st->len, ptr, n);
+        st->len += n;
+        ptr += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&st->lock);
+    return SUCCESS;
+}
+
+/*
+ * Exports the tree below a path, streaming it back.
+ * Input:
+ *  - sh: shard the request was received on
+ *  - req: export request
+ */
+void applyExport(shard *sh, request *req) {
+    char path[MAX_INPUT_SIZE], format;
+    stream st = { sh, req, "", 0, PTHREAD_MUTEX_INITIALIZER };
+
+    if (sscanf(req->message.command, "%*c %s %c", path, &format) != 2 || (format != 't' && format != 'b')) {
+        streamEnd(&st, TECNICOFS_ERROR_OTHER);
+        return;
+    }
+    log_info("Export: %s\n", path);
+    streamEnd(&st, export_tree(path, format == 'b', streamWrite, &st));
+}
+
+/*
+ * Writes a range of a file from the memfd attached to a write request,
+ * read into a buffer of the server first, as the client may still change
+ * or shrink it meanwhile.
+ * Input:
+ *  - path: path of the file
+ *  - fd: the memfd, which is closed
+ *  - len: bytes the client said it holds
+ *  - offset: where they are written
+ * Returns: status of the write
+ */
+int writeRangeFd(char *path, int fd, int len, int offset) {
+    struct stat st;
+    char *bytes;
+    int status, done = 0;
+    ssize_t n;
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size != len ||
+        (bytes = malloc(len > 0 ? len : 1)) == NULL) {
+        close(fd);
+        return TECNICOFS_ERROR_OTHER;
+    }
+    while (done < len) {
+        n = pread(fd, bytes + done, len - done, done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    close(fd);
+
+    /* truncated since it was sent */
+    status = done == len ? write_range(path, bytes, len, offset) : TECNICOFS_ERROR_OTHER;
+    free(bytes);
+    return status;
+}
+
+/*
+ * Writes to a file the bytes following the request or the memfd attached
+ * to it. Without an offset they replace the contents, and the memfd isn't
+ * copied if contents are kept in memfds; with one only the blocks they
+ * fall in change.
+ * Input:
+ *  - req: write request
+ * Returns: status of the write
+ */
+int applyWrite(request *req) {
+    char path[MAX_INPUT_SIZE];
+    fileData *file;
+    int len, offset, status, args;
+
+    args = sscanf(req->message.command, "%*c %s %d %d", path, &len, &offset);
+    if (args < 2 || len < 0 || (args == 3 && offset < 0 && offset != TFS_APPEND) ||
+        (req->fd < 0 && len != req->batchLen)) {
+        if (req->fd >= 0)
+            close(req->fd);
+        return TECNICOFS_ERROR_OTHER;
+    }
+
+    if (args == 3) {
+        log_info("Write: %s, %d bytes at %d%s\n", path, len, offset, req->fd >= 0 ? " in a memfd" : "");
+        if (req->fd >= 0)
+            return writeRangeFd(path, req->fd, len, offset);
+        return write_range(path, req->batch, len, offset);
+    }
+
+    file = req->fd >= 0 ? file_adopt(req->fd) : file_alloc(req->batch, len);
+    if (file == NULL || file->size != len) {
+        /* the memfd isn't the length the client said */
+        file_release(file);
+        return TECNICOFS_ERROR_OTHER;
+    }
+
+    log_info("Write: %s, %d bytes%s\n", path, len, req->fd >= 0 ? " in a memfd" : "");
+    if ((status = write_contents(path, file)) == FAIL)
+        file_release(file);
+    return status;
+}
+
+/*
+ * Reads a file, whole or a range of it. Contents still held whole in a
+ * memfd are handed to the client as they are and, if contents are kept in
+ * memfds, other large ones are copied to a new one; the rest is streamed
+ * back.
+ * Input:
+ *  - sh: shard the request was received on
+ *  - req: read request
+ */
+void applyRead(shard *sh, request *req) {
+    char path[MAX_INPUT_SIZE];
+    stream st = { sh, req, "", 0, PTHREAD_MUTEX_INITIALIZER };
+    fileData *file;
+    int offset, len, args, fd;
+
+    args = sscanf(req->message.command, "%*c %s %d %d", path, &offset, &len);
+    if (args != 1 && (args != 3 || offset < 0 || len < 0)) {
+        streamEnd(&st, TECNICOFS_ERROR_OTHER);
+        return;
+    }
+    log_info("Read: %s\n", path);
+    if (read_contents(path, &file) == FAIL) {
+        streamEnd(&st, FAIL);
+        return;
+    }
+
+    if (args == 3) {
+        streamEnd(&st, file_read(file, offset, len, streamWrite, &st));
+    } else if (file == NULL) {
+        streamEnd(&st, 0);
+    } else if (file_memfd(file) >= 0) {
+        replyFd(sh, req, file->size, file_memfd(file));
+        pthread_mutex_destroy(&st.lock);
+    } else if (memfdStorage && file->size > TFS_MAX_REPLY_PAYLOAD && (fd = file_pack(file)) >= 0) {
+        replyFd(sh, req, file->size, fd);
+        close(fd);
+        pthread_mutex_destroy(&st.lock);
+    } else {
+        streamEnd(&st, file_read(file, 0, file->size, streamWrite, &st));
+    }
+    file_release(file);
+}
+
+void *applyCommands(void *arg) {
+    shard *sh = arg;
+    request req;
+    int results[TFS_MAX_BATCH];
+    char payload[TFS_MAX_REPLY_PAYLOAD] __attribute__((aligned(8)));
+
+    while (1) {
+        pthread_mutex_lock(&sh->commandsLock);
+        while (sh->numberCommands == 0) {
+            pthread_cond_wait(&sh->fill, &sh->commandsLock);
+        }
+
+        req = sh->requestQueue[sh->headQueue];
+        sh->headQueue = (sh->headQueue + 1) % maxInFlight; /* increment circularly */
+        sh->numberCommands--;
+        pthread_mutex_unlock(&sh->commandsLock);
+
+        if (req.batch != NULL && req.message.command[0] == TFS_BULK_STAT_COMMAND) {
+            int n = applyBulkStat(&req, (tfsNodeStat *) payload);
+            replyPayload(sh, &req, n, payload, sizeof(tfsNodeStat) * n);
+            free(req.batch);
+        } else if (req.message.command[0] == TFS_FIND_COMMAND) {
+            applyFind(sh, &req);
+        } else if (req.message.command[0] == TFS_EXPORT_COMMAND) {
+            applyExport(sh, &req);
+        } else if (req.message.command[0] == TFS_READ_COMMAND) {
+            applyRead(sh, &req);
+        } else if (req.message.command[0] == TFS_WRITE_COMMAND) {
+            reply(sh, &req, applyWrite(&req), 0);
+            free(req.batch);
+        } else if (req.batch != NULL) {
+            int applied = applyBatch(&req, results);
+            replyPayload(sh, &req, applied, results, sizeof(int) * applied);
+            free(req.batch);
+        } else {
+            int lease, payloadLen;
+            int status = executeCommand(req.message.command, &req, &lease, payload, &payloadLen);
+            if (payloadLen > 0)
+                replyPayload(sh, &req, status, payload, payloadLen);
+            else
+                reply(sh, &req, status, lease);
+        }
+
+        if (__atomic_sub_fetch(&inFlight, 1, __ATOMIC_ACQ_REL) == 0) {
+            pthread_mutex_lock(&drainLock);
+            pthread_cond_signal(&drained);
+            pthread_mutex_unlock(&drainLock);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Sends file descriptors over a connected unix socket, with SCM_RIGHTS.
+ * Input:
+ *  - sock: connected unix socket
+ *  - fds: file descriptors to send
+ *  - n: number of file descriptors, at most MAX_SHARDS
+ * Returns: SUCCESS or FAIL
+ */
+int sendFds(int sock, int *fds, int n) {
+    char control[CMSG_SPACE(sizeof(int) * MAX_SHARDS)];
+    struct iovec iov = { &n, sizeof(n) };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+
+    return sendmsg(sock, &msg, 0) == sizeof(n) ? SUCCESS : FAIL;
+}
+
+/*
+ * Receives file descriptors sent with sendFds.
+ * Input:
+ *  - sock: connected unix socket
+ *  - fds: array of MAX_SHARDS to store the file descriptors
+ * Returns: number of file descriptors received or FAIL
+ */
+int recvFds(int sock, int *fds) {
+    char control[CMSG_SPACE(sizeof(int) * MAX_SHARDS)];
+    int n;
+    struct iovec iov = { &n, sizeof(n) };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(sock, &msg, 0) != sizeof(n) || n <= 0 || n > MAX_SHARDS)
+        return FAIL;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * n))
+        return FAIL;
+
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n);
+    return n;
+}
+
+/*
+ * Waits for a new server process on the control socket and hands it the
+ * bound sockets and the namespace. New requests are left in the socket
+ * while the ones in flight drain, then this process exits. If the handoff
+ * fails the server resumes receiving requests.
+ */
+void *acceptHandoff() {
+    int fds[MAX_SHARDS];
+    char stop = 0;
+
+    while (1) {
+        int ctl = accept(handoffSockfd, NULL, NULL);
+        if (ctl < 0) continue;
+
+        log_warn("Handoff: draining requests\n");
+        if (write(stopPipe[1], &stop, sizeof(stop)) != sizeof(stop)) {
+            log_error("Handoff: can't stop receiving requests\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < numberShards; i++) {
+            pthread_join(shards[i].receiverTid, NULL);
+            fds[i] = shards[i].sockfd;
+        }
+
+        pthread_mutex_lock(&drainLock);
+        while (__atomic_load_n(&inFlight, __ATOMIC_ACQUIRE) > 0) {
+            pthread_cond_wait(&drained, &drainLock);
+        }
+        pthread_mutex_unlock(&drainLock);
+
+        /* workers are idle, the namespace can't change while it is saved */
+        if (sendFds(ctl, fds, numberShards) == SUCCESS && save_fs(ctl) == SUCCESS && lease_save(ctl) == SUCCESS &&
+            watch_save(ctl) == SUCCESS) {
+            close(ctl);
+            log_warn("Handoff: done, exiting\n");
+            log_flush();
+            exit(EXIT_SUCCESS);
+        }
+
+        log_error("Handoff: failed, resuming\n");
+        close(ctl);
+        if (read(stopPipe[0], &stop, sizeof(stop)) != sizeof(stop)) {
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < numberShards; i++) {
+            if (pthread_create(&shards[i].receiverTid, NULL, receiveRequests, &shards[i]) != 0) {
                 exit(EXIT_FAILURE);
             }
         }
-    sendto(sockfd, &status, sizeof(status), 0, (struct sockaddr *)&client_addr, addrlen);
     }
     return NULL;
 }
 
+/*
+ * Takes over from the server running on socketName: receives its bound
+ * sockets and restores its namespace. The number of shards is the one of
+ * the running server.
+ * Input:
+ *  - handoffName: control socket of the running server
+ *  - fds: array of MAX_SHARDS to store the sockets
+ * Returns: number of sockets received or FAIL
+ */
+int takeOver(char *handoffName, int *fds) {
+    struct sockaddr_un addr;
+    socklen_t len = setSockAddrUn(handoffName, &addr);
+    int ctl, n;
+
+    if ((ctl = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        connect(ctl, (struct sockaddr *) &addr, len) < 0) {
+        perror("server: can't connect to running server");
+        return FAIL;
+    }
+
+    if ((n = recvFds(ctl, fds)) == FAIL || restore_fs(ctl) == FAIL || lease_restore(ctl) == FAIL ||
+        watch_restore(ctl) == FAIL) {
+        fprintf(stderr, "server: handoff from running server failed\n");
+        close(ctl);
+        return FAIL;
+    }
+
+    close(ctl);
+    return n;
+}
+
+/*
+ * Listens on the control socket for a server process taking over.
+ */
+void listenHandoff(char *handoffName) {
+    struct sockaddr_un addr;
+    socklen_t len;
+    pthread_t tid;
+
+    if ((handoffSockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || pipe(stopPipe) < 0) {
+        perror("server: can't open control socket");
+        exit(EXIT_FAILURE);
+    }
+
+    unlink(handoffName);
+    len = setSockAddrUn(handoffName, &addr);
+    if (bind(handoffSockfd, (struct sockaddr *) &addr, len) < 0 || listen(handoffSockfd, 1) < 0) {
+        perror("server: control socket bind error");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pthread_create(&tid, NULL, acceptHandoff, NULL) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(tid);
+}
+
 
 int main(int argc, char* argv[]) {
-    char *socketName;
+    char *socketName, handoffName[sizeof(server_addr.sun_path)];
+    int opt, takeover = 0, compress = 0, dedup = 0, fds[MAX_SHARDS], leaseMs = LEASE_DEFAULT_MS;
+    logLevel level = LOG_DEFAULT_LEVEL;
+
+    /* parse admission control and logging options */
+    while ((opt = getopt(argc, argv, "tmzds:q:r:l:v:")) != -1) {
+        switch (opt) {
+            case 't':
+                takeover = 1;
+                break;
+            case 'm':
+                memfdStorage = 1;
+                break;
+            case 'z':
+                compress = 1;
+                break;
+            case 'd':
+                dedup = 1;
+                break;
+            case 's':
+                numberShards = atoi(optarg);
+                break;
+            case 'q':
+                maxInFlight = atoi(optarg);
+                break;
+            case 'r':
+                maxClientRate = atoi(optarg);
+                break;
+            case 'l':
+                leaseMs = atoi(optarg);
+                break;
+            case 'v':
+                level = atoi(optarg);
+                break;
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
 
     /* Check arguments */
-    if (argc != 3) {
+    if (argc - optind != 2) {
         usage();
         exit(EXIT_FAILURE);
     }
 
     /* store possible arguments: numthreads */
-    numberThreads = atoi(argv[1]);
-    socketName = argv[2];
+    numberThreads = atoi(argv[optind]);
+    socketName = argv[optind + 1];
 
     /* check numberOfThreads argument */
     if (!(isdigit(numberThreads) || numberThreads > 0)) {
@@ -157,38 +1091,117 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
-        perror("server: can't open socket");
+    if (numberShards <= 0 || numberShards > MAX_SHARDS || numberShards > numberThreads) {
+        fprintf(stderr, "Error: numberOfShards must be between 1 and min(%d, numberOfThreads).\n", MAX_SHARDS);
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    if (maxInFlight <= 0 || maxClientRate < 0 || leaseMs < 0) {
+        fprintf(stderr, "Error: admission thresholds must be positive integers.\n");
+        usage();
         exit(EXIT_FAILURE);
     }
 
-	unlink(socketName);
-    addrlen = setSockAddrUn(socketName, &server_addr);
-	if (bind(sockfd, (struct sockaddr *) &server_addr, addrlen) < 0) {
-		perror("server: bind error");
-		exit(EXIT_FAILURE);
-	}
+    if (level < LOG_ERROR || level > LOG_DEBUG) {
+        fprintf(stderr, "Error: logLevel must be between %d and %d.\n", LOG_ERROR, LOG_DEBUG);
+        usage();
+        exit(EXIT_FAILURE);
+    }
+    log_init(level);
+    snprintf(commandFormat, sizeof(commandFormat), "%%c %%%ds %%%ds", MAX_INPUT_SIZE - 1, MAX_INPUT_SIZE - 1);
+    file_set_storage(memfdStorage, compress, dedup);
+
+    if (strlen(socketName) + strlen(HANDOFF_SUFFIX) >= sizeof(handoffName)) {
+        fprintf(stderr, "Error: socketName is too long.\n");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(handoffName, "%s%s", socketName, HANDOFF_SUFFIX);
+
+    if (takeover) {
+        /* the sockets stay bound, requests wait in them during the handoff */
+        int n = takeOver(handoffName, fds);
+        if (n == FAIL)
+            exit(EXIT_FAILURE);
+        if (n != numberShards) {
+            log_warn("Handoff: using the %d shards of the previous server\n", n);
+            numberShards = n;
+        }
+        /* every shard needs at least one worker */
+        if (numberThreads < numberShards)
+            numberThreads = numberShards;
+    } else {
+        for (int i = 0; i < numberShards; i++) {
+            char shardName[sizeof(server_addr.sun_path)];
+
+            if (i == 0)
+                strcpy(shardName, socketName);
+            else
+                sprintf(shardName, "%s.%d", socketName, i);
 
+            if ((fds[i] = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+                perror("server: can't open socket");
+                exit(EXIT_FAILURE);
+            }
+
+            unlink(shardName);
+            addrlen = setSockAddrUn(shardName, &server_addr);
+            if (bind(fds[i], (struct sockaddr *) &server_addr, addrlen) < 0) {
+                perror("server: bind error");
+                exit(EXIT_FAILURE);
+            }
+        }
 
-    /* init filesystem */
-    init_fs();    
+        /* init filesystem */
+        init_fs();
+    }
+
+    shards = malloc(sizeof(shard) * numberShards);
+    for (int i = 0; i < numberShards; i++) {
+        shards[i].sockfd = fds[i];
+        shards[i].requestQueue = malloc(sizeof(request) * maxInFlight);
+        shards[i].numberCommands = shards[i].headQueue = shards[i].insertIndex = 0;
+        pthread_mutex_init(&shards[i].commandsLock, NULL);
+        pthread_cond_init(&shards[i].fill, NULL);
+    }
+    pthread_mutex_init(&drainLock, NULL);
+    pthread_cond_init(&drained, NULL);
+    pthread_mutex_init(&ratesLock, NULL);
+    lease_init(shards[0].sockfd, leaseMs);
+    watch_init(shards[0].sockfd);
+    listenHandoff(handoffName);
 
     pthread_t tid[numberThreads];
-    /* create and assign thread pool to handleRequests */
+    /* create and assign thread pool to handleRequests, spread over the shards */
     for (int i = 0; i < numberThreads; i++) {
-        if (pthread_create(&tid[i], NULL, applyCommands, NULL) !=0) {
+        if (pthread_create(&tid[i], NULL, applyCommands, &shards[i % numberShards]) !=0) {
             exit(EXIT_FAILURE);
         } 
     }
 
+    for (int i = 0; i < numberShards; i++) {
+        if (pthread_create(&shards[i].receiverTid, NULL, receiveRequests, &shards[i]) != 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
     for (int i = 0; i < numberThreads; i++) {
         pthread_join(tid[i], NULL);
     }
 
-    close(sockfd);
-
     /* release allocated memory */
+    for (int i = 0; i < numberShards; i++) {
+        close(shards[i].sockfd);
+        free(shards[i].requestQueue);
+        pthread_mutex_destroy(&shards[i].commandsLock);
+        pthread_cond_destroy(&shards[i].fill);
+    }
+    free(shards);
     destroy_fs();
+    pthread_mutex_destroy(&drainLock);
+    pthread_cond_destroy(&drained);
+    pthread_mutex_destroy(&ratesLock);
+    log_destroy();
 
     exit(EXIT_SUCCESS);
 }
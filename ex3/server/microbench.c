@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include "fs/operations.h"
+#include "log.h"
+
+#define READ 1
+#define WRITE 0
+
+#define MAX_THREADS 16
+#define MAX_RESULTS 64
+/* directories of the path looked up by the lookup benchmark */
+#define LOOKUP_DEPTH 4
+
+/*
+ * State of a thread running a benchmark, set up and torn down outside the
+ * timed part
+ */
+typedef struct benchThread {
+	int id;
+	int threads; /* running the benchmark together */
+	int dir; /* directory of the thread */
+	int child; /* file every entry of dir refers to */
+	int inodes[INODE_TABLE_SIZE];
+	int count; /* i-nodes the thread may create at once */
+	long long ns; /* time spent in the timed part */
+	long long ops; /* operations it did */
+} benchThread;
+
+/*
+ * A primitive measured: setup and teardown run once per thread around the
+ * trials, run does at least ops operations, adding them to t->ops and the
+ * time of the timed part to t->ns, and leaves the state as it found it.
+ */
+typedef struct benchmark {
+	char *name;
+	void (*setup)(benchThread *t);
+	void (*run)(benchThread *t, int ops);
+	void (*teardown)(benchThread *t);
+} benchmark;
+
+/*
+ * ns/op of a benchmark over the trials
+ */
+typedef struct result {
+	char name[32];
+	int threads;
+	double mean;
+	double stddev;
+	double min;
+} result;
+
+int opsPerTrial = 100000;
+int warmupOps = 10000;
+int trials = 10;
+int threadCounts[MAX_THREADS] = { 1, 4 };
+int numberThreadCounts = 2;
+char *only = NULL;
+char *saveFile = NULL;
+char *baselineFile = NULL;
+
+static char lookupPath[MAX_FILE_NAME];
+static char entryNames[MAX_DIR_ENTRIES + 1][MAX_FILE_NAME];
+
+static pthread_barrier_t start, done;
+static int running = 1;
+
+
+static void displayUsage(const char* appName) {
+	printf("Usage: %s [-t threads,...] [-n ops] [-w warmup] [-r trials] [-f filter] [-s file] [-b file]\n", appName);
+	printf("  -t: thread counts each benchmark runs with (default 1,4)\n");
+	printf("  -n: operations of each thread in a trial (default %d)\n", opsPerTrial);
+	printf("  -w: operations of each thread before the trials (default %d)\n", warmupOps);
+	printf("  -r: trials (default %d)\n", trials);
+	printf("  -f: only run the benchmarks whose name contains this\n");
+	printf("  -s: save the results to a file, as a baseline\n");
+	printf("  -b: compare the results with a baseline saved with -s\n");
+	exit(EXIT_FAILURE);
+}
+
+static long long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Gives a thread its share of the free i-nodes, for the benchmarks
+ * creating and deleting them.
+ */
+static void share_inodes(benchThread *t) {
+	int used = 0;
+	nodeMeta meta;
+
+	for (int i = 0; i < INODE_TABLE_SIZE; i++)
+		used += inode_get_meta(i, &meta) == SUCCESS;
+	t->count = (INODE_TABLE_SIZE - used) / t->threads;
+	if (t->count == 0) {
+		fprintf(stderr, "Error: i-node table too small for %d threads\n", t->threads);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void create_inodes(benchThread *t) {
+	for (int i = 0; i < t->count; i++)
+		t->inodes[i] = inode_create(T_FILE);
+}
+
+static void delete_inodes(benchThread *t) {
+	for (int i = 0; i < t->count; i++) {
+		/* as operations delete them, under the lock of the i-node */
+		inode_lock(t->inodes[i], WRITE);
+		inode_delete(t->inodes[i]);
+		inode_unlock(t->inodes[i]);
+	}
+}
+
+static void run_create(benchThread *t, int ops) {
+	for (int done = 0; done < ops; done += t->count) {
+		long long begin = now_ns();
+
+		create_inodes(t);
+		t->ns += now_ns() - begin;
+		delete_inodes(t);
+	}
+	t->ops += (ops + t->count - 1) / t->count * t->count;
+}
+
+static void run_delete(benchThread *t, int ops) {
+	for (int done = 0; done < ops; done += t->count) {
+		long long begin;
+
+		create_inodes(t);
+		begin = now_ns();
+		delete_inodes(t);
+		t->ns += now_ns() - begin;
+	}
+	t->ops += (ops + t->count - 1) / t->count * t->count;
+}
+
+/*
+ * Gives a thread a directory of its own and a file for its entries.
+ */
+static void setup_dir(benchThread *t) {
+	t->dir = inode_create(T_DIRECTORY);
+	t->child = inode_create(T_FILE);
+	if (t->dir == FAIL || t->child == FAIL) {
+		fprintf(stderr, "Error: i-node table full\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void fill_dir(benchThread *t) {
+	for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+		dir_add_entry(t->dir, t->child, entryNames[i]);
+}
+
+static void empty_dir(benchThread *t) {
+	for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+		dir_reset_entry(t->dir, t->child);
+}
+
+static void teardown_dir(benchThread *t) {
+	inode_delete(t->child);
+	inode_delete(t->dir);
+}
+
+static void run_add_entry(benchThread *t, int ops) {
+	for (int done = 0; done < ops; done += MAX_DIR_ENTRIES) {
+		long long begin = now_ns();
+
+		fill_dir(t);
+		t->ns += now_ns() - begin;
+		empty_dir(t);
+	}
+	t->ops += (ops + MAX_DIR_ENTRIES - 1) / MAX_DIR_ENTRIES * MAX_DIR_ENTRIES;
+}
+
+static void run_reset_entry(benchThread *t, int ops) {
+	for (int done = 0; done < ops; done += MAX_DIR_ENTRIES) {
+		long long begin;
+
+		fill_dir(t);
+		begin = now_ns();
+		empty_dir(t);
+		t->ns += now_ns() - begin;
+	}
+	t->ops += (ops + MAX_DIR_ENTRIES - 1) / MAX_DIR_ENTRIES * MAX_DIR_ENTRIES;
+}
+
+static void setup_full_dir(benchThread *t) {
+	setup_dir(t);
+	fill_dir(t);
+}
+
+static void teardown_full_dir(benchThread *t) {
+	empty_dir(t);
+	teardown_dir(t);
+}
+
+/* every entry of a full directory in turn, and a name it doesn't have */
+static void run_lookup_sub_node(benchThread *t, int ops) {
+	union Data data;
+	long long begin;
+	volatile int found = 0;
+
+	inode_get(t->dir, NULL, &data);
+	begin = now_ns();
+	for (int i = 0; i < ops; i++)
+		found += lookup_sub_node(entryNames[i % (MAX_DIR_ENTRIES + 1)], data.dirEntries);
+	t->ns += now_ns() - begin;
+	t->ops += ops;
+}
+
+/* a path LOOKUP_DEPTH directories deep, shared by every thread */
+static void run_lookup(benchThread *t, int ops) {
+	int inodes_visited[INODE_TABLE_SIZE];
+	int num_inodes_visited;
+	long long begin = now_ns();
+
+	for (int i = 0; i < ops; i++) {
+		num_inodes_visited = 0;
+		lookup(lookupPath, inodes_visited, &num_inodes_visited, READ);
+		unlock_inodes(inodes_visited, num_inodes_visited);
+	}
+	t->ns += now_ns() - begin;
+	t->ops += ops;
+}
+
+static void no_setup(benchThread *t) {
+	(void) t;
+}
+
+benchmark benchmarks[] = {
+	{ "inode_create", share_inodes, run_create, no_setup },
+	{ "inode_delete", share_inodes, run_delete, no_setup },
+	{ "dir_add_entry", setup_dir, run_add_entry, teardown_dir },
+	{ "dir_reset_entry", setup_dir, run_reset_entry, teardown_dir },
+	{ "lookup_sub_node", setup_full_dir, run_lookup_sub_node, teardown_full_dir },
+	{ "lookup", no_setup, run_lookup, no_setup },
+};
+
+/*
+ * A thread of a benchmark: sets up, then runs the warmup and each trial
+ * when the main thread lets it, between two barriers.
+ */
+typedef struct benchArg {
+	benchmark *b;
+	benchThread t;
+	int ops; /* of the next round, 0 to stop */
+} benchArg;
+
+static int roundOps;
+
+static void *bench_thread(void *arg) {
+	benchArg *a = arg;
+
+	a->b->setup(&a->t);
+	pthread_barrier_wait(&done);
+	while (1) {
+		pthread_barrier_wait(&start);
+		if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+			break;
+		a->b->run(&a->t, roundOps);
+		pthread_barrier_wait(&done);
+	}
+	a->b->teardown(&a->t);
+	return NULL;
+}
+
+/*
+ * Runs a round on every thread.
+ * Returns: ns/op of the round, over the timed parts of every thread
+ */
+static double run_round(benchArg *args, int threads, int ops) {
+	long long ns = 0, count = 0;
+
+	roundOps = ops;
+	for (int i = 0; i < threads; i++)
+		args[i].t.ns = args[i].t.ops = 0;
+	pthread_barrier_wait(&start);
+	pthread_barrier_wait(&done);
+	for (int i = 0; i < threads; i++) {
+		ns += args[i].t.ns;
+		count += args[i].t.ops;
+	}
+	return (double) ns / count;
+}
+
+/*
+ * Runs a benchmark with a number of threads.
+ * Input:
+ *  - b: the benchmark
+ *  - threads: number of threads
+ *  - res: set to the ns/op over the trials
+ */
+static void run_benchmark(benchmark *b, int threads, result *res) {
+	benchArg args[MAX_THREADS];
+	pthread_t tid[MAX_THREADS];
+	double sum = 0, squares = 0;
+
+	pthread_barrier_init(&start, NULL, threads + 1);
+	pthread_barrier_init(&done, NULL, threads + 1);
+	running = 1;
+	for (int i = 0; i < threads; i++) {
+		args[i].b = b;
+		memset(&args[i].t, 0, sizeof(benchThread));
+		args[i].t.id = i;
+		args[i].t.threads = threads;
+		if (pthread_create(&tid[i], NULL, bench_thread, &args[i]) != 0) {
+			fprintf(stderr, "Error: can't create benchmark thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	/* every thread set up */
+	pthread_barrier_wait(&done);
+
+	if (warmupOps > 0)
+		run_round(args, threads, warmupOps);
+	res->min = INFINITY;
+	for (int i = 0; i < trials; i++) {
+		double ns = run_round(args, threads, opsPerTrial);
+
+		sum += ns;
+		squares += ns * ns;
+		if (ns < res->min)
+			res->min = ns;
+	}
+
+	__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+	pthread_barrier_wait(&start);
+	for (int i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
+	pthread_barrier_destroy(&start);
+	pthread_barrier_destroy(&done);
+
+	snprintf(res->name, sizeof(res->name), "%s", b->name);
+	res->threads = threads;
+	res->mean = sum / trials;
+	res->stddev = trials > 1 ? sqrt(fmax(0, (squares - sum * sum / trials) / (trials - 1))) : 0;
+}
+
+/*
+ * Reads the results saved in a baseline file.
+ * Returns: number of results, exits if the file can't be read
+ */
+static int read_baseline(char *path, result *results) {
+	FILE *f = fopen(path, "r");
+	char line[256];
+	int n = 0;
+
+	if (f == NULL) {
+		fprintf(stderr, "Error: cannot open baseline %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	while (n < MAX_RESULTS && fgets(line, sizeof(line), f)) {
+		result *r = &results[n];
+
+		if (line[0] != '#' && sscanf(line, "%31s %d %lf %lf %lf", r->name, &r->threads,
+			&r->mean, &r->stddev, &r->min) == 5)
+			n++;
+	}
+	fclose(f);
+	return n;
+}
+
+static result *find_result(result *results, int n, result *res) {
+	for (int i = 0; i < n; i++) {
+		if (strcmp(results[i].name, res->name) == 0 && results[i].threads == res->threads)
+			return &results[i];
+	}
+	return NULL;
+}
+
+/*
+ * Prints a result, with its change from the baseline if there is one.
+ * A change within twice the standard deviations of both is marked as noise.
+ */
+static void print_result(result *res, result *base) {
+	printf("%-16s %7d %10.1f %8.1f %10.1f", res->name, res->threads, res->mean, res->stddev, res->min);
+	if (base != NULL) {
+		double change = 100 * (res->mean - base->mean) / base->mean;
+		int noise = fabs(res->mean - base->mean) <= 2 * (res->stddev + base->stddev);
+
+		printf(" %10.1f %+7.1f%%%s", base->mean, change, noise ? " ~" : "");
+	}
+	printf("\n");
+}
+
+static void parse_threads(char *list) {
+	char *saveptr, *count = strtok_r(list, ",", &saveptr);
+
+	numberThreadCounts = 0;
+	for (; count != NULL; count = strtok_r(NULL, ",", &saveptr)) {
+		int threads = atoi(count);
+
+		if (threads <= 0 || threads > MAX_THREADS || numberThreadCounts == MAX_THREADS) {
+			fprintf(stderr, "Error: thread counts must be between 1 and %d\n", MAX_THREADS);
+			exit(EXIT_FAILURE);
+		}
+		threadCounts[numberThreadCounts++] = threads;
+	}
+}
+
+int main(int argc, char* argv[]) {
+	result results[MAX_RESULTS], baseline[MAX_RESULTS];
+	int opt, n = 0, numberBaseline = 0;
+	int inodes_visited[INODE_TABLE_SIZE], num_inodes_visited = 0;
+	FILE *save = NULL;
+
+	while ((opt = getopt(argc, argv, "t:n:w:r:f:s:b:")) != -1) {
+		switch (opt) {
+			case 't':
+				parse_threads(optarg);
+				break;
+			case 'n':
+				opsPerTrial = atoi(optarg);
+				break;
+			case 'w':
+				warmupOps = atoi(optarg);
+				break;
+			case 'r':
+				trials = atoi(optarg);
+				break;
+			case 'f':
+				only = optarg;
+				break;
+			case 's':
+				saveFile = optarg;
+				break;
+			case 'b':
+				baselineFile = optarg;
+				break;
+			default:
+				displayUsage(argv[0]);
+		}
+	}
+	if (optind != argc || opsPerTrial <= 0 || warmupOps < 0 || trials <= 0 || numberThreadCounts == 0)
+		displayUsage(argv[0]);
+
+	if (baselineFile)
+		numberBaseline = read_baseline(baselineFile, baseline);
+	if (saveFile && (save = fopen(saveFile, "w")) == NULL) {
+		fprintf(stderr, "Error: cannot open %s\n", saveFile);
+		exit(EXIT_FAILURE);
+	}
+
+	log_init(LOG_ERROR);
+	init_fs();
+
+	/* entry names, the last one never added */
+	for (int i = 0; i <= MAX_DIR_ENTRIES; i++)
+		sprintf(entryNames[i], "entry%d", i);
+	lookupPath[0] = '\0';
+	for (int i = 0; i < LOOKUP_DEPTH; i++) {
+		sprintf(lookupPath + strlen(lookupPath), "/d%d", i);
+		if (create(lookupPath, T_DIRECTORY) == FAIL) {
+			fprintf(stderr, "Error: can't create %s\n", lookupPath);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (lookup(lookupPath, inodes_visited, &num_inodes_visited, READ) == FAIL) {
+		fprintf(stderr, "Error: can't look up %s\n", lookupPath);
+		exit(EXIT_FAILURE);
+	}
+	unlock_inodes(inodes_visited, num_inodes_visited);
+
+	printf("%-16s %7s %10s %8s %10s", "primitive", "threads", "ns/op", "stddev", "min");
+	if (baselineFile)
+		printf(" %10s %8s", "baseline", "change");
+	printf("\n");
+	if (save)
+		fprintf(save, "# primitive threads ns/op stddev min, %d trials of %d ops\n", trials, opsPerTrial);
+
+	for (int i = 0; i < (int) (sizeof(benchmarks) / sizeof(benchmark)); i++) {
+		if (only && strstr(benchmarks[i].name, only) == NULL)
+			continue;
+		for (int j = 0; j < numberThreadCounts && n < MAX_RESULTS; j++, n++) {
+			run_benchmark(&benchmarks[i], threadCounts[j], &results[n]);
+			print_result(&results[n], find_result(baseline, numberBaseline, &results[n]));
+			if (save)
+				fprintf(save, "%s %d %.2f %.2f %.2f\n", results[n].name, results[n].threads,
+					results[n].mean, results[n].stddev, results[n].min);
+		}
+	}
+	printf("%d trials of %d ops per thread, after %d ops of warmup\n", trials, opsPerTrial, warmupOps);
+
+	if (save)
+		fclose(save);
+	destroy_fs();
+	log_destroy();
+	exit(EXIT_SUCCESS);
+}
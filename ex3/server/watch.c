@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "watch.h"
+#include "lease.h"
+#include "log.h"
+#include "../tecnicofs-api-constants.h"
+
+#define SUCCESS 0
+#define FAIL -1
+
+/*
+ * An event waiting to be sent
+ */
+typedef struct watchEvent {
+	char type; /* TFS_EVENT_*, 0 once coalesced away */
+	char path[MAX_FILE_NAME];
+} watchEvent;
+
+/*
+ * A path watched by a client, with the events not yet sent to it
+ */
+typedef struct watch {
+	int id; /* chosen by the client, 0 if the slot is free */
+	int recursive;
+	char path[MAX_FILE_NAME];
+	struct sockaddr_un client_addr;
+	socklen_t addrlen;
+	watchEvent queue[WATCH_QUEUE_SIZE];
+	int head, count;
+	int overflowed; /* events are dropped until the queue is sent */
+} watch;
+
+static watch watches[MAX_WATCHES];
+static int activeWatches = 0;
+static int queuedEvents = 0;
+static int pushSockfd = -1;
+static pthread_mutex_t watchesLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t eventsQueued = PTHREAD_COND_INITIALIZER;
+
+
+/*
+ * Checks if an event on a path concerns a watch: it is the watched path,
+ * an entry of it or, for a recursive watch, anything below it.
+ */
+static int watch_matches(watch *w, char *path) {
+	int len = strlen(w->path);
+
+	if (strncmp(path, w->path, len) != 0)
+		return 0;
+	if (path[len] == '\0')
+		return 1;
+	if (len > 0 && path[len] != '/')
+		return 0;
+	return w->recursive || strchr(path + len + (len > 0), '/') == NULL;
+}
+
+static int is_below(char *path, char *ancestor, int len) {
+	return strncmp(path, ancestor, len) == 0 && path[len] == '/';
+}
+
+/*
+ * Queues an event for a watch, coalescing it with the ones still queued:
+ * the same event as the last one on the path is dropped, and the removal
+ * of a node created since the queue was last sent takes away its creation
+ * and the events below it, as if it never existed.
+ */
+static void watch_queue(watch *w, char type, char *path) {
+	int len = strlen(path);
+	watchEvent *event;
+
+	for (int i = w->count - 1; i >= 0; i--) {
+		event = &w->queue[(w->head + i) % WATCH_QUEUE_SIZE];
+		if (event->type == 0 || strcmp(event->path, path) != 0)
+			continue;
+
+		if (event->type == type)
+			return;
+
+		if ((type == TFS_EVENT_DELETE || type == TFS_EVENT_MOVED_FROM) &&
+			(event->type == TFS_EVENT_CREATE || event->type == TFS_EVENT_MOVED_TO)) {
+			event->type = 0;
+			for (int j = i + 1; j < w->count; j++) {
+				watchEvent *below = &w->queue[(w->head + j) % WATCH_QUEUE_SIZE];
+				if (is_below(below->path, path, len))
+					below->type = 0;
+			}
+			return;
+		}
+		break;
+	}
+
+	if (w->overflowed)
+		return;
+
+	/* the last slot is kept for the overflow */
+	if (w->count == WATCH_QUEUE_SIZE - 1) {
+		log_info("watch: queue of watch %d is full\n", w->id);
+		type = TFS_EVENT_OVERFLOW;
+		path = w->path;
+		w->overflowed = 1;
+	}
+
+	event = &w->queue[(w->head + w->count++) % WATCH_QUEUE_SIZE];
+	event->type = type;
+	strcpy(event->path, path);
+	if (queuedEvents++ == 0)
+		pthread_cond_signal(&eventsQueued);
+}
+
+/*
+ * Frees the slot of a watch, dropping its queued events.
+ */
+static void watch_free(watch *w) {
+	queuedEvents -= w->count;
+	w->count = 0;
+	w->id = 0;
+	activeWatches--;
+}
+
+/*
+ * Sends the queued events of a watch, as many per datagram as fit. Pushes
+ * never block: if the client isn't draining its socket, the events stay
+ * queued and are sent again later. A client whose socket is gone loses
+ * its watch.
+ */
+static void watch_flush(watch *w) {
+	char buffer[sizeof(tfsReply) + TFS_MAX_REPLY_PAYLOAD];
+	tfsReply *push = (tfsReply *) buffer;
+
+	push->id = TFS_PUSH_ID;
+	push->status = TFS_PUSH_EVENTS;
+	push->lease = w->id;
+
+	while (w->count > 0) {
+		size_t len = sizeof(tfsReply);
+		int n;
+
+		for (n = 0; n < w->count; n++) {
+			watchEvent *event = &w->queue[(w->head + n) % WATCH_QUEUE_SIZE];
+			size_t pathLen = strlen(event->path);
+
+			if (event->type == 0)
+				continue;
+			if (len + pathLen + 2 > sizeof(buffer))
+				break;
+			buffer[len] = event->type;
+			memcpy(buffer + len + 1, event->path, pathLen + 1);
+			len += pathLen + 2;
+		}
+
+		if (len > sizeof(tfsReply) && sendto(pushSockfd, buffer, len, MSG_DONTWAIT,
+			(struct sockaddr *) &w->client_addr, w->addrlen) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+				return;
+			log_info("watch: client of watch %d is gone\n", w->id);
+			watch_free(w);
+			return;
+		}
+
+		/* the overflow is always the last event queued */
+		if (n == w->count)
+			w->overflowed = 0;
+		w->head = (w->head + n) % WATCH_QUEUE_SIZE;
+		w->count -= n;
+		queuedEvents -= n;
+	}
+}
+
+/*
+ * Sends the queued events, once they had WATCH_FLUSH_MS to be coalesced
+ * with the ones following them.
+ */
+static void *watch_flusher(void *arg) {
+	pthread_mutex_lock(&watchesLock);
+	while (1) {
+		while (queuedEvents == 0) {
+			pthread_cond_wait(&eventsQueued, &watchesLock);
+		}
+		pthread_mutex_unlock(&watchesLock);
+		usleep(WATCH_FLUSH_MS * 1000);
+		pthread_mutex_lock(&watchesLock);
+
+		for (int i = 0; i < MAX_WATCHES; i++) {
+			if (watches[i].id != 0 && watches[i].count > 0)
+				watch_flush(&watches[i]);
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * Sets where events are sent from and starts sending them.
+ * Input:
+ *  - sockfd: socket used to push events to clients
+ */
+void watch_init(int sockfd) {
+	pthread_t tid;
+
+	pushSockfd = sockfd;
+	if (pthread_create(&tid, NULL, watch_flusher, NULL) != 0) {
+		log_error("watch: can't create flusher thread\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(tid);
+}
+
+
+/*
+ * Watches a path for a client, which needn't exist yet. Watching again
+ * with the id of a watch of the client replaces it.
+ * Input:
+ *  - path: path watched
+ *  - recursive: if every node below path is watched, not only its entries
+ *  - id: id of the watch, chosen by the client
+ *  - client_addr, addrlen: address of the client
+ * Returns: SUCCESS or FAIL, if there are MAX_WATCHES already
+ */
+int watch_add(char *path, int recursive, int id, struct sockaddr_un *client_addr, socklen_t addrlen) {
+	watch *slot = NULL;
+
+	pthread_mutex_lock(&watchesLock);
+	for (int i = 0; i < MAX_WATCHES; i++) {
+		watch *w = &watches[i];
+
+		if (w->id != 0 && w->id == id && strcmp(w->client_addr.sun_path, client_addr->sun_path) == 0) {
+			watch_free(w);
+			slot = w;
+			break;
+		}
+		if (w->id == 0 && slot == NULL)
+			slot = w;
+	}
+
+	if (slot == NULL) {
+		pthread_mutex_unlock(&watchesLock);
+		return FAIL;
+	}
+
+	normalize_path(slot->path, path);
+	slot->recursive = recursive;
+	slot->client_addr = *client_addr;
+	slot->addrlen = addrlen;
+	slot->head = slot->count = slot->overflowed = 0;
+	slot->id = id;
+	activeWatches++;
+	pthread_mutex_unlock(&watchesLock);
+	return SUCCESS;
+}
+
+
+/*
+ * Cancels a watch of a client.
+ * Returns: SUCCESS or FAIL, if the client has no such watch
+ */
+int watch_remove(int id, struct sockaddr_un *client_addr) {
+	pthread_mutex_lock(&watchesLock);
+	for (int i = 0; i < MAX_WATCHES; i++) {
+		watch *w = &watches[i];
+
+		if (w->id != 0 && w->id == id && strcmp(w->client_addr.sun_path, client_addr->sun_path) == 0) {
+			watch_free(w);
+			pthread_mutex_unlock(&watchesLock);
+			return SUCCESS;
+		}
+	}
+	pthread_mutex_unlock(&watchesLock);
+	return FAIL;
+}
+
+
+/*
+ * Queues an event for the watches it concerns. Must be called before the
+ * change to the path is unlocked.
+ * Input:
+ *  - event: TFS_EVENT_CREATE, TFS_EVENT_DELETE, TFS_EVENT_MOVED_FROM or
+ *    TFS_EVENT_MOVED_TO
+ *  - path: path changed
+ */
+void watch_notify(char event, char *path) {
+	char key[MAX_FILE_NAME];
+
+	if (__atomic_load_n(&activeWatches, __ATOMIC_RELAXED) == 0)
+		return;
+
+	normalize_path(key, path);
+	pthread_mutex_lock(&watchesLock);
+	for (int i = 0; i < MAX_WATCHES; i++) {
+		if (watches[i].id != 0 && watch_matches(&watches[i], key))
+			watch_queue(&watches[i], event, key);
+	}
+	pthread_mutex_unlock(&watchesLock);
+}
+
+
+/*
+ * Writes the watches and their queued events to fd, for a handoff.
+ * Returns: SUCCESS or FAIL
+ */
+int watch_save(int fd) {
+	char *ptr = (char *) watches;
+	size_t len = sizeof(watches);
+
+	pthread_mutex_lock(&watchesLock);
+	while (len > 0) {
+		ssize_t n = write(fd, ptr, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			pthread_mutex_unlock(&watchesLock);
+			return FAIL;
+		}
+		ptr += n;
+		len -= n;
+	}
+	pthread_mutex_unlock(&watchesLock);
+	return SUCCESS;
+}
+
+
+/*
+ * Reads the watches written by watch_save, before watch_init.
+ * Returns: SUCCESS or FAIL
+ */
+int watch_restore(int fd) {
+	char *ptr = (char *) watches;
+	size_t len = sizeof(watches);
+
+	while (len > 0) {
+		ssize_t n = read(fd, ptr, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FAIL;
+		ptr += n;
+		len -= n;
+	}
+
+	activeWatches = queuedEvents = 0;
+	for (int i = 0; i < MAX_WATCHES; i++) {
+		if (watches[i].id != 0) {
+			activeWatches++;
+			queuedEvents += watches[i].count;
+		}
+	}
+	return SUCCESS;
+}
@@ -0,0 +1,30 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Watches on paths.
+ * A client watching a path is pushed the creates, deletes and moves of the
+ * path and of the entries below it, instead of polling with lookups.
+ * Events are queued per watch while the change is still locked, so each
+ * watch gets the events of a path in the order they happened, and a
+ * background thread sends the queues a few at a time. Queues are bounded:
+ * once one is full its events are lost until it drains, which the watcher
+ * is told with TFS_EVENT_OVERFLOW.
+ */
+
+#define MAX_WATCHES 128
+#define WATCH_QUEUE_SIZE 64
+/* milliseconds events wait to be coalesced with the ones following them */
+#define WATCH_FLUSH_MS 2
+
+void watch_init(int sockfd);
+int watch_add(char *path, int recursive, int id, struct sockaddr_un *client_addr, socklen_t addrlen);
+int watch_remove(int id, struct sockaddr_un *client_addr);
+void watch_notify(char event, char *path);
+int watch_save(int fd);
+int watch_restore(int fd);
+
+#endif /* WATCH_H */
@@ -9,6 +9,181 @@
 typedef enum permission { NONE, WRITE, READ, RW } permission;
 typedef enum type { T_FILE, T_DIRECTORY, T_NONE } type;
 
+/*
+ * Datagram sent to the server: a request id chosen by the client and the
+ * command in text, e.g. "c /a d"
+ */
+typedef struct tfsRequest {
+	int id;
+	char command[MAX_INPUT_SIZE];
+} tfsRequest;
+
+/*
+ * A batch is a tfsRequest with the command "b <count>", sent whole, followed
+ * by count commands, each terminated by '\0'. The status of the reply is
+ * the number of commands applied and is followed by their statuses, an int
+ * each.
+ */
+#define TFS_BATCH_COMMAND 'b'
+#define TFS_MAX_BATCH 256
+#define TFS_MAX_BATCH_SIZE (sizeof(tfsRequest) + TFS_MAX_BATCH * MAX_INPUT_SIZE)
+
+/* most bytes following a tfsReply */
+#define TFS_MAX_REPLY_PAYLOAD 4096
+
+/*
+ * An entry of a directory listing
+ */
+typedef struct tfsDirEntry {
+	int inumber;
+	int type;
+	char name[MAX_FILE_NAME];
+} tfsDirEntry;
+
+/*
+ * A listing is read in chunks with "r <path> <cursor>", starting at cursor
+ * 0. The status of the reply is the number of entries in the chunk, up to
+ * TFS_READDIR_CHUNK, and is followed by the cursor of the next chunk, an
+ * int, TFS_CURSOR_END after the last one, and then the entries.
+ */
+#define TFS_READDIR_CHUNK 16
+#define TFS_CURSOR_END -1
+
+/*
+ * Metadata of a node, sent back by "s <path>": size is the length of the
+ * contents of a file or the number of entries of a directory, stored the
+ * bytes of memory the contents of a file take, fewer than their length if
+ * they are compressed or have holes, ctime and mtime the creation of the
+ * node and the last change to its contents, in nanoseconds since the epoch
+ */
+typedef struct tfsNodeStat {
+	int inumber;
+	int type;
+	int size;
+	int stored;
+	long long ctime;
+	long long mtime;
+} tfsNodeStat;
+
+/*
+ * A bulk stat is a tfsRequest with the command "S <count>", sent whole,
+ * followed by count paths, each terminated by '\0'. The status of the
+ * reply is the number of paths and is followed by a tfsNodeStat for each,
+ * with inumber FAIL, type T_NONE and the rest zero if the path doesn't
+ * exist or isn't shorter than MAX_FILE_NAME.
+ */
+#define TFS_BULK_STAT_COMMAND 'S'
+/* as many as fit in TFS_MAX_REPLY_PAYLOAD */
+#define TFS_MAX_STAT 128
+
+/*
+ * Datagram sent back by the server, with the id of the request it answers
+ */
+typedef struct tfsReply {
+	int id;
+	int status;
+	int lease; /* lookups: milliseconds the client may keep the result */
+} tfsReply;
+
+/*
+ * Replies too long for a datagram are streamed: every datagram but the
+ * last has the status TFS_STREAM_MORE, the last one the status of the
+ * request, and each is followed by part of the data.
+ */
+#define TFS_STREAM_MORE -100
+
+/*
+ * "F <path> <pattern>" finds the nodes below path whose name matches the
+ * glob pattern. The matches are streamed back as paths, each terminated by
+ * '\0', and the final status is their number.
+ */
+#define TFS_FIND_COMMAND 'F'
+
+/*
+ * "E <path> <format>" exports the tree below path, streamed back in
+ * preorder. With format 't' it is the lines tecnicofs prints, with format
+ * 'b' a record per node: its type and the length of its name in a byte
+ * each, the name, without '\0', and for a directory the number of its
+ * children in a byte, whose records follow. The final status is the
+ * number of nodes.
+ */
+#define TFS_EXPORT_COMMAND 'E'
+
+/*
+ * "w <path> <len>" replaces the contents of a file with len bytes. The
+ * tfsRequest is sent whole, followed by the bytes when they fit in
+ * TFS_MAX_WRITE_INLINE, or else alone with a memfd holding them attached
+ * (SCM_RIGHTS). A server keeping contents in memfds seals it and keeps it
+ * as the contents of the file, without copying them.
+ * "w <path> <len> <offset>" writes the len bytes at offset instead, growing
+ * the file if they end past it and leaving a hole if they start past it.
+ * Only the blocks they fall in change.
+ */
+#define TFS_WRITE_COMMAND 'w'
+#define TFS_MAX_WRITE_INLINE (TFS_MAX_BATCH_SIZE - sizeof(tfsRequest))
+/* offset of a write at the end of the file */
+#define TFS_APPEND -1
+
+/*
+ * "R <path>" reads the contents of a file, the status of the reply is
+ * their length. A server keeping contents in memfds attaches the sealed
+ * memfd of the file to the reply, which the client maps read-only, and
+ * otherwise streams the contents back.
+ * "R <path> <offset> <len>" streams back at most len bytes from offset,
+ * holes as zeros, the status being the number of bytes read.
+ */
+#define TFS_READ_COMMAND 'R'
+
+/*
+ * "u" gets the totals of the blocks of files on a server, a tfsUsageStat
+ * following the status: the bytes they hold and the ones they take,
+ * compressed, so that used / stored is the compression ratio, how many
+ * reads of compressed blocks the cache of decompressed blocks served, and
+ * the distinct blocks in the pool of deduplicated blocks and the references
+ * to them, so that poolRefs / poolBlocks is the deduplication ratio.
+ */
+#define TFS_USAGE_COMMAND 'u'
+
+typedef struct tfsUsageStat {
+	long long used;
+	long long stored;
+	long long cacheHits;
+	long long cacheMisses;
+	long long poolBlocks;
+	long long poolRefs;
+} tfsUsageStat;
+
+/*
+ * Datagrams pushed by the server have this id instead of a request id,
+ * their status tells what they are
+ */
+#define TFS_PUSH_ID 0
+/* followed by a path: leases on it and on paths below it are revoked */
+#define TFS_PUSH_INVALIDATE 1
+/*
+ * Events of a watch, whose id is in the lease field, followed by records:
+ * the type of an event in a byte and the path it happened to, terminated
+ * by '\0'
+ */
+#define TFS_PUSH_EVENTS 2
+
+/*
+ * "W <path> <r|n> <watch>" watches path and the entries of the directory
+ * at path, with 'r' every node below it too, under an id chosen by the
+ * client, "U <watch>" cancels the watch. Events still queued when another
+ * one comes are coalesced: the same event again is dropped, and a node
+ * created and deleted meanwhile isn't reported at all.
+ */
+#define TFS_WATCH_COMMAND 'W'
+#define TFS_UNWATCH_COMMAND 'U'
+
+#define TFS_EVENT_CREATE 'c'
+#define TFS_EVENT_DELETE 'd'
+#define TFS_EVENT_MOVED_FROM 'f'
+#define TFS_EVENT_MOVED_TO 't'
+/* the queue of the watch filled up and events were lost at this point, with the path of the watch */
+#define TFS_EVENT_OVERFLOW 'o'
+
 /* Client already has an open session with a TecnicoFS server */
 #define TECNICOFS_ERROR_OPEN_SESSION -1
 /* Doesn't exist an open session */
@@ -31,5 +206,9 @@ typedef enum type { T_FILE, T_DIRECTORY, T_NONE } type;
 #define TECNICOFS_ERROR_INVALID_MODE -10
 /* Generic error */
 #define TECNICOFS_ERROR_OTHER -11
+/* Server is overloaded and rejected the request, try again later */
+#define TECNICOFS_ERROR_SERVER_BUSY -12
+/* Move between subtrees owned by different servers of a mount */
+#define TECNICOFS_ERROR_CROSS_SHARD -13
 
 #endif /* TECNICOFS_API_CONSTANTS_H */
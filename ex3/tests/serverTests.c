@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../tecnicofs-api-constants.h"
+
+#define MAX_WATCH_ID 64
+
+/*
+ * Regression tests of a running server, sending raw datagrams so that they
+ * can build requests the client API never sends.
+ */
+
+int sockfd;
+struct sockaddr_un serverAddr, clientAddr;
+int nextId = 1;
+/* pushed events received, by watch id */
+int events[MAX_WATCH_ID];
+
+static void displayUsage(const char* appName) {
+	printf("Usage: %s server_socket_name\n", appName);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Receives a datagram, counting it if it is a push of events.
+ * Returns: bytes received, or -1 after a timeout
+ */
+static int receive(char *reply, int size) {
+	tfsReply *header = (tfsReply *) reply;
+	int n = recv(sockfd, reply, size, 0);
+
+	if (n >= (int) sizeof(tfsReply) && header->id == TFS_PUSH_ID && header->status == TFS_PUSH_EVENTS &&
+		header->lease >= 0 && header->lease < MAX_WATCH_ID)
+		events[header->lease]++;
+	return n < (int) sizeof(tfsReply) ? -1 : n;
+}
+
+/*
+ * Sends a request and waits for its reply, counting pushed events.
+ * Input:
+ *  - command: command of the request
+ *  - payload, payloadLen: bytes following the tfsRequest, NULL for none
+ *  - results, resultsLen: buffer for the bytes following the tfsReply
+ * Returns: status of the reply, exits if there is none
+ */
+static int request(char *command, char *payload, int payloadLen, void *results, int resultsLen) {
+	char *buffer = malloc(sizeof(tfsRequest) + payloadLen), reply[sizeof(tfsReply) + TFS_MAX_REPLY_PAYLOAD];
+	tfsRequest *message = (tfsRequest *) buffer;
+	int id = nextId++, n;
+
+	memset(message, 0, sizeof(tfsRequest));
+	message->id = id;
+	snprintf(message->command, sizeof(message->command), "%s", command);
+	if (payload)
+		memcpy(buffer + sizeof(tfsRequest), payload, payloadLen);
+	if (sendto(sockfd, buffer, payload ? sizeof(tfsRequest) + payloadLen : sizeof(message->id) + strlen(command) + 1,
+		0, (struct sockaddr *) &serverAddr, sizeof(serverAddr)) < 0) {
+		perror("Error: can't send request");
+		exit(EXIT_FAILURE);
+	}
+	free(buffer);
+
+	do {
+		if ((n = receive(reply, sizeof(reply))) < 0) {
+			fprintf(stderr, "Error: no reply to %s, the server is gone\n", command);
+			exit(EXIT_FAILURE);
+		}
+	} while (((tfsReply *) reply)->id != id);
+
+	if (results)
+		memcpy(results, reply + sizeof(tfsReply), n - sizeof(tfsReply) < resultsLen ? n - sizeof(tfsReply) : resultsLen);
+	return ((tfsReply *) reply)->status;
+}
+
+/* a command of a batch longer than MAX_INPUT_SIZE is rejected, not parsed */
+static int testOversizedBatchCommand() {
+	int len = 5000, results[1] = { 0 }, status;
+	char *command = malloc(len + 1);
+
+	memset(command, 'A', len);
+	memcpy(command, "c /", 3);
+	memcpy(command + len - 2, " d", 2);
+	command[len] = '\0';
+	status = request("b 1", command, len + 1, results, sizeof(results));
+	free(command);
+	return status == 1 && results[0] == TECNICOFS_ERROR_OTHER && request("l /", NULL, 0, NULL, 0) >= 0;
+}
+
+/* a bulk stat path too long for the server isn't truncated to a prefix that exists */
+static int testLongBulkStatPath() {
+	char paths[2 + 1 + 2 + 2 * MAX_FILE_NAME + 3 + 1];
+	tfsNodeStat stats[2];
+	int len = 3, ok;
+
+	strcpy(paths, "/t");
+	len += sprintf(paths + len, "/t");
+	memset(paths + len, '/', 2 * MAX_FILE_NAME);
+	len += 2 * MAX_FILE_NAME;
+	strcpy(paths + len, "zzz");
+	len += 4;
+
+	memset(stats, 0xff, sizeof(stats));
+	ok = request("c /t d", NULL, 0, NULL, 0) == 0 && request("S 2", paths, len, stats, sizeof(stats)) == 2;
+	ok = ok && stats[0].inumber >= 0 && stats[1].inumber < 0 && stats[1].type == T_NONE && stats[1].size == 0 &&
+		stats[1].stored == 0 && stats[1].ctime == 0 && stats[1].mtime == 0;
+	request("d /t", NULL, 0, NULL, 0);
+	return ok;
+}
+
+/*
+ * Lists the names of the entries of a directory, in the order of their slots.
+ * Returns: number of entries, or -1
+ */
+static int listNames(char *path, char names[][MAX_FILE_NAME]) {
+	char command[MAX_INPUT_SIZE], reply[sizeof(int) + TFS_READDIR_CHUNK * sizeof(tfsDirEntry)];
+	tfsDirEntry *entries = (tfsDirEntry *) (reply + sizeof(int));
+	int n;
+
+	snprintf(command, sizeof(command), "r %s 0", path);
+	if ((n = request(command, NULL, 0, reply, sizeof(reply))) < 0)
+		return -1;
+	for (int i = 0; i < n; i++)
+		strcpy(names[i], entries[i].name);
+	return n;
+}
+
+/* writing below a clone keeps the entries along the path in their slots */
+static int testUnshareKeepsSlots() {
+	char before[TFS_READDIR_CHUNK][MAX_FILE_NAME], after[TFS_READDIR_CHUNK][MAX_FILE_NAME];
+	char *setup[] = { "c /p d", "c /p/a f", "c /p/c f", "c /p/b d", "d /p/a", "C /p /q" };
+	int ok = 1, n;
+
+	for (int i = 0; i < (int) (sizeof(setup) / sizeof(setup[0])); i++)
+		ok = ok && request(setup[i], NULL, 0, NULL, 0) == 0;
+	n = listNames("/p", before);
+	/* unshares /p and then /p/b, which must stay after /p/c rather than take the slot of /p/a */
+	ok = ok && n == 2 && request("c /p/b/x f", NULL, 0, NULL, 0) == 0 && listNames("/p", after) == n;
+	for (int i = 0; ok && i < n; i++)
+		ok = strcmp(before[i], after[i]) == 0;
+	request("D /p", NULL, 0, NULL, 0);
+	request("D /q", NULL, 0, NULL, 0);
+	return ok;
+}
+
+/*
+ * Waits for the server to push events of a watch.
+ * Returns: 1 if it did, 0 after a timeout
+ */
+static int waitEvents(int watch) {
+	char reply[sizeof(tfsReply) + TFS_MAX_REPLY_PAYLOAD];
+
+	while (events[watch] == 0) {
+		if (receive(reply, sizeof(reply)) < 0)
+			return 0;
+	}
+	events[watch] = 0;
+	return 1;
+}
+
+/* unwatching a watch id that isn't a positive number leaves live watches alone */
+static int testUnwatchInvalidId() {
+	int ok = request("W / n 1", NULL, 0, NULL, 0) == 0 && request("W / n 2", NULL, 0, NULL, 0) == 0 &&
+		request("U 1", NULL, 0, NULL, 0) == 0;
+
+	ok = ok && request("U 0", NULL, 0, NULL, 0) < 0 && request("U x", NULL, 0, NULL, 0) < 0;
+	ok = ok && request("c /watched f", NULL, 0, NULL, 0) == 0 && waitEvents(2);
+	request("d /watched", NULL, 0, NULL, 0);
+	return request("U 2", NULL, 0, NULL, 0) == 0 && ok;
+}
+
+struct {
+	char *name;
+	int (*run)();
+} tests[] = {
+	{ "oversized batch command", testOversizedBatchCommand },
+	{ "unwatch invalid id", testUnwatchInvalidId },
+	{ "long bulk stat path", testLongBulkStatPath },
+	{ "unshare keeps slots", testUnshareKeepsSlots },
+};
+
+int main(int argc, char* argv[]) {
+	struct timeval timeout = { 5, 0 };
+	int failed = 0;
+
+	if (argc != 2 || strlen(argv[1]) >= sizeof(serverAddr.sun_path))
+		displayUsage(argv[0]);
+
+	serverAddr.sun_family = AF_UNIX;
+	strcpy(serverAddr.sun_path, argv[1]);
+	clientAddr.sun_family = AF_UNIX;
+	snprintf(clientAddr.sun_path, sizeof(clientAddr.sun_path), "/tmp/tecnicofs-tests-%d", getpid());
+	unlink(clientAddr.sun_path);
+	if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0 ||
+		bind(sockfd, (struct sockaddr *) &clientAddr, sizeof(clientAddr)) < 0 ||
+		setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+		perror("Error: can't open client socket");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < (int) (sizeof(tests) / sizeof(tests[0])); i++) {
+		int ok = tests[i].run();
+
+		printf("%s: %s\n", ok ? "PASS" : "FAIL", tests[i].name);
+		failed += !ok;
+	}
+
+	close(sockfd);
+	unlink(clientAddr.sun_path);
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}